@@ -33,7 +33,7 @@
 #include "util.h"
 #include "rr_logging.h"
 #include "rr_dict.h"
-#include "rr_minheap.h"
+#include "rr_heapq.h"
 #include "rr_fts.h"
 #include "rr_rhino_rox.h"
 #include "rr_server.h"
@@ -107,13 +107,6 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     return o;
 }
 
-/* Create a string object with EMBSTR encoding if it is smaller than
- * REIDS_ENCODING_EMBSTR_SIZE_LIMIT, otherwise the RAW encoding is
- * used.
- *
- * The current limit of 39 is chosen so that the biggest string object
- * we allocate as EMBSTR will still fit into the 64 byte arena of jemalloc. */
-#define OBJ_ENCODING_EMBSTR_SIZE_LIMIT 44
 robj *createStringObject(const char *ptr, size_t len) {
     if (len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT)
         return createEmbeddedStringObject(ptr,len);
@@ -121,6 +114,67 @@ robj *createStringObject(const char *ptr, size_t len) {
         return createRawStringObject(ptr,len);
 }
 
+/* Like createStringObject(), but small strings reuse the EMBSTR objects of
+ * the pool when there are some of the right size. */
+robj *createStringObjectFromPool(objectPool *pool, const char *ptr, size_t len) {
+    struct sdshdr8 *sh;
+    size_t alloc;
+    robj *o;
+    int class;
+
+    if (len > OBJ_ENCODING_EMBSTR_SIZE_LIMIT)
+        return createRawStringObject(ptr,len);
+
+    class = OBJ_POOL_CLASS(len);
+    if (pool->len[class]) {
+        o = pool->objs[class][--pool->len[class]];
+        sh = (void*)(o+1);
+    } else {
+        alloc = OBJ_EMBSTR_CHUNK_SIZE(len)-sizeof(robj)-sizeof(struct sdshdr8)-1;
+        o = rr_malloc(sizeof(robj)+sizeof(struct sdshdr8)+alloc+1);
+        sh = (void*)(o+1);
+        o->type = OBJ_STRING;
+        o->encoding = OBJ_ENCODING_EMBSTR;
+        o->ptr = sh+1;
+        o->refcount = 1;
+        sh->alloc = alloc;
+        sh->flags = SDS_TYPE_8;
+    }
+    sh->len = len;
+    memcpy(sh->buf,ptr,len);
+    sh->buf[len] = '\0';
+    return o;
+}
+
+/* Release an object created by createStringObjectFromPool(). It goes back to
+ * the pool unless it is referenced somewhere else, or was turned into another
+ * encoding. */
+void releaseObjectToPool(objectPool *pool, robj *o) {
+    int class;
+
+    if (o->encoding == OBJ_ENCODING_EMBSTR &&
+        __atomic_load_n(&o->refcount, __ATOMIC_RELAXED) == 1 &&
+        sdsalloc(o->ptr) == OBJ_EMBSTR_CHUNK_SIZE(sdslen(o->ptr)) -
+                           sizeof(robj)-sizeof(struct sdshdr8)-1)
+    {
+        class = OBJ_POOL_CLASS(sdslen(o->ptr));
+        if (pool->len[class] < OBJ_POOL_CLASS_LEN) {
+            pool->objs[class][pool->len[class]++] = o;
+            return;
+        }
+    }
+    decrRefCount(o);
+}
+
+void emptyObjectPool(objectPool *pool) {
+    int class;
+
+    for (class = 0; class < OBJ_POOL_CLASSES; class++) {
+        while (pool->len[class])
+            rr_free(pool->objs[class][--pool->len[class]]);
+    }
+}
+
 robj *createStringObjectFromLongLong(long long value) {
     robj *o;
     if (value >= 0 && value < OBJ_SHARED_INTEGERS) {
@@ -188,35 +242,8 @@ robj *createHashObject(void) {
     return o;
 }
 
-/* minheap callbacks - copy, compare, swap */
-static inline void *hq_cpy(void *dst, const void *src) {
-    *(hq_item_t *) dst = *(hq_item_t *) src;
-    return dst;
-}
-
-static inline int hq_cmp(const void *lv, const void *rv) {
-    const hq_item_t *l = (const hq_item_t *) lv;
-    const hq_item_t *r = (const hq_item_t *) rv;
-
-    if (l->score < r->score)
-        return -1;
-    else if (l->score > r->score)
-        return 1;
-    else
-        return 0;
-}
-
-static inline void hq_swp(void *lv, void *rv) {
-    hq_item_t tmp;
-
-    tmp = *(hq_item_t *) lv;
-    *(hq_item_t *) lv = *(hq_item_t *) rv;
-    *(hq_item_t *) rv = tmp;
-}
-
 robj *createHeapqObject(void) {
-    minheap_t *hq = minheap_create(8, sizeof(hq_item_t), hq_cmp, hq_cpy, hq_swp);
-    minheap_set_freecb(hq, rr_obj_free_callback);
+    heapq_t *hq = heapq_create();
     robj *o = createObject(OBJ_HEAPQ, hq);
     o->encoding = OBJ_ENCODING_HEAPQ;
     return o;
@@ -262,19 +289,27 @@ void freeHashObject(robj *o) {
 }
 
 void freeHeapqObject(robj *o) {
-    minheap_free((minheap_t *) o->ptr);
+    heapq_free((heapq_t *) o->ptr);
 }
 
 void freeFTSObject(robj *o) {
     fts_free((fts_t *) o->ptr);
 }
 
+/* The reply lists keep references to large values, which may be released by
+ * the I/O threads, other reactors or the lazy free thread, so the refcount
+ * is updated atomically. Shared objects are never touched. */
 void incrRefCount(robj *o) {
-    if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount++;
+    if (__atomic_load_n(&o->refcount, __ATOMIC_RELAXED) != OBJ_SHARED_REFCOUNT)
+        __atomic_add_fetch(&o->refcount, 1, __ATOMIC_RELAXED);
 }
 
 void decrRefCount(robj *o) {
-    if (o->refcount == 1) {
+    int refcount;
+
+    if (__atomic_load_n(&o->refcount, __ATOMIC_RELAXED) == OBJ_SHARED_REFCOUNT) return;
+    refcount = __atomic_sub_fetch(&o->refcount, 1, __ATOMIC_ACQ_REL);
+    if (refcount == 0) {
         switch(o->type) {
         case OBJ_STRING: freeStringObject(o); break;
         case OBJ_HASH: freeHashObject(o); break;
@@ -283,9 +318,8 @@ void decrRefCount(robj *o) {
         default: rr_log(RR_LOG_ERROR, "Unknown object type"); break;
         }
         rr_free(o);
-    } else {
-        if (o->refcount <= 0) rr_log(RR_LOG_ERROR, "decrRefCount against refcount <= 0");
-        if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount--;
+    } else if (refcount < 0) {
+        rr_log(RR_LOG_ERROR, "decrRefCount against refcount <= 0");
     }
 }
 
@@ -674,7 +708,7 @@ void createSharedObjects(void) {
     shared.emptymultibulk = createObject(OBJ_STRING,sdsnew("*0\r\n"));
     shared.pong = createObject(OBJ_STRING,sdsnew("+PONG\r\n"));
     shared.queued = createObject(OBJ_STRING,sdsnew("+QUEUED\r\n"));
-    shared.emptyscan = createObject(OBJ_STRING,sdsnew("*2\r\n$1\r\n0\r\n*0\r\n"));
+    shared.emptyscan = createObject(OBJ_STRING,sdsnew("*2\r\n$0\r\n\r\n*0\r\n"));
     shared.wrongtypeerr = createObject(OBJ_STRING,sdsnew(
         "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n"));
     shared.nokeyerr = createObject(OBJ_STRING,sdsnew(
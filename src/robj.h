@@ -62,6 +62,30 @@ typedef struct redisObject {
     void *ptr;
 } robj;
 
+/* Create a string object with EMBSTR encoding if it is smaller than
+ * OBJ_ENCODING_EMBSTR_SIZE_LIMIT, otherwise the RAW encoding is used.
+ *
+ * The current limit of 44 is chosen so that the biggest string object
+ * we allocate as EMBSTR will still fit into the 64 byte arena of jemalloc. */
+#define OBJ_ENCODING_EMBSTR_SIZE_LIMIT 44
+
+/* The size of the chunk allocated for an EMBSTR object of len bytes. Small
+ * allocations are rounded up to 16 bytes anyway, so the string of a pooled
+ * object is given the whole chunk, and the object can be reused for any
+ * string of the same chunk size. */
+#define OBJ_EMBSTR_CHUNK_SIZE(len) \
+    ((sizeof(robj)+sizeof(struct sdshdr8)+(len)+1+15) & ~(size_t)15)
+#define OBJ_POOL_CLASS(len) ((int) (OBJ_EMBSTR_CHUNK_SIZE(len)/16 - 2))
+#define OBJ_POOL_CLASSES (OBJ_POOL_CLASS(OBJ_ENCODING_EMBSTR_SIZE_LIMIT)+1)
+#define OBJ_POOL_CLASS_LEN 16
+
+/* EMBSTR objects kept for reuse by their chunk size, which saves the
+ * allocations of the arguments parsed for every command */
+typedef struct objectPool {
+    int len[OBJ_POOL_CLASSES];
+    robj *objs[OBJ_POOL_CLASSES][OBJ_POOL_CLASS_LEN];
+} objectPool;
+
 #define OBJ_SHARED_INTEGERS 10000
 #define OBJ_SHARED_BULKHDR_LEN 32
 #define PROTO_SHARED_SELECT_CMDS 10
@@ -77,11 +101,6 @@ typedef struct redisObject {
     _var.ptr = _ptr; \
 } while(0);
 
-typedef struct hq_item_t {
-    double score;
-    robj *obj;
-} hq_item_t;
-
 struct sharedObjectsStruct {
     robj *crlf, *ok, *err, *emptybulk, *czero, *cone, *cnegone, *pong, *space,
     *colon, *nullbulk, *nullmultibulk, *queued,
@@ -115,6 +134,9 @@ robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
 robj *dupStringObject(robj *o);
+robj *createStringObjectFromPool(objectPool *pool, const char *ptr, size_t len);
+void releaseObjectToPool(objectPool *pool, robj *o);
+void emptyObjectPool(objectPool *pool);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
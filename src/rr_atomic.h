@@ -14,22 +14,23 @@
 
 #else
 
+/* ptr and mutex are pointers, as with the builtins */
 #define ATOM_INC(ptr,n,mutex) do { \
-    pthread_mutex_lock(&mutex);    \
-    ptr += (n);                    \
-    pthread_mutex_unlock(&mutex);  \
+    pthread_mutex_lock(mutex);     \
+    *(ptr) += (n);                 \
+    pthread_mutex_unlock(mutex);   \
 } while (0)
 
 #define ATOM_DEC(ptr,n,mutex) do { \
-    pthread_mutex_lock(&mutex);    \
-    ptr -= (n);                    \
-    pthread_mutex_unlock(&mutex);  \
+    pthread_mutex_lock(mutex);     \
+    *(ptr) -= (n);                 \
+    pthread_mutex_unlock(mutex);   \
 } while (0)
 
 #define ATOM_GET(ptr,dst,mutex) do { \
-    pthread_mutex_lock(&mutex);      \
-    dst = ptr;                       \
-    pthread_mutex_unlock(&mutex);    \
+    pthread_mutex_lock(mutex);       \
+    dst = *(ptr);                    \
+    pthread_mutex_unlock(mutex);     \
 } while (0)
 #endif
 
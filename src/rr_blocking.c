@@ -0,0 +1,152 @@
+/*
+ * Blocking operations, BQPOP and the steps of QMERGE for now.
+ *
+ * A blocked client is kept in a list per key in db->blocking_keys. Commands
+ * adding items to a key call rr_db_signal_key_ready, which queues the key
+ * in server.ready_keys if anyone is waiting on it. Once the command is done,
+ * the server serves the waiters of the ready keys in the order they blocked,
+ * one item each, as long as there are items left.
+ *
+ * A client running a QMERGE is blocked on no key, the merge unblocks it once
+ * its last step is done. So is a client waiting for the commands other
+ * reactors run for it, see rr_reactor.c.
+ */
+#include "rr_blocking.h"
+#include "rr_cmd_heapq.h"
+#include "rr_reactor.h"
+#include "rr_rhino_rox.h"
+#include "rr_malloc.h"
+#include "rr_db.h"
+#include "adlist.h"
+
+#include <assert.h>
+
+/* A key that has been signaled as ready */
+typedef struct ready_key_t {
+    rrdb_t *db;
+    robj *key;
+} ready_key_t;
+
+static int block_timeout_fired(eventloop_t *el, void *ud) {
+    rr_client_t *c = ud;
+    UNUSED(el);
+
+    /* The timer is removed once it returns */
+    c->bpop.timeout = NULL;
+    reply_add_obj(c, shared.nullmultibulk);
+    rr_client_unblock(c);
+    return 0;
+}
+
+void rr_client_block(rr_client_t *c, robj **keys, int numkeys, long long timeout) {
+    int i;
+
+    c->bpop.keys = numkeys ? rr_malloc(sizeof(robj *) * numkeys) : NULL;
+    c->bpop.numkeys = numkeys;
+    for (i = 0; i < numkeys; i++) {
+        list *clients = dict_get(c->db->blocking_keys, keys[i]->ptr);
+
+        if (!clients) {
+            clients = listCreate();
+            dict_set(c->db->blocking_keys, keys[i]->ptr, clients);
+        }
+        listAddNodeTail(clients, c);
+        c->bpop.keys[i] = keys[i];
+        incrRefCount(keys[i]);
+    }
+
+    c->bpop.timeout = NULL;
+    if (timeout > 0)
+        c->bpop.timeout = el_timer_add(server.el, timeout, block_timeout_fired, c);
+    c->flags |= CLIENT_BLOCKED;
+    server.blocked_clients++;
+}
+
+void rr_client_unblock(rr_client_t *c) {
+    int i;
+
+    assert(c->flags & CLIENT_BLOCKED);
+    for (i = 0; i < c->bpop.numkeys; i++) {
+        robj *key = c->bpop.keys[i];
+        list *clients = dict_get(c->db->blocking_keys, key->ptr);
+        listNode *ln = listSearchKey(clients, c);
+
+        assert(ln != NULL);
+        listDelNode(clients, ln);
+        if (listLength(clients) == 0) {
+            dict_del(c->db->blocking_keys, key->ptr);
+            listRelease(clients);
+        }
+        decrRefCount(key);
+    }
+    rr_free(c->bpop.keys);
+    c->bpop.keys = NULL;
+    c->bpop.numkeys = 0;
+    if (c->bpop.timeout) {
+        el_timer_del(server.el, c->bpop.timeout);
+        c->bpop.timeout = NULL;
+    }
+    if (c->bpop.merge) rr_cmd_hqmerge_cancel(c);
+    if (c->bpop.job) rr_reactor_dispatch_cancel(c);
+
+    c->flags &= ~CLIENT_BLOCKED;
+    c->flags |= CLIENT_UNBLOCKED;
+    /* The time spent blocked doesn't count as idle */
+    c->last_interaction = el_loop_now(server.el);
+    listAddNodeTail(server.unblocked_clients, c);
+    server.blocked_clients--;
+}
+
+void rr_db_signal_key_ready(rrdb_t *db, robj *key) {
+    ready_key_t *rk;
+
+    if (!dict_contains(db->blocking_keys, key->ptr)) return;
+    if (dict_contains(db->ready_keys, key->ptr)) return;
+
+    rk = rr_malloc(sizeof(*rk));
+    rk->db = db;
+    rk->key = key;
+    incrRefCount(key);
+    listAddNodeTail(server.ready_keys, rk);
+    dict_set(db->ready_keys, key->ptr, rk);
+}
+
+void rr_blocking_serve_ready_keys(void) {
+    while (listLength(server.ready_keys)) {
+        list *ready = server.ready_keys;
+        listNode *ln;
+
+        /* Serving clients may signal more keys, let them go to a new list */
+        server.ready_keys = listCreate();
+        while ((ln = listFirst(ready)) != NULL) {
+            ready_key_t *rk = listNodeValue(ln);
+            robj *o = rr_db_lookup(rk->db, rk->key);
+            list *clients;
+
+            dict_del(rk->db->ready_keys, rk->key->ptr);
+            while (o && o->type == OBJ_HEAPQ &&
+                   (clients = dict_get(rk->db->blocking_keys, rk->key->ptr))) {
+                rr_client_t *c = listNodeValue(listFirst(clients));
+
+                if (!rr_cmd_hqpop_reply(c, rk->key, o)) break;
+                rr_client_unblock(c);
+            }
+            decrRefCount(rk->key);
+            rr_free(rk);
+            listDelNode(ready, ln);
+        }
+        listRelease(ready);
+    }
+}
+
+void rr_blocking_process_unblocked(void) {
+    listNode *ln;
+
+    while ((ln = listFirst(server.unblocked_clients)) != NULL) {
+        rr_client_t *c = listNodeValue(ln);
+
+        listDelNode(server.unblocked_clients, ln);
+        c->flags &= ~CLIENT_UNBLOCKED;
+        rr_client_process_input(c);
+    }
+}
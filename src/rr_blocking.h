@@ -0,0 +1,25 @@
+#ifndef _RR_BLOCKING_H
+#define _RR_BLOCKING_H
+
+#include "rr_server.h"
+
+/* Block the client on the given keys until one of them gets served by
+ * rr_blocking_serve_ready_keys, or the timeout (in milliseconds, 0 means
+ * forever) expires, in which case a null multi bulk is replied. Without keys
+ * the client waits for rr_client_unblock. */
+void rr_client_block(rr_client_t *c, robj **keys, int numkeys, long long timeout);
+
+/* Unblock the client, the commands it sent meanwhile are processed before
+ * the next polling */
+void rr_client_unblock(rr_client_t *c);
+
+/* Mark a key as ready to serve the clients blocked on it, if any */
+void rr_db_signal_key_ready(rrdb_t *db, robj *key);
+
+/* Serve the clients blocked on the ready keys */
+void rr_blocking_serve_ready_keys(void);
+
+/* Process the pending input of the clients unblocked in this iteration */
+void rr_blocking_process_unblocked(void);
+
+#endif /* ifndef _RR_BLOCKING_H */
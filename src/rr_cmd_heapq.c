@@ -2,43 +2,179 @@
 #include "rr_cmd_heapq.h"
 #include "robj.h"
 #include "rr_db.h"
-#include "rr_minheap.h"
+#include "rr_heapq.h"
+#include "rr_blocking.h"
+#include "rr_reactor.h"
+#include "rr_datetime.h"
+#include "rr_malloc.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/* Promotion timer of the delayed items of a heapq. The heapq may be deleted
+ * before the timer fires, so the timer looks the key up again. */
+typedef struct hq_timer_t {
+    rrdb_t *db;
+    robj *key;
+} hq_timer_t;
+
+/* Members moved by a step of QMERGE */
+#define HQ_MERGE_STEP 1024
+
+static void hq_schedule(rrdb_t *db, robj *key, heapq_t *hq);
+
+static void hq_check_layout(heapq_t *hq) {
+    if (heapq_len(hq) > server.heapq_dary_entries) heapq_to_dary(hq);
+}
+
+static void hq_timer_free(hq_timer_t *t) {
+    decrRefCount(t->key);
+    rr_free(t);
+}
+
+static int hq_timer_fired(eventloop_t *el, void *ud) {
+    hq_timer_t *t = ud;
+    robj *o = rr_db_lookup(t->db, t->key);
+    UNUSED(el);
+
+    /* The key may hold another heapq by now, which has its own timer */
+    if (o && o->type == OBJ_HEAPQ && ((heapq_t *) o->ptr)->timer &&
+        ((heapq_t *) o->ptr)->timer->ud == t) {
+        heapq_t *hq = o->ptr;
+
+        hq->timer = NULL;
+        if (heapq_promote(hq, rr_dt_mstime())) {
+            hq_check_layout(hq);
+            rr_db_signal_key_ready(t->db, t->key);
+        }
+        hq_schedule(t->db, t->key, hq);
+        rr_blocking_serve_ready_keys();
+    }
+    hq_timer_free(t);
+    return 0;
+}
+
+static void hq_unschedule(heapq_t *hq) {
+    if (!hq->timer) return;
+    hq_timer_free(hq->timer->ud);
+    el_timer_del(server.el, hq->timer);
+    hq->timer = NULL;
+}
+
+/* Arm a timer for the earliest delayed item unless one is armed for it or
+ * an earlier one already. A timer armed for a later item is replaced. */
+static void hq_schedule(rrdb_t *db, robj *key, heapq_t *hq) {
+    long long next = heapq_next_at(hq), delay;
+    hq_timer_t *t;
+
+    if (next < 0 || (hq->timer && hq->timer_at <= next)) return;
+    hq_unschedule(hq);
+
+    t = rr_malloc(sizeof(*t));
+    t->db = db;
+    t->key = key;
+    incrRefCount(key);
+    delay = next - rr_dt_mstime();
+    if ((hq->timer = el_timer_add(server.el, delay > 0 ? delay : 1, hq_timer_fired, t)) == NULL) {
+        hq_timer_free(t);
+        return;
+    }
+    hq->timer_at = next;
+}
 
 void rr_cmd_hqpush(rr_client_t *c) {
-    robj *hp, *reply;
-    hq_item_t item;
+    robj *hp;
+    double score;
 
-    if (getDoubleFromObjectOrReply(c, c->argv[2], &item.score, NULL)) return;
+    if (getDoubleFromObjectOrReply(c, c->argv[2], &score, NULL)) return;
     hp = rr_db_lookup_or_create(c, c->argv[1], OBJ_HEAPQ);
     if (!hp || hp->type != OBJ_HEAPQ) {
         reply_add_obj(c, shared.wrongtypeerr);
         return;
     }
 
-    c->argv[3] = tryObjectEncoding(c->argv[3]);
-    item.obj = c->argv[3];
-    if (!minheap_push(hp->ptr, &item)) {
-        incrRefCount(c->argv[3]);
-        reply = shared.ok;
+    heapq_push(hp->ptr, score, c->argv[3]);
+    hq_check_layout(hp->ptr);
+    rr_db_signal_key_ready(c->db, c->argv[1]);
+    reply_add_obj(c, shared.ok);
+}
+
+/* QPUSHN key score member [score member ...] */
+void rr_cmd_hqpushn(rr_client_t *c) {
+    robj *hp, **objs;
+    double *scores;
+    int i, n = (c->argc - 2) / 2;
+
+    if (c->argc % 2) {
+        reply_add_obj(c, shared.syntaxerr);
+        return;
+    }
+    scores = rr_malloc(sizeof(double) * n);
+    for (i = 0; i < n; i++) {
+        if (getDoubleFromObjectOrReply(c, c->argv[2+i*2], &scores[i], NULL)) {
+            rr_free(scores);
+            return;
+        }
+    }
+    hp = rr_db_lookup_or_create(c, c->argv[1], OBJ_HEAPQ);
+    if (!hp || hp->type != OBJ_HEAPQ) {
+        rr_free(scores);
+        reply_add_obj(c, shared.wrongtypeerr);
+        return;
+    }
+
+    objs = rr_malloc(sizeof(robj *) * n);
+    for (i = 0; i < n; i++) objs[i] = c->argv[3+i*2];
+    heapq_push_many(hp->ptr, scores, objs, n);
+    hq_check_layout(hp->ptr);
+    rr_db_signal_key_ready(c->db, c->argv[1]);
+    reply_add_obj(c, shared.ok);
+    rr_free(objs);
+    rr_free(scores);
+}
+
+/* QPUSHAT key timestamp score member
+ *
+ * Push the member once the unix time in milliseconds is reached, until then
+ * it's invisible to the popping commands. */
+void rr_cmd_hqpushat(rr_client_t *c) {
+    robj *hp;
+    long long at;
+    double score;
+
+    if (getLongLongFromObjectOrReply(c, c->argv[2], &at, NULL) ||
+        getDoubleFromObjectOrReply(c, c->argv[3], &score, NULL)) return;
+    hp = rr_db_lookup_or_create(c, c->argv[1], OBJ_HEAPQ);
+    if (!hp || hp->type != OBJ_HEAPQ) {
+        reply_add_obj(c, shared.wrongtypeerr);
+        return;
+    }
+
+    if (at <= rr_dt_mstime()) {
+        heapq_push(hp->ptr, score, c->argv[4]);
+        hq_check_layout(hp->ptr);
+        rr_db_signal_key_ready(c->db, c->argv[1]);
     } else {
-        reply = shared.err;
+        heapq_push_at(hp->ptr, at, score, c->argv[4]);
+        hq_schedule(c->db, c->argv[1], hp->ptr);
     }
-    reply_add_obj(c, reply);
+    reply_add_obj(c, shared.ok);
 }
 
 void rr_cmd_hqpop(rr_client_t *c) {
-    robj *hq;
-    hq_item_t *item;
+    robj *hq, *obj;
 
     if ((hq=rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
         checkType(c, hq, OBJ_HEAPQ)) return;
 
-    if ((item = minheap_pop(hq->ptr)) == NULL) {
+    if (!heapq_pop(hq->ptr, &obj, NULL)) {
         reply_add_obj(c, shared.nullbulk);
     }
     else {
-        reply_add_bulk_obj(c, item->obj);
-        decrRefCount(item->obj);
+        reply_add_bulk_obj(c, obj);
+        decrRefCount(obj);
     }
 }
 
@@ -49,10 +185,10 @@ void rr_cmd_hqpeek(rr_client_t *c) {
     if ((hq=rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
         checkType(c, hq, OBJ_HEAPQ)) return;
 
-    if ((item = minheap_min(hq->ptr)) == NULL)
+    if ((item = heapq_min(hq->ptr)) == NULL)
         reply_add_obj(c, shared.nullbulk);
     else
-        reply_add_bulk_obj(c, item->obj);
+        reply_add_bulk_obj(c, item->member->obj);
 }
 
 void rr_cmd_hqlen(rr_client_t *c) {
@@ -61,12 +197,11 @@ void rr_cmd_hqlen(rr_client_t *c) {
     if ((hq=rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
         checkType(c, hq, OBJ_HEAPQ)) return;
 
-    reply_add_longlong(c, minheap_len(hq->ptr));
+    reply_add_longlong(c, heapq_len(hq->ptr));
 }
 
 void rr_cmd_hqpopn(rr_client_t *c) {
-    robj *hq;
-    hq_item_t *item;
+    robj *hq, *obj;
     long n, len;
 
     if (getLongFromObjectOrReply(c, c->argv[2], &n, NULL)) return;
@@ -77,11 +212,638 @@ void rr_cmd_hqpopn(rr_client_t *c) {
     if ((hq=rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
         checkType(c, hq, OBJ_HEAPQ)) return;
 
-    len = minheap_len(hq->ptr);
+    len = heapq_len(hq->ptr);
     n = n < len ?  n : len;
     reply_add_multi_bulk_len(c, n);
-    while (n-- > 0 && (item=minheap_pop(hq->ptr)) != NULL) {
-        reply_add_bulk_obj(c, item->obj);
-        decrRefCount(item->obj);
+    while (n-- > 0 && heapq_pop(hq->ptr, &obj, NULL)) {
+        reply_add_bulk_obj(c, obj);
+        decrRefCount(obj);
+    }
+}
+
+void rr_cmd_hqscore(rr_client_t *c) {
+    robj *hq;
+    double score;
+
+    if ((hq=rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
+        checkType(c, hq, OBJ_HEAPQ)) return;
+
+    if (heapq_score(hq->ptr, c->argv[2]->ptr, &score))
+        reply_add_double(c, score);
+    else
+        reply_add_obj(c, shared.nullbulk);
+}
+
+void rr_cmd_hqupdate(rr_client_t *c) {
+    robj *hq;
+    double score;
+
+    if (getDoubleFromObjectOrReply(c, c->argv[3], &score, NULL)) return;
+    if ((hq=rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.czero);
+        return;
+    }
+    if (checkType(c, hq, OBJ_HEAPQ)) return;
+
+    if (heapq_update(hq->ptr, c->argv[2]->ptr, score))
+        reply_add_obj(c, shared.cone);
+    else
+        reply_add_obj(c, shared.czero);
+}
+
+void rr_cmd_hqrem(rr_client_t *c) {
+    robj *hq;
+
+    if ((hq=rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.czero);
+        return;
+    }
+    if (checkType(c, hq, OBJ_HEAPQ)) return;
+
+    if (heapq_remove(hq->ptr, c->argv[2]->ptr))
+        reply_add_obj(c, shared.cone);
+    else
+        reply_add_obj(c, shared.czero);
+}
+
+/* QCREATE key [CAP k]
+ *
+ * Create the heapq, or change the cap of an existing one. A capped heapq only
+ * keeps the k members with the highest scores. */
+void rr_cmd_hqcreate(rr_client_t *c) {
+    robj *hq;
+    long long cap = 0;
+
+    if (c->argc == 4 && !strcasecmp(c->argv[2]->ptr, "cap")) {
+        if (getLongLongFromObjectOrReply(c, c->argv[3], &cap, NULL)) return;
+        if (cap <= 0) {
+            reply_add_err(c, "cap must be positive");
+            return;
+        }
+    } else if (c->argc != 2) {
+        reply_add_obj(c, shared.syntaxerr);
+        return;
+    }
+
+    hq = rr_db_lookup_or_create(c, c->argv[1], OBJ_HEAPQ);
+    if (checkType(c, hq, OBJ_HEAPQ)) return;
+    heapq_set_cap(hq->ptr, cap);
+    reply_add_obj(c, shared.ok);
+}
+
+/* QMERGE in progress, its client stays blocked until all of src is moved */
+typedef struct hq_merge_t {
+    rr_client_t *c;
+    rrdb_t *db;
+    robj *dst;              /* keys */
+    robj *src;
+    long long moved;        /* members of src found in dst */
+    dict_t *landed;         /* members landed in a capped dst, NULL if uncapped */
+    ev_timer_t *timer;      /* timer running the next step */
+    struct rr_call_t *call; /* QTAKE running the next step, src being on another reactor */
+    bool started;           /* whether QTAKE found src already */
+} hq_merge_t;
+
+static hq_merge_t *hq_merge_create(rr_client_t *c) {
+    hq_merge_t *m = rr_malloc(sizeof(*m));
+
+    m->c = c;
+    m->db = c->db;
+    m->dst = c->argv[1];
+    m->src = c->argv[2];
+    incrRefCount(m->dst);
+    incrRefCount(m->src);
+    m->moved = 0;
+    m->landed = NULL;
+    m->timer = NULL;
+    m->call = NULL;
+    m->started = false;
+    return m;
+}
+
+static void hq_merge_free(hq_merge_t *m) {
+    decrRefCount(m->dst);
+    decrRefCount(m->src);
+    if (m->landed) dict_free(m->landed);
+    rr_free(m);
+}
+
+/* Reply the number of members moved and unblock the client, if still there */
+static void hq_merge_done(hq_merge_t *m) {
+    rr_client_t *c = m->c;
+
+    if (c) {
+        c->bpop.merge = NULL;
+        reply_add_longlong(c, m->moved);
+        rr_client_unblock(c);
+    }
+    hq_merge_free(m);
+}
+
+/* Move the next HQ_MERGE_STEP members, returns true once the merge is over.
+ * It's over early if either key is deleted or replaced in the meantime. */
+static bool hq_merge_step(hq_merge_t *m) {
+    robj *dst = rr_db_lookup(m->db, m->dst), *src = rr_db_lookup(m->db, m->src);
+
+    if (!dst || !src || dst == src || dst->type != OBJ_HEAPQ || src->type != OBJ_HEAPQ)
+        return true;
+    m->moved += heapq_merge(dst->ptr, src->ptr, HQ_MERGE_STEP, m->landed);
+    hq_check_layout(dst->ptr);
+    hq_schedule(m->db, m->dst, dst->ptr);
+    if (heapq_len(dst->ptr)) rr_db_signal_key_ready(m->db, m->dst);
+    if (heapq_len(src->ptr) || heapq_delayed_len(src->ptr)) return false;
+    if (!heapq_leased_len(src->ptr)) rr_db_del(m->db, m->src);
+    return true;
+}
+
+static int hq_merge_fired(eventloop_t *el, void *ud) {
+    hq_merge_t *m = ud;
+    UNUSED(el);
+
+    if (!hq_merge_step(m)) {
+        rr_blocking_serve_ready_keys();
+        return 1;
+    }
+    /* The timer is removed once it returns */
+    m->timer = NULL;
+    hq_merge_done(m);
+    rr_blocking_serve_ready_keys();
+    return 0;
+}
+
+static void hq_merge_take(hq_merge_t *m);
+
+static void hq_merge_given_back(struct rr_call_t *call, void *ud) {
+    UNUSED(call);
+    UNUSED(ud);
+}
+
+/* Push a member taken from src back to src, dst being gone */
+static void hq_merge_give_back(hq_merge_t *m, robj *obj, double score, long long at) {
+    robj **argv = rr_malloc(sizeof(robj *) * 5);
+    int argc = 0;
+
+    argv[argc++] = at ? createStringObject("qpushat", 7) : createStringObject("qpush", 5);
+    argv[argc++] = createStringObject(m->src->ptr, sdslen(m->src->ptr));
+    if (at) argv[argc++] = createObject(OBJ_STRING, sdsfromlonglong(at));
+    argv[argc++] = createObject(OBJ_STRING, sdscatprintf(sdsempty(), "%.17g", score));
+    argv[argc++] = createStringObject(obj->ptr, sdslen(obj->ptr));
+    rr_reactor_call(rr_reactor_of_key(m->src), m->db->id, argv, argc, hq_merge_given_back, NULL);
+}
+
+/* Push the members QTAKE took from src, unless dst is gone, then go on with
+ * the next step if there may be more */
+static void hq_merge_taken(struct rr_call_t *call, void *ud) {
+    hq_merge_t *m = ud;
+    robj *dst, *obj;
+    const char *str;
+    long long n = 0, at;
+    size_t len;
+    double score;
+    int type, i;
+
+    m->call = NULL;
+    type = rr_call_reply_read(call, &n, &str, &len);
+    if (type == '-') {
+        if (m->c) rr_call_reply_to(call, m->c);
+        m->c = NULL;
+    }
+    if (type != '*') {
+        hq_merge_done(m);
+        return;
+    }
+
+    dst = rr_db_lookup(m->db, m->dst);
+    if (!dst && !m->started) {
+        dst = createCollectionObject(OBJ_HEAPQ);
+        rr_db_add(m->db, m->dst, dst);
+    }
+    if (dst && dst->type == OBJ_HEAPQ && !m->started && ((heapq_t *) dst->ptr)->cap)
+        m->landed = dict_create();
+    m->started = true;
+
+    for (i = 0; i < n / 3; i++) {
+        rr_call_reply_read(call, &at, &str, &len);
+        obj = createStringObject(str, len);
+        rr_call_reply_read(call, &at, &str, &len);
+        score = strtod(str, NULL);
+        rr_call_reply_read(call, &at, &str, &len);
+        if (dst && dst->type == OBJ_HEAPQ)
+            m->moved += heapq_merge_one(dst->ptr, score, at, obj, m->landed);
+        else
+            hq_merge_give_back(m, obj, score, at);
+        decrRefCount(obj);
+    }
+
+    if (dst && dst->type == OBJ_HEAPQ) {
+        hq_check_layout(dst->ptr);
+        hq_schedule(m->db, m->dst, dst->ptr);
+        if (heapq_len(dst->ptr)) rr_db_signal_key_ready(m->db, m->dst);
+        if (m->c && n / 3 == HQ_MERGE_STEP) {
+            hq_merge_take(m);
+            rr_blocking_serve_ready_keys();
+            return;
+        }
+    }
+    hq_merge_done(m);
+    rr_blocking_serve_ready_keys();
+}
+
+/* Ask the reactor of src for the members of the next step */
+static void hq_merge_take(hq_merge_t *m) {
+    robj **argv = rr_malloc(sizeof(robj *) * 3);
+
+    argv[0] = createStringObject("qtake", 5);
+    argv[1] = createStringObject(m->src->ptr, sdslen(m->src->ptr));
+    argv[2] = createObject(OBJ_STRING, sdsfromlonglong(HQ_MERGE_STEP));
+    m->call = rr_reactor_call(rr_reactor_of_key(m->src), m->db->id, argv, 3,
+                              hq_merge_taken, m);
+}
+
+void rr_cmd_hqmerge_cancel(rr_client_t *c) {
+    hq_merge_t *m = c->bpop.merge;
+
+    c->bpop.merge = NULL;
+    /* The members taken from src by the step in flight are still to land */
+    if (m->call) {
+        m->c = NULL;
+        return;
+    }
+    if (m->timer) el_timer_del(server.el, m->timer);
+    hq_merge_free(m);
+}
+
+/* QMERGE dst src
+ *
+ * Move all the members of src to dst, replies the number of members of src
+ * found in dst afterwards. src is deleted unless it still has leased members.
+ *
+ * A src without leases is just renamed when dst doesn't exist. Otherwise the
+ * members are moved HQ_MERGE_STEP at a time, lowest scores first, and the
+ * client is blocked until the last step so that the other clients are served
+ * in between. Each member is in either of the heapqs meanwhile.
+ *
+ * With src on another reactor, every step takes the members from src with
+ * QTAKE first, so that they are in neither of the heapqs in between. */
+void rr_cmd_hqmerge(rr_client_t *c) {
+    robj *dst, *src;
+    hq_merge_t *m;
+
+    if (server.reactors_num > 1 && rr_reactor_of_key(c->argv[2]) != server.reactor_id) {
+        if ((dst = rr_db_lookup(c->db, c->argv[1])) != NULL &&
+            checkType(c, dst, OBJ_HEAPQ)) return;
+        m = hq_merge_create(c);
+        hq_merge_take(m);
+        rr_client_block(c, NULL, 0, 0);
+        c->bpop.merge = m;
+        return;
+    }
+
+    if ((src = rr_db_lookup(c->db, c->argv[2])) == NULL) {
+        reply_add_obj(c, shared.czero);
+        return;
+    }
+    if (checkType(c, src, OBJ_HEAPQ)) return;
+    if ((dst = rr_db_lookup(c->db, c->argv[1])) != NULL &&
+        checkType(c, dst, OBJ_HEAPQ)) return;
+    if (src == dst) {
+        reply_add_obj(c, shared.sameobjecterr);
+        return;
+    }
+
+    if (!dst && !heapq_leased_len(src->ptr)) {
+        heapq_t *hq = src->ptr;
+
+        incrRefCount(src);
+        rr_db_del_sync(c->db, c->argv[2]);
+        rr_db_add(c->db, c->argv[1], src);
+        /* The promotion timer looks the heapq up by its old key */
+        hq_unschedule(hq);
+        hq_schedule(c->db, c->argv[1], hq);
+        if (heapq_len(hq)) rr_db_signal_key_ready(c->db, c->argv[1]);
+        reply_add_longlong(c, heapq_len(hq) + heapq_delayed_len(hq));
+        return;
+    }
+
+    dst = rr_db_lookup_or_create(c, c->argv[1], OBJ_HEAPQ);
+    m = hq_merge_create(c);
+    m->landed = ((heapq_t *) dst->ptr)->cap ? dict_create() : NULL;
+    if (hq_merge_step(m) ||
+        (m->timer = el_timer_add(server.el, 1, hq_merge_fired, m)) == NULL) {
+        reply_add_longlong(c, m->moved);
+        hq_merge_free(m);
+        return;
+    }
+    rr_client_block(c, NULL, 0, 0);
+    c->bpop.merge = m;
+}
+
+static int hq_item_desc_cmp(const void *l, const void *r) {
+    const hq_item_t *a = l, *b = r;
+
+    if (a->score != b->score) return a->score < b->score ? 1 : -1;
+    return strcmp(a->member->obj->ptr, b->member->obj->ptr);
+}
+
+/* QTOPK key [WITHSCORES]
+ *
+ * All the members from the highest score to the lowest one, without popping
+ * them. Meant for capped heapqs, it takes O(n log n). */
+void rr_cmd_hqtopk(rr_client_t *c) {
+    robj *hq;
+    heapq_t *h;
+    hq_item_t *items;
+    unsigned long i;
+    int withscores = 0;
+
+    if (c->argc == 3 && !strcasecmp(c->argv[2]->ptr, "withscores")) {
+        withscores = 1;
+    } else if (c->argc != 2) {
+        reply_add_obj(c, shared.syntaxerr);
+        return;
+    }
+    if ((hq = rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.emptymultibulk);
+        return;
+    }
+    if (checkType(c, hq, OBJ_HEAPQ)) return;
+
+    h = hq->ptr;
+    items = rr_malloc(sizeof(hq_item_t) * (heapq_len(h) + 1));
+    memcpy(items, h->heap.items, sizeof(hq_item_t) * heapq_len(h));
+    qsort(items, heapq_len(h), sizeof(hq_item_t), hq_item_desc_cmp);
+
+    reply_add_multi_bulk_len(c, heapq_len(h) * (withscores + 1));
+    for (i = 0; i < heapq_len(h); i++) {
+        reply_add_bulk_obj(c, items[i].member->obj);
+        if (withscores) reply_add_double(c, items[i].score);
+    }
+    rr_free(items);
+}
+
+/* Parse a score bound, either a float, -inf/+inf, or a float prefixed by `(`
+ * to exclude it from the range */
+static int parse_score_bound(robj *o, double *value, int *ex) {
+    const char *s = o->ptr;
+    char *eptr;
+
+    *ex = s[0] == '(';
+    if (*ex) s++;
+    *value = strtod(s, &eptr);
+    if (s[0] == '\0' || eptr[0] != '\0' || isnan(*value)) return RR_ERROR;
+    return RR_OK;
+}
+
+static int parse_score_range(rr_client_t *c, skiplist_range_t *range) {
+    if (parse_score_bound(c->argv[2], &range->min, &range->minex) != RR_OK ||
+        parse_score_bound(c->argv[3], &range->max, &range->maxex) != RR_OK) {
+        reply_add_err(c, "min or max is not a float");
+        return RR_ERROR;
+    }
+    return RR_OK;
+}
+
+/* QCOUNT key min max */
+void rr_cmd_hqcount(rr_client_t *c) {
+    robj *hq;
+    skiplist_range_t range;
+
+    if (parse_score_range(c, &range) != RR_OK) return;
+    if ((hq = rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.czero);
+        return;
+    }
+    if (checkType(c, hq, OBJ_HEAPQ)) return;
+
+    reply_add_longlong(c, skiplist_count_range(heapq_index(hq->ptr), &range));
+}
+
+/* QRANGEBYSCORE key min max [WITHSCORES] [LIMIT count]
+ *
+ * The members in the score range from the lowest score, without popping them */
+void rr_cmd_hqrangebyscore(rr_client_t *c) {
+    robj *hq;
+    skiplist_range_t range;
+    skiplist_node_t *node;
+    void *replylen;
+    long limit = -1, n = 0;
+    int i, withscores = 0;
+
+    if (parse_score_range(c, &range) != RR_OK) return;
+    for (i = 4; i < c->argc; i++) {
+        if (!strcasecmp(c->argv[i]->ptr, "withscores")) {
+            withscores = 1;
+        } else if (!strcasecmp(c->argv[i]->ptr, "limit") && i+1 < c->argc) {
+            if (getLongFromObjectOrReply(c, c->argv[++i], &limit, NULL)) return;
+        } else {
+            reply_add_obj(c, shared.syntaxerr);
+            return;
+        }
+    }
+
+    if ((hq = rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.emptymultibulk);
+        return;
+    }
+    if (checkType(c, hq, OBJ_HEAPQ)) return;
+
+    replylen = reply_add_deferred_multi_bulk_len(c);
+    node = skiplist_first_in_range(heapq_index(hq->ptr), &range);
+    while (node && limit-- && skiplist_value_lte_max(node->score, &range)) {
+        reply_add_bulk_cstr(c, node->member);
+        if (withscores) reply_add_double(c, node->score);
+        node = skiplist_next(node);
+        n++;
+    }
+    reply_set_deferred_multi_bulk_len(c, replylen, n * (withscores + 1));
+}
+
+bool rr_cmd_hqpop_reply(rr_client_t *c, robj *key, robj *hq) {
+    robj *obj;
+
+    /* QWAIT only waits for members to show up */
+    if (c->lastcmd->proc == rr_cmd_hqwait) {
+        if (!heapq_len(hq->ptr)) return false;
+        reply_add_bulk_obj(c, key);
+        return true;
+    }
+
+    if (!heapq_pop(hq->ptr, &obj, NULL)) return false;
+    reply_add_multi_bulk_len(c, 2);
+    reply_add_bulk_obj(c, key);
+    reply_add_bulk_obj(c, obj);
+    decrRefCount(obj);
+    return true;
+}
+
+/* BQPOP key [key ...] timeout
+ *
+ * Pop from the first non-empty heapq, or block until any of them gets an item
+ * or the timeout, in seconds, expires. A timeout of 0 blocks forever. */
+void rr_cmd_bqpop(rr_client_t *c) {
+    robj *hq;
+    double timeout;
+    int i;
+
+    if (getDoubleFromObjectOrReply(c, c->argv[c->argc-1], &timeout,
+        "timeout is not a float or out of range")) return;
+    if (timeout < 0) {
+        reply_add_err(c, "timeout is negative");
+        return;
+    }
+
+    for (i = 1; i < c->argc-1; i++) {
+        if ((hq = rr_db_lookup(c->db, c->argv[i])) == NULL) continue;
+        if (checkType(c, hq, OBJ_HEAPQ)) return;
+        if (rr_cmd_hqpop_reply(c, c->argv[i], hq)) return;
+    }
+
+    /* Wait for at least a millisecond for the tiny positive timeouts */
+    rr_client_block(c, c->argv+1, c->argc-2,
+        timeout > 0 && timeout < 0.001 ? 1 : (long long) (timeout * 1000));
+}
+
+/* QWAIT key [key ...]
+ *
+ * Internal, for a BQPOP of keys of several reactors. Replies the first key
+ * holding members, or blocks until any of them gets some. */
+void rr_cmd_hqwait(rr_client_t *c) {
+    robj *hq;
+    int i;
+
+    for (i = 1; i < c->argc; i++) {
+        if ((hq = rr_db_lookup(c->db, c->argv[i])) == NULL) continue;
+        if (checkType(c, hq, OBJ_HEAPQ)) return;
+        if (heapq_len(hq->ptr)) {
+            reply_add_bulk_obj(c, c->argv[i]);
+            return;
+        }
+    }
+    rr_client_block(c, c->argv+1, c->argc-1, 0);
+}
+
+/* QTAKE key count
+ *
+ * Internal, for a QMERGE of a src on another reactor. Pops up to count members
+ * as heapq_merge does, and replies their member, score and delayed time, 0 if
+ * not delayed. The key is deleted once empty unless it has leased members. */
+void rr_cmd_hqtake(rr_client_t *c) {
+    robj *hq, *obj;
+    long n, i;
+    long long at;
+    double score;
+    void *replylen;
+
+    if (getLongFromObjectOrReply(c, c->argv[2], &n, NULL)) return;
+    if ((hq = rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
+        checkType(c, hq, OBJ_HEAPQ)) return;
+
+    replylen = reply_add_deferred_multi_bulk_len(c);
+    for (i = 0; i < n && heapq_take(hq->ptr, &obj, &score, &at); i++) {
+        reply_add_bulk_obj(c, obj);
+        reply_add_double(c, score);
+        reply_add_longlong(c, at);
+        decrRefCount(obj);
+    }
+    reply_set_deferred_multi_bulk_len(c, replylen, i * 3);
+    if (!heapq_len(hq->ptr) && !heapq_delayed_len(hq->ptr) && !heapq_leased_len(hq->ptr))
+        rr_db_del(c->db, c->argv[1]);
+}
+
+/* QLEASE key count leasems
+ *
+ * Pop up to count members and lease them for leasems milliseconds, replies
+ * the lease ids along with the members. The members not acknowledged by QACK
+ * before the lease expires are pushed back with their scores. */
+void rr_cmd_hqlease(rr_client_t *c) {
+    robj *hq;
+    long n, i;
+    long long ms, deadline;
+    hq_lease_t *lease;
+
+    if (getLongFromObjectOrReply(c, c->argv[2], &n, NULL) ||
+        getLongLongFromObjectOrReply(c, c->argv[3], &ms, NULL)) return;
+    if (n <= 0 || ms <= 0) {
+        reply_add_err(c, "count and lease time must be positive");
+        return;
+    }
+    if ((hq = rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.emptymultibulk);
+        return;
+    }
+    if (checkType(c, hq, OBJ_HEAPQ)) return;
+
+    if ((unsigned long) n > heapq_len(hq->ptr)) n = heapq_len(hq->ptr);
+    if (n && !dict_contains(c->db->leased_keys, c->argv[1]->ptr)) {
+        dict_set(c->db->leased_keys, c->argv[1]->ptr, c->argv[1]);
+        incrRefCount(c->argv[1]);
+    }
+
+    deadline = rr_dt_mstime() + ms;
+    reply_add_multi_bulk_len(c, n * 2);
+    for (i = 0; i < n; i++) {
+        lease = heapq_lease(hq->ptr, deadline);
+        reply_add_bulk_longlong(c, lease->id);
+        reply_add_bulk_obj(c, lease->obj);
+    }
+}
+
+/* QACK key id [id ...]
+ *
+ * Acknowledge the leased members, replies the number of leases released */
+void rr_cmd_hqack(rr_client_t *c) {
+    robj *hq;
+    long long acked = 0;
+    int i;
+
+    if ((hq = rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.czero);
+        return;
+    }
+    if (checkType(c, hq, OBJ_HEAPQ)) return;
+
+    for (i = 2; i < c->argc; i++)
+        if (heapq_ack(hq->ptr, c->argv[i]->ptr)) acked++;
+    reply_add_longlong(c, acked);
+}
+
+void rr_cmd_hqlease_cron(void) {
+    long long now = rr_dt_mstime();
+    dict_iterator_t it;
+    list *done = listCreate();
+    listNode *ln;
+    int i;
+
+    for (i = 0; i < server.max_dbs; i++) {
+        rrdb_t *db = server.dbs[i];
+
+        if (dict_empty(db->leased_keys)) continue;
+        dict_iter_init(db->leased_keys, &it);
+        while (dict_iter_hasnext(&it)) {
+            robj *key = dict_iter_next(&it).value;
+            robj *o = rr_db_lookup(db, key);
+
+            if (!o || o->type != OBJ_HEAPQ) {
+                listAddNodeTail(done, key);
+                continue;
+            }
+            if (heapq_expire_leases(o->ptr, now)) {
+                hq_check_layout(o->ptr);
+                rr_db_signal_key_ready(db, key);
+            }
+            if (!heapq_leased_len(o->ptr)) listAddNodeTail(done, key);
+        }
+        dict_iter_release(&it);
+
+        /* The keys can't be removed while iterating */
+        while ((ln = listFirst(done)) != NULL) {
+            robj *key = listNodeValue(ln);
+
+            dict_del(db->leased_keys, key->ptr);
+            decrRefCount(key);
+            listDelNode(done, ln);
+        }
     }
+    listRelease(done);
+    rr_blocking_serve_ready_keys();
 }
@@ -3,10 +3,37 @@
 
 #include "rr_server.h"
 
+#include <stdbool.h>
+
 void rr_cmd_hqpush(rr_client_t *c);
+void rr_cmd_hqpushn(rr_client_t *c);
+void rr_cmd_hqpushat(rr_client_t *c);
 void rr_cmd_hqpeek(rr_client_t *c);
 void rr_cmd_hqpop(rr_client_t *c);
 void rr_cmd_hqpopn(rr_client_t *c);
 void rr_cmd_hqlen(rr_client_t *c);
+void rr_cmd_hqscore(rr_client_t *c);
+void rr_cmd_hqupdate(rr_client_t *c);
+void rr_cmd_hqrem(rr_client_t *c);
+void rr_cmd_hqcreate(rr_client_t *c);
+void rr_cmd_hqtopk(rr_client_t *c);
+void rr_cmd_hqmerge(rr_client_t *c);
+void rr_cmd_hqcount(rr_client_t *c);
+void rr_cmd_hqrangebyscore(rr_client_t *c);
+void rr_cmd_bqpop(rr_client_t *c);
+void rr_cmd_hqlease(rr_client_t *c);
+void rr_cmd_hqack(rr_client_t *c);
+void rr_cmd_hqwait(rr_client_t *c);
+void rr_cmd_hqtake(rr_client_t *c);
+
+/* Stop the QMERGE the client is blocked in, called when it's unblocked */
+void rr_cmd_hqmerge_cancel(rr_client_t *c);
+
+/* Push back the leased members whose lease expired, called by the server cron */
+void rr_cmd_hqlease_cron(void);
+
+/* Pop the lowest item of the heapq and reply it along with the key to the
+ * client, returns false if the heapq is empty */
+bool rr_cmd_hqpop_reply(rr_client_t *c, robj *key, robj *hq);
 
 #endif /* ifndef RR_CMD_HEAPQ_H */
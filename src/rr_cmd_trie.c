@@ -1,8 +1,13 @@
+#include "rr_ftmacro.h"
+
+#include "rr_rhino_rox.h"
 #include "rr_cmd_trie.h"
 #include "robj.h"
 #include "rr_db.h"
 #include "rr_dict.h"
-#include "rr_array.h"
+
+#include <string.h>
+#include <strings.h>
 
 void rr_cmd_rget(rr_client_t *c) {
     robj *trie, *o;
@@ -55,11 +60,24 @@ void rr_cmd_rset(rr_client_t *c) {
     reply_add_obj(c, reply);
 }
 
+/* Stream the key/value pairs from the iterator into the client reply,
+ * returns the number of pairs replied */
+static long reply_add_dict_iter(rr_client_t *c, dict_iterator_t *iter, int flags) {
+    long n = 0;
+
+    while (dict_iter_hasnext(iter)) {
+        dict_kv_t kv = dict_iter_next(iter);
+        if (flags & DICT_KEY) reply_add_bulk_cstr(c, kv.key);
+        if (flags & DICT_VAL) reply_add_bulk_obj(c, kv.value);
+        n++;
+    }
+    return n;
+}
+
 static void get_prefix(rr_client_t *c, int flags) {
     robj *trie;
-    dict_iterator_t *iter;
-    array_t *kvs;
-    long n = 0, multiplier = 0, i, total;
+    dict_iterator_t iter;
+    long multiplier = 0;
 
     if ((trie=rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
         checkType(c, trie, OBJ_HASH)) return;
@@ -67,58 +85,79 @@ static void get_prefix(rr_client_t *c, int flags) {
     if (flags & DICT_KEY) multiplier++;
     if (flags & DICT_VAL) multiplier++;
 
-    iter = dict_get_prefix(trie->ptr, c->argv[2]->ptr);
-    kvs = array_create(8, sizeof(dict_kv_t));
-    while (dict_iter_hasnext(iter)) {
-        dict_kv_t *kv = array_push(kvs);
-        *kv = dict_iter_next(iter);
-        n++;
-    }
-
-    total = n * multiplier;
-    reply_add_multi_bulk_len(c, total);
-    for (i = 0; i < n; i++) {
-        dict_kv_t *kv = ARRAY_AT(kvs, i);
-        if (flags & DICT_KEY) reply_add_bulk_cstr(c, kv->key);
-        if (flags & DICT_VAL) reply_add_bulk_obj(c, kv->value);
-    }
-    array_free(kvs);
-    dict_iter_free(iter);
+    reply_add_multi_bulk_len(c, dict_count_prefix(trie->ptr, c->argv[2]->ptr) * multiplier);
+    dict_iter_init_prefix(trie->ptr, c->argv[2]->ptr, &iter);
+    reply_add_dict_iter(c, &iter, flags);
+    dict_iter_release(&iter);
 }
 
 void rr_cmd_rpget(rr_client_t *c) {
     get_prefix(c, DICT_KEY|DICT_VAL);
 }
 
-static void get_all(rr_client_t *c, int flags) {
+void rr_cmd_rpcount(rr_client_t *c) {
     robj *trie;
-    dict_iterator_t *iter;
-    array_t *kvs;
-    long n = 0, multiplier = 0, i, total;
+
+    if ((trie=rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.czero);
+        return;
+    }
+    if (checkType(c, trie, OBJ_HASH)) return;
+
+    reply_add_longlong(c, dict_count_prefix(trie->ptr, c->argv[2]->ptr));
+}
+
+void rr_cmd_rrank(rr_client_t *c) {
+    robj *trie;
+    unsigned long rank;
 
     if ((trie=rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
         checkType(c, trie, OBJ_HASH)) return;
 
-    if (flags & DICT_KEY) multiplier++;
-    if (flags & DICT_VAL) multiplier++;
+    if (dict_rank(trie->ptr, c->argv[2]->ptr, &rank))
+        reply_add_longlong(c, rank);
+    else
+        reply_add_obj(c, shared.nullbulk);
+}
 
-    iter = dict_iter_create(trie->ptr);
-    kvs = array_create(8, sizeof(dict_kv_t));
-    while (dict_iter_hasnext(iter)) {
-        dict_kv_t *kv = array_push(kvs);
-        *kv = dict_iter_next(iter);
-        n++;
+/* RNTH key index, negative indexes count from the last key as in LINDEX */
+void rr_cmd_rnth(rr_client_t *c) {
+    robj *trie;
+    long index;
+    dict_kv_t kv;
+
+    if (getLongFromObjectOrReply(c, c->argv[2], &index, NULL)) return;
+    if ((trie=rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.nullmultibulk);
+        return;
     }
+    if (checkType(c, trie, OBJ_HASH)) return;
 
-    total = n * multiplier;
-    reply_add_multi_bulk_len(c, total);
-    for (i = 0; i < n; i++) {
-        dict_kv_t *kv = array_at(kvs, i);
-        if (flags & DICT_KEY) reply_add_bulk_cstr(c, kv->key);
-        if (flags & DICT_VAL) reply_add_bulk_obj(c, kv->value);
+    if (index < 0) index += dict_length(trie->ptr);
+    if (index < 0 || !dict_nth(trie->ptr, index, &kv)) {
+        reply_add_obj(c, shared.nullmultibulk);
+        return;
     }
-    array_free(kvs);
-    dict_iter_free(iter);
+    reply_add_multi_bulk_len(c, 2);
+    reply_add_bulk_cstr(c, kv.key);
+    reply_add_bulk_obj(c, kv.value);
+}
+
+static void get_all(rr_client_t *c, int flags) {
+    robj *trie;
+    dict_iterator_t iter;
+    long multiplier = 0;
+
+    if ((trie=rr_db_lookup_or_reply(c, c->argv[1], shared.nullbulk)) == NULL ||
+        checkType(c, trie, OBJ_HASH)) return;
+
+    if (flags & DICT_KEY) multiplier++;
+    if (flags & DICT_VAL) multiplier++;
+
+    reply_add_multi_bulk_len(c, dict_length(trie->ptr) * multiplier);
+    dict_iter_init(trie->ptr, &iter);
+    reply_add_dict_iter(c, &iter, flags);
+    dict_iter_release(&iter);
 }
 
 void rr_cmd_rkeys(rr_client_t *c) {
@@ -133,6 +172,121 @@ void rr_cmd_rgetall(rr_client_t *c) {
     get_all(c, DICT_KEY|DICT_VAL);
 }
 
+void rr_cmd_rscan(rr_client_t *c) {
+    robj *trie;
+
+    if ((trie=rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.emptyscan);
+        return;
+    }
+    if (checkType(c, trie, OBJ_HASH)) return;
+
+    rr_db_scan_generic(c, trie->ptr, 2, DICT_KEY|DICT_VAL);
+}
+
+/* A bound of a lexicographical range. As in Redis, '[key' is an inclusive
+ * bound, '(key' is an exclusive one, and '-' and '+' are the lowest and
+ * highest possible keys respectively */
+typedef struct lex_bound_t {
+    const char *key; /* NULL for '-' and '+' */
+    int inf;         /* -1 for '-', 1 for '+', 0 otherwise */
+    int exclusive;
+} lex_bound_t;
+
+static int parse_lex_bound(robj *o, lex_bound_t *b) {
+    const char *s = o->ptr;
+
+    b->key = NULL;
+    b->inf = 0;
+    b->exclusive = 0;
+    switch (s[0]) {
+    case '-':
+    case '+':
+        if (s[1] != '\0') return RR_ERROR;
+        b->inf = s[0] == '-' ? -1 : 1;
+        return RR_OK;
+    case '(':
+        b->exclusive = 1;
+        /* fall through */
+    case '[':
+        b->key = s+1;
+        return RR_OK;
+    default:
+        return RR_ERROR;
+    }
+}
+
+/* Implement RRANGE key min max [LIMIT n] and RREVRANGE key max min [LIMIT n].
+ *
+ * The iterator seeks to the first key of the range in O(key length), then
+ * the keys are streamed in order until the other end of the range is met,
+ * so the subtrees out of the range are never visited. */
+static void get_range(rr_client_t *c, int reverse) {
+    robj *trie;
+    lex_bound_t start, end;
+    dict_iterator_t iter;
+    void *replylen;
+    long limit = -1, n = 0;
+    int dir = reverse ? -1 : 1;
+
+    if (parse_lex_bound(c->argv[2], &start) != RR_OK ||
+        parse_lex_bound(c->argv[3], &end) != RR_OK) {
+        reply_add_err(c, "min or max not valid string range item");
+        return;
+    }
+    if (c->argc == 6 && !strcasecmp(c->argv[4]->ptr, "limit")) {
+        if (getLongFromObjectOrReply(c, c->argv[5], &limit, NULL)) return;
+    } else if (c->argc != 4) {
+        reply_add_obj(c, shared.syntaxerr);
+        return;
+    }
+
+    if ((trie=rr_db_lookup(c->db, c->argv[1])) == NULL) {
+        reply_add_obj(c, shared.emptymultibulk);
+        return;
+    }
+    if (checkType(c, trie, OBJ_HASH)) return;
+
+    /* Ranges starting from the wrong end are always empty */
+    if (start.inf == dir || end.inf == -dir) {
+        reply_add_obj(c, shared.emptymultibulk);
+        return;
+    }
+
+    if (reverse) {
+        if (start.inf) dict_iter_init_rev(trie->ptr, &iter);
+        else dict_iter_init_rev_from(trie->ptr, start.key, &iter);
+    } else {
+        if (start.inf) dict_iter_init(trie->ptr, &iter);
+        else dict_iter_init_from(trie->ptr, start.key, &iter);
+    }
+
+    replylen = reply_add_deferred_multi_bulk_len(c);
+    while (dict_iter_hasnext(&iter) && n != limit) {
+        dict_kv_t kv = dict_iter_next(&iter);
+
+        if (!end.inf) {
+            int cmp = strcmp(kv.key, end.key) * dir;
+            if (cmp > 0 || (cmp == 0 && end.exclusive)) break;
+        }
+        if (start.exclusive && !strcmp(kv.key, start.key)) continue;
+
+        reply_add_bulk_cstr(c, kv.key);
+        reply_add_bulk_obj(c, kv.value);
+        n++;
+    }
+    dict_iter_release(&iter);
+    reply_set_deferred_multi_bulk_len(c, replylen, n*2);
+}
+
+void rr_cmd_rrange(rr_client_t *c) {
+    get_range(c, 0);
+}
+
+void rr_cmd_rrevrange(rr_client_t *c) {
+    get_range(c, 1);
+}
+
 void rr_cmd_rdel(rr_client_t *c) {
     robj *reply, *trie, *del;
 
@@ -141,6 +295,6 @@ void rr_cmd_rdel(rr_client_t *c) {
 
     del = dict_del(trie->ptr, c->argv[2]->ptr);
     reply = !del ? shared.czero : shared.cone;
-    rr_obj_free_callback(del);
+    if (del) rr_obj_free_callback(del);
     reply_add_obj(c, reply);
 }
@@ -12,5 +12,11 @@ void rr_cmd_rdel(rr_client_t *c);
 void rr_cmd_rpget(rr_client_t *c);
 void rr_cmd_rlen(rr_client_t *c);
 void rr_cmd_rexists(rr_client_t *c);
+void rr_cmd_rscan(rr_client_t *c);
+void rr_cmd_rrange(rr_client_t *c);
+void rr_cmd_rrevrange(rr_client_t *c);
+void rr_cmd_rpcount(rr_client_t *c);
+void rr_cmd_rrank(rr_client_t *c);
+void rr_cmd_rnth(rr_client_t *c);
 
 #endif /* ifndef _RR_CMD_TRIE_H */
@@ -5,6 +5,9 @@
 #include "rr_logging.h"
 #include "rr_server.h"
 #include "rr_malloc.h"
+#include "rr_iothreads.h"
+#include "rr_reactor.h"
+#include "rr_event.h"
 #include "ini.h"
 
 #include <stdlib.h>
@@ -39,6 +42,12 @@ cfg_enum_t LOG_LEVEL_ENUM[] = {
     {NULL, 0}
 };
 
+cfg_enum_t EVENT_BACKEND_ENUM[] = {
+    {"default", RR_EV_BACKEND_DEFAULT},
+    {"io_uring", RR_EV_BACKEND_IO_URING},
+    {NULL, 0}
+};
+
 /* Convert a string representing an amount of memory into the number of
  * bytes, so for instance memtoll("1Gb") will return 1073741824 that is
  * (1024*1024*1024).
@@ -161,6 +170,33 @@ static int handler(void *config,
             err = "Invalid socket file permissions";
             goto error;
         }
+    } else if (MATCH("server", "io_threads")) {
+        SETVAL("io_threads");
+        cfg->io_threads = atoi(val);
+        if (cfg->io_threads < 1 || cfg->io_threads > IO_THREADS_MAX_NUM) {
+            err = "Invalid value for io_threads";
+            goto error;
+        }
+    } else if (MATCH("server", "reactors")) {
+        SETVAL("reactors");
+        cfg->reactors = atoi(val);
+        if (cfg->reactors < 1 || cfg->reactors > REACTORS_MAX_NUM) {
+            err = "Invalid value for reactors";
+            goto error;
+        }
+    } else if (MATCH("server", "event_backend")) {
+        SETVAL("event_backend");
+        if (!cfg_enum_get_value(EVENT_BACKEND_ENUM, val, &cfg->event_backend)) {
+            err = "Invalid value for event_backend";
+            goto error;
+        }
+    } else if (MATCH("server", "client_timeout")) {
+        SETVAL("client_timeout");
+        cfg->client_timeout = atoi(val);
+        if (cfg->client_timeout < 0) {
+            err = "Invalid value for client_timeout";
+            goto error;
+        }
     } else if (MATCH("logging", "log_level")) {
         SETVAL("log_level");
         if (!cfg_enum_get_value(LOG_LEVEL_ENUM, val, &cfg->log_level)
@@ -215,6 +251,13 @@ static int handler(void *config,
             err = "Invalid value for max_dbs";
             goto error;
         }
+    } else if (MATCH("heapq", "dary_entries")) {
+        SETVAL("dary_entries");
+        cfg->heapq_dary_entries = memtoll(val, NULL);
+        if (cfg->heapq_dary_entries < 0) {
+            err = "Invalid value for dary_entries";
+            goto error;
+        }
     } else {
         snprintf(msg, sizeof(msg), "Unknown item: \"%s\" in section: [%s]", name, section);
         err = msg;
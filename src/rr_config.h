@@ -30,6 +30,11 @@ typedef struct rr_configuration {
     int tcp_backlog;
     int lazyfree_server_del;
     int max_dbs;
+    int io_threads;
+    int reactors;
+    int event_backend;
+    int client_timeout;
+    long long heapq_dary_entries;
 } rr_configuration;
 
 typedef struct rr_configuration_context {
@@ -1,8 +1,15 @@
+#include "rr_ftmacro.h"
 #include "rr_datetime.h"
 
 #include <stddef.h>
 #include <sys/time.h>
 #include <stdbool.h>
+#include <time.h>
+#if defined(USE_PROCESSOR_CLOCK) && defined(__x86_64__)
+#define HAVE_PROCESSOR_CLOCK
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 void rr_dt_now(long *sec, long *ms) {
     struct timeval tv;
@@ -50,3 +57,65 @@ long long rr_dt_ustime(void) {
 mstime_t rr_dt_mstime(void) {
     return rr_dt_ustime()/1000;
 }
+
+static long long clock_monotonic_us(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((long long)ts.tv_sec)*1000000 + ts.tv_nsec/1000;
+}
+
+#ifdef HAVE_PROCESSOR_CLOCK
+/* How long the TSC is calibrated against the clock of the system, the error
+ * of the calibration shrinks as it gets longer */
+#define TSC_CALIBRATION_US 20000
+
+static double tsc_us_per_tick = 0;  /* zero as long as the TSC is not used */
+static unsigned long long tsc_origin;
+static long long tsc_origin_us;
+
+/* The TSC runs at a constant rate regardless of the frequency and the sleep
+ * states of the cores only when it is invariant */
+static bool tsc_is_invariant(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) return false;
+    return (edx & (1 << 8)) != 0;
+}
+#endif
+
+void rr_dt_monotonic_init(void) {
+#ifdef HAVE_PROCESSOR_CLOCK
+    struct timespec ts = {0, TSC_CALIBRATION_US*1000};
+    unsigned long long tsc;
+    long long us;
+
+    if (tsc_us_per_tick || !tsc_is_invariant()) return;
+    us = clock_monotonic_us();
+    tsc = __rdtsc();
+    nanosleep(&ts, NULL);
+    tsc_origin_us = clock_monotonic_us();
+    tsc_origin = __rdtsc();
+    if (tsc_origin > tsc && tsc_origin_us > us)
+        tsc_us_per_tick = (double) (tsc_origin_us - us)/(tsc_origin - tsc);
+#endif
+}
+
+const char *rr_dt_monotonic_clock(void) {
+#ifdef HAVE_PROCESSOR_CLOCK
+    if (tsc_us_per_tick) return "tsc";
+#endif
+    return "clock_gettime";
+}
+
+long long rr_dt_monotonic_us(void) {
+#ifdef HAVE_PROCESSOR_CLOCK
+    if (tsc_us_per_tick)
+        return tsc_origin_us + (long long) ((long long) (__rdtsc() - tsc_origin)*tsc_us_per_tick);
+#endif
+    return clock_monotonic_us();
+}
+
+mstime_t rr_dt_monotonic_ms(void) {
+    return rr_dt_monotonic_us()/1000;
+}
@@ -22,4 +22,19 @@ bool rr_dt_is_past(long sec, long ms);
 long long rr_dt_ustime(void);
 mstime_t rr_dt_mstime(void);
 
+/*
+ * Monotonic clock, for the delays and the durations, which unlike the wall
+ * clock does not jump when the system time is changed. Its origin is
+ * arbitrary, so its values are only meaningful relative to each other.
+ *
+ * Built with USE_PROCESSOR_CLOCK on x86-64, it reads the TSC of the processor
+ * when it is invariant, at the cost of a calibration at startup against the
+ * clock of the system. rr_dt_monotonic_init must then be called once before
+ * any thread is started, the clock of the system is used until then.
+ */
+void rr_dt_monotonic_init(void);
+const char *rr_dt_monotonic_clock(void);
+long long rr_dt_monotonic_us(void);
+mstime_t rr_dt_monotonic_ms(void);
+
 #endif
@@ -1,12 +1,16 @@
+#include "rr_ftmacro.h"
+
 #include "rr_db.h"
 #include "rr_server.h"
 #include "robj.h"
 #include "sds.h"
 #include "rr_malloc.h"
 #include "rr_bgtask.h"
+#include "rr_array.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 rrdb_t *rr_db_create(int id) {
     rrdb_t *db;
@@ -14,6 +18,9 @@ rrdb_t *rr_db_create(int id) {
     db = rr_malloc(sizeof(*db));
     db->dict = dict_create();
     dict_set_freecb(db->dict, rr_obj_free_callback);
+    db->blocking_keys = dict_create();
+    db->ready_keys = dict_create();
+    db->leased_keys = dict_create();
     db->id = id;
 
     return db;
@@ -186,3 +193,77 @@ void rr_cmd_type(struct rr_client_t *c) {
     }
     reply_add_status(c, type);
 }
+
+void rr_cmd_scan(struct rr_client_t *c) {
+    rr_db_scan_generic(c, c->db->dict, 1, DICT_KEY);
+}
+
+/* Cursor based incremental scan shared by SCAN and RSCAN.
+ *
+ * The cursor is the last key returned by the previous call. As the dict keeps
+ * its keys ordered, the scan resumes by seeking right after the cursor, so
+ * every call costs O(key length + COUNT) no matter how large the dict is, and
+ * keys present during the whole scan are returned exactly once. An empty
+ * cursor starts a new scan, and is returned once the scan is complete.
+ *
+ * The cursor is at argv[idx], followed by the options [MATCH prefix] and
+ * [COUNT n]. MATCH only takes a prefix, so that the scan stays within the
+ * subtree of the prefix. */
+void rr_db_scan_generic(struct rr_client_t *c, dict_t *dict, int idx, int flags) {
+    const char *cursor = c->argv[idx]->ptr, *prefix = "", *start;
+    dict_iterator_t iter;
+    array_t *kvs;
+    long count = SCAN_DEFAULT_COUNT, multiplier = 0, i, n;
+    size_t prefixlen;
+    bool done = true;
+
+    for (i = idx+1; i < c->argc; i += 2) {
+        if (!strcasecmp(c->argv[i]->ptr, "match") && i+1 < c->argc) {
+            prefix = c->argv[i+1]->ptr;
+        } else if (!strcasecmp(c->argv[i]->ptr, "count") && i+1 < c->argc) {
+            if (getLongFromObjectOrReply(c, c->argv[i+1], &count, NULL)) return;
+            if (count < 1) {
+                reply_add_obj(c, shared.syntaxerr);
+                return;
+            }
+        } else {
+            reply_add_obj(c, shared.syntaxerr);
+            return;
+        }
+    }
+
+    if (flags & DICT_KEY) multiplier++;
+    if (flags & DICT_VAL) multiplier++;
+
+    prefixlen = strlen(prefix);
+    start = strcmp(cursor, prefix) > 0 ? cursor : prefix;
+    dict_iter_init_from(dict, start, &iter);
+    kvs = array_create(count < 1024 ? count : 1024, sizeof(dict_kv_t));
+    while (dict_iter_hasnext(&iter)) {
+        dict_kv_t kv = dict_iter_next(&iter);
+
+        if (strncmp(kv.key, prefix, prefixlen)) break;
+        if (*cursor && !strcmp(kv.key, cursor)) continue;
+
+        /* Stop once we've got enough keys and there is more to come. The empty
+         * key can't be used as a cursor, so it never ends an unfinished scan */
+        n = ARRAY_LEN(kvs);
+        if (n >= count && ((dict_kv_t *) ARRAY_AT(kvs, n-1))->key[0]) {
+            done = false;
+            break;
+        }
+        *(dict_kv_t *) array_push(kvs) = kv;
+    }
+    dict_iter_release(&iter);
+
+    n = ARRAY_LEN(kvs);
+    reply_add_multi_bulk_len(c, 2);
+    reply_add_bulk_cstr(c, done ? "" : ((dict_kv_t *) ARRAY_AT(kvs, n-1))->key);
+    reply_add_multi_bulk_len(c, n * multiplier);
+    for (i = 0; i < n; i++) {
+        dict_kv_t *kv = ARRAY_AT(kvs, i);
+        if (flags & DICT_KEY) reply_add_bulk_cstr(c, kv->key);
+        if (flags & DICT_VAL) reply_add_bulk_obj(c, kv->value);
+    }
+    array_free(kvs);
+}
@@ -7,8 +7,11 @@
 #include <stdbool.h>
 
 typedef struct rrdb_t {
-    int id;        /* database ID */
-    dict_t *dict;  /* database keyspace */
+    int id;                /* database ID */
+    dict_t *dict;          /* database keyspace */
+    dict_t *blocking_keys; /* keys with blocked clients -> list of clients */
+    dict_t *ready_keys;    /* blocked keys signaled as ready */
+    dict_t *leased_keys;   /* heapq keys with leased items -> key object */
 } rrdb_t;
 
 rrdb_t *rr_db_create(int id);
@@ -29,5 +32,12 @@ void rr_cmd_del(struct rr_client_t *c);
 void rr_cmd_len(struct rr_client_t *c);
 void rr_cmd_exists(struct rr_client_t *c);
 void rr_cmd_type(struct rr_client_t *c);
+void rr_cmd_scan(struct rr_client_t *c);
+
+/* Keys returned by a scan call unless COUNT tells otherwise */
+#define SCAN_DEFAULT_COUNT 10
+
+/* Generic cursor based scan, see SCAN and RSCAN */
+void rr_db_scan_generic(struct rr_client_t *c, dict_t *dict, int idx, int flags);
 
 #endif /* ifndef RR_DB_H */
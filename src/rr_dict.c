@@ -9,10 +9,12 @@
  * http://github.com/martanne/vis
  *
  * Added features:
- *  - non-recursive style iterator
+ *  - non-recursive style iterator, which doesn't allocate for most trees
  *  - custom memory cleanup callback when emptying dict
  *  - overwrite the value for the existing keys
  *  - keep track the size of dict
+ *  - keep track the number of leaves under every internal node, for
+ *    counting prefixes, ranking keys and looking up keys by position
  *
  * Further information about the data structure can be found at:
  *  http://cr.yp.to/critbit.html
@@ -20,7 +22,6 @@
  *  http://ccodearchive.net/info/strmap.html
  */
 
-#include "adlist.h"
 #include "rr_dict.h"
 #include "rr_malloc.h"
 
@@ -49,19 +50,29 @@ struct Dict {
     void *v;
 };
 
+/* The byte index is 32 bits wide so that the leaf count fits without growing
+ * the node, keys are way shorter than 4GB as the protocol limits them to 512MB */
 struct Node {
-    Dict child[2];  /* children could be either leaf and internal nodes */
-    size_t byte_idx;  /* the byte index where the first bit differs */
-    uint8_t bit_idx;  /* the bit index where two children differ */
-};
-
-/* The dict iterator implemented by linked list */
-struct dict_iterator_t {
-    list *stack;
+    Dict child[2];      /* children could be either leaf and internal nodes */
+    unsigned long count;  /* number of leaves in this subtree */
+    uint32_t byte_idx;  /* the byte index where the first bit differs */
+    uint8_t bit_idx;    /* the bit index where two children differ */
 };
 
 #define EMPTY_NODE(d) ((d)->u.n == NULL)
 
+/* Which child to follow for the given key at the internal node */
+static inline uint8_t child_dir(Node *node, const uint8_t *bytes, size_t len) {
+    if (node->byte_idx >= len) return 0;
+    return (bytes[node->byte_idx] >> node->bit_idx) & 1;
+}
+
+/* Number of leaves, i.e. keys, in the subtree */
+static inline unsigned long leaves(Dict *n) {
+    if (EMPTY_NODE(n)) return 0;
+    return n->v ? 1 : n->u.n->count;
+}
+
 unsigned long dict_length(dict_t *dict) {
     return dict->size;
 }
@@ -162,6 +173,51 @@ bool dict_contains(dict_t *dict, const char *key) {
     return dict_get(dict, key) != NULL;
 }
 
+unsigned long dict_count_prefix(dict_t *dict, const char *prefix) {
+    return leaves(get_prefix(dict->dict, prefix));
+}
+
+bool dict_rank(dict_t *dict, const char *key, unsigned long *rank) {
+    Dict *n = dict->dict;
+    size_t len = strlen(key);
+    const uint8_t *bytes = (const uint8_t *) key;
+    unsigned long r = 0;
+
+    if (EMPTY_NODE(n)) return false;
+
+    /* Every time we turn right, the keys on the left are less than the key */
+    while (!n->v) {
+        uint8_t dir = child_dir(n->u.n, bytes, len);
+
+        if (dir) r += leaves(&n->u.n->child[0]);
+        n = &n->u.n->child[dir];
+    }
+    if (strcmp(key, n->u.s)) return false;
+
+    *rank = r;
+    return true;
+}
+
+bool dict_nth(dict_t *dict, unsigned long index, dict_kv_t *kv) {
+    Dict *n = dict->dict;
+
+    if (index >= dict->size) return false;
+
+    while (!n->v) {
+        unsigned long left = leaves(&n->u.n->child[0]);
+
+        if (index < left) {
+            n = &n->u.n->child[0];
+        } else {
+            index -= left;
+            n = &n->u.n->child[1];
+        }
+    }
+    kv->key = n->u.s;
+    kv->value = n->v;
+    return true;
+}
+
 bool dict_set(dict_t *dict, const char *k, void *value) {
     Dict *d = dict->dict, *n;
     size_t len = strlen(k);
@@ -211,6 +267,7 @@ bool dict_set(dict_t *dict, const char *k, void *value) {
     }
     newn->byte_idx = byte_idx;
     newn->bit_idx = bit_idx;
+    newn->count = 1;
     newn->child[new_dir].v = value;
     newn->child[new_dir].u.s = key;
 
@@ -227,9 +284,11 @@ bool dict_set(dict_t *dict, const char *k, void *value) {
             uint8_t c = bytes[n->u.n->byte_idx];
             direction = (c >> n->u.n->bit_idx) & 1;
         }
+        n->u.n->count++;
         n = &n->u.n->child[direction];
     }
 
+    newn->count += leaves(n);
     newn->child[!new_dir] = *n;
     n->u.n = newn;
     n->v = NULL;
@@ -240,7 +299,7 @@ bool dict_set(dict_t *dict, const char *k, void *value) {
 void *dict_del(dict_t *dict, const char *key) {
     size_t len = strlen(key);
     const uint8_t *bytes = (const uint8_t *) key;
-    Dict *parent = NULL, *n = dict->dict;
+    Dict *parent = NULL, *n = dict->dict, *d;
     void *value = NULL;
     uint8_t direction;
 
@@ -263,6 +322,10 @@ void *dict_del(dict_t *dict, const char *key) {
     /* Did we find it? */
     if (strcmp(key, n->u.s)) return NULL;
 
+    /* Walk down again to update the leaf counts on the way */
+    for (d = dict->dict; d != n; d = &d->u.n->child[child_dir(d->u.n, bytes, len)])
+        d->u.n->count--;
+
     rr_free((char *) n->u.s);
     value = n->v;
     dict->size--;
@@ -335,70 +398,164 @@ bool dict_copy(dict_t *dest, dict_t *src) {
     return rv;
 }
 
-static dict_iterator_t *iter_create(Dict *dict, unsigned long size) {
-    Dict *node;
+static void iter_push(dict_iterator_t *iter, Dict *node) {
+    if (iter->top == iter->cap) {
+        void **stack;
 
-    dict_iterator_t *iter = rr_malloc(sizeof(*iter));
-    if (!iter) return NULL;
-    iter->stack = listCreate();
-    if (size == 0) return iter;
+        if (iter->stack == iter->inline_stack) {
+            stack = rr_malloc(sizeof(void *) * iter->cap * 2);
+            memcpy(stack, iter->inline_stack, sizeof(void *) * iter->cap);
+        } else {
+            stack = rr_realloc(iter->stack, sizeof(void *) * iter->cap * 2);
+        }
+        iter->stack = stack;
+        iter->cap *= 2;
+    }
+    iter->stack[iter->top++] = node;
+}
+
+/* Walk down to the first leaf of the given subtree in the iteration order,
+ * i.e. the leftmost one or the rightmost one for reverse iterators. The
+ * other children met on the way are pushed to the stack to be visited later */
+static Dict *iter_descend(dict_iterator_t *iter, Dict *node) {
+    int first = iter->reverse;
 
-    node = dict;
-    listAddNodeHead(iter->stack, node);
     while (!node->v) {
-        node = &node->u.n->child[0];
-        listAddNodeHead(iter->stack, node);
+        iter_push(iter, &node->u.n->child[!first]);
+        node = &node->u.n->child[first];
     }
-    return iter;
+    return node;
+}
+
+static void iter_setup(dict_iterator_t *iter, int reverse) {
+    iter->stack = iter->inline_stack;
+    iter->top = 0;
+    iter->cap = DICT_ITER_STACK_SIZE;
+    iter->next = NULL;
+    iter->reverse = reverse;
+}
+
+static void iter_init(dict_iterator_t *iter, Dict *dict, int reverse) {
+    iter_setup(iter, reverse);
+    if (!EMPTY_NODE(dict)) iter->next = iter_descend(iter, dict);
+}
+
+void dict_iter_init(dict_t *dict, dict_iterator_t *iter) {
+    iter_init(iter, dict->dict, 0);
+}
+
+void dict_iter_init_rev(dict_t *dict, dict_iterator_t *iter) {
+    iter_init(iter, dict->dict, 1);
+}
+
+void dict_iter_init_prefix(dict_t *dict, const char *prefix, dict_iterator_t *iter) {
+    iter_init(iter, get_prefix(dict->dict, prefix), 0);
+}
+
+/* Position the iterator at the given key, or at the first key after it in the
+ * iteration order if it's missing. It takes two walks down the tree, the first
+ * one finds the critical bit where the key departs from the tree, the second
+ * one records the pending subtrees on the way to that bit. */
+static void iter_seek(Dict *n, const char *key, dict_iterator_t *iter) {
+    Dict *leaf;
+    size_t len = strlen(key), byte_idx;
+    const uint8_t *bytes = (const uint8_t *) key;
+    uint8_t bit_idx, new_dir, diff;
+    int first = iter->reverse;
+
+    if (EMPTY_NODE(n)) return;
+
+    leaf = closest(n, key);
+    for (byte_idx = 0; leaf->u.s[byte_idx] == key[byte_idx]; byte_idx++) {
+        if (key[byte_idx] == '\0') {
+            /* Exact match, walk down to it */
+            while (!n->v) {
+                uint8_t direction = 0;
+
+                if (n->u.n->byte_idx < len)
+                    direction = (bytes[n->u.n->byte_idx] >> n->u.n->bit_idx) & 1;
+                if (direction == first) iter_push(iter, &n->u.n->child[!first]);
+                n = &n->u.n->child[direction];
+            }
+            iter->next = n;
+            return;
+        }
+    }
+
+    diff = (uint8_t)leaf->u.s[byte_idx] ^ bytes[byte_idx];
+    for (bit_idx = 0; diff >>= 1; bit_idx++);
+    new_dir = (bytes[byte_idx] >> bit_idx) & 1;
+
+    /* Same walk as the insertion of the key in dict_set */
+    while (!n->v) {
+        uint8_t direction = 0;
+
+        if (n->u.n->byte_idx > byte_idx) break;
+        if (n->u.n->byte_idx == byte_idx && n->u.n->bit_idx < bit_idx) break;
+
+        if (n->u.n->byte_idx < len)
+            direction = (bytes[n->u.n->byte_idx] >> n->u.n->bit_idx) & 1;
+        if (direction == first) iter_push(iter, &n->u.n->child[!first]);
+        n = &n->u.n->child[direction];
+    }
+
+    /* The key would sit either before or after the whole subtree of n. If it's
+     * before (in the iteration order) the first leaf of n is what we are
+     * after, otherwise resume from the next pending subtree */
+    if (new_dir == first)
+        iter->next = iter_descend(iter, n);
+    else
+        iter->next = iter->top ? iter_descend(iter, iter->stack[--iter->top]) : NULL;
+}
+
+void dict_iter_init_from(dict_t *dict, const char *key, dict_iterator_t *iter) {
+    iter_setup(iter, 0);
+    iter_seek(dict->dict, key, iter);
+}
+
+void dict_iter_init_rev_from(dict_t *dict, const char *key, dict_iterator_t *iter) {
+    iter_setup(iter, 1);
+    iter_seek(dict->dict, key, iter);
+}
+
+void dict_iter_release(dict_iterator_t *iter) {
+    if (iter->stack != iter->inline_stack) rr_free(iter->stack);
+    iter_setup(iter, iter->reverse);
 }
 
 dict_iterator_t *dict_get_prefix(dict_t *dict, const char *prefix) {
-    Dict *d;
+    dict_iterator_t *iter = rr_malloc(sizeof(*iter));
 
-    d = get_prefix(dict->dict, prefix);
-    return iter_create(d, dict->size);
+    if (iter) dict_iter_init_prefix(dict, prefix, iter);
+    return iter;
 }
 
 dict_iterator_t *dict_iter_create(dict_t *dict) {
-    return iter_create(dict->dict, dict->size);
+    dict_iterator_t *iter = rr_malloc(sizeof(*iter));
+
+    if (iter) dict_iter_init(dict, iter);
+    return iter;
 }
 
 bool dict_iter_hasnext(dict_iterator_t *iter) {
-   return listLength(iter->stack);
+    return iter->next != NULL;
 }
 
 dict_kv_t dict_iter_next(dict_iterator_t *iter) {
     dict_kv_t kv;
-    listNode *ln;
-    Dict *dict, *node;
-
-    ln = listFirst(iter->stack);
-    dict = (Dict*) ln->value;
-    /* The toppest item in the stack must be a leaf node */
-    assert(dict->v);
-    kv.key = dict->u.s;
-    kv.value = dict->v;
-    listDelNode(iter->stack, ln);
+    Dict *leaf = iter->next;
 
-    if (!listLength(iter->stack)) return kv;
+    /* The next node must be a leaf node */
+    assert(leaf && leaf->v);
+    kv.key = leaf->u.s;
+    kv.value = leaf->v;
 
     /* Move iterator to the next leaf node */
-    ln = listFirst(iter->stack);
-    dict = (Dict*) ln->value;
-    listDelNode(iter->stack, ln);
-    /* This node must be an internal node */
-    assert(!dict->v);
-    node = &dict->u.n->child[1];
-    listAddNodeHead(iter->stack, node);
-    while (!node->v) {
-        node = &node->u.n->child[0];
-        listAddNodeHead(iter->stack, node);
-    }
-
+    iter->next = iter->top ? iter_descend(iter, iter->stack[--iter->top]) : NULL;
     return kv;
 }
 
 void dict_iter_free(dict_iterator_t *iter) {
-    listRelease(iter->stack);
+    dict_iter_release(iter);
     rr_free(iter);
 }
@@ -9,7 +9,6 @@
 typedef void (*dict_free_callback)(void *value);
 
 typedef struct dict_t dict_t;
-typedef struct dict_iterator_t dict_iterator_t;
 typedef struct dict_kv_t {
     const char *key;
     void *value;
@@ -18,6 +17,22 @@ typedef struct dict_kv_t {
 #define DICT_KEY 1
 #define DICT_VAL 2
 
+/* Number of pending subtrees the iterator can hold without allocating. It is
+ * bounded by the depth of the tree, deeper trees spill over to the heap. */
+#define DICT_ITER_STACK_SIZE 64
+
+/* The dict iterator, it can be either allocated on the stack and set up by
+ * dict_iter_init/dict_iter_init_prefix, or on the heap by dict_iter_create/
+ * dict_get_prefix. The fields are private to the dict. */
+typedef struct dict_iterator_t {
+    void *next;           /* next leaf to be returned, NULL if exhausted */
+    void **stack;         /* right subtrees yet to be visited */
+    unsigned long top;    /* number of subtrees in the stack */
+    unsigned long cap;    /* capacity of the stack */
+    int reverse;          /* iterate in descending order */
+    void *inline_stack[DICT_ITER_STACK_SIZE];
+} dict_iterator_t;
+
 dict_t *dict_create(void);
 void dict_free(dict_t *dict);
 bool dict_empty(dict_t *dict);
@@ -28,6 +43,17 @@ bool dict_contains(dict_t *dict, const char *key);
 bool dict_has_prefix(dict_t *dict, const char *prefix);
 void *dict_get(dict_t *dict, const char *key);
 
+/* Order statistics, all of them take O(key length) or O(depth of the tree).
+ *
+ * dict_count_prefix returns the number of keys with the given prefix.
+ * dict_rank gets the 0-based position of the key in the lexicographical order,
+ * returns false if the key is missing.
+ * dict_nth gets the key/value pair at the 0-based position, returns false if
+ * the index is out of range. */
+unsigned long dict_count_prefix(dict_t *dict, const char *prefix);
+bool dict_rank(dict_t *dict, const char *key, unsigned long *rank);
+bool dict_nth(dict_t *dict, unsigned long index, dict_kv_t *kv);
+
 /* Set a key value pair for the given dict.
  * If the key is already in the dict, the old value will be overwritten.
  * The user can specify a callback function to free the value.
@@ -43,6 +69,21 @@ bool dict_iter_hasnext(dict_iterator_t *iter);
 dict_kv_t dict_iter_next(dict_iterator_t *iter);
 void dict_iter_free(dict_iterator_t *iter);
 
+/* Set up a caller allocated iterator, over the entire dict or the keys
+ * matching the given prefix. dict_iter_release must be called once done */
+void dict_iter_init(dict_t *dict, dict_iterator_t *iter);
+void dict_iter_init_prefix(dict_t *dict, const char *prefix, dict_iterator_t *iter);
+/* Set up an iterator starting from the first key which is greater than or
+ * equal to the given key, the keys are iterated in lexicographical order */
+void dict_iter_init_from(dict_t *dict, const char *key, dict_iterator_t *iter);
+
+/* Reverse iterators, which iterate the keys in descending order, either over
+ * the entire dict or starting from the last key less than or equal to the
+ * given key */
+void dict_iter_init_rev(dict_t *dict, dict_iterator_t *iter);
+void dict_iter_init_rev_from(dict_t *dict, const char *key, dict_iterator_t *iter);
+void dict_iter_release(dict_iterator_t *iter);
+
 /* Foreach was implemented in a recursive fashion, so use it sparingly for
  * large dicts.
  * The callback function returns a boolean to signal whether it should break
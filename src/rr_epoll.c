@@ -125,3 +125,16 @@ static int el_context_poll(eventloop_t *el, struct timeval *tvp) {
     }
     return nevent;
 }
+
+static const el_backend_t el_backend_poll = {
+    "epoll",
+    el_context_create,
+    el_context_free,
+    el_context_add,
+    el_context_del,
+    el_context_poll,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
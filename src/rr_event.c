@@ -1,61 +1,179 @@
+#include "rr_ftmacro.h"
+
 #include "rr_event.h"
 #include "rr_datetime.h"
 #include "rr_logging.h"
 #include "rr_malloc.h"
 
-#include <assert.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <limits.h>
 #include <errno.h>
 
+/* Polling backend, one is picked for each event loop */
+typedef struct el_backend_t {
+    const char *name;
+    int (*create)(eventloop_t *el);
+    void (*free)(eventloop_t *el);
+    int (*add)(eventloop_t *el, int fd, int mask);
+    void (*del)(eventloop_t *el, int fd, int mask);
+    int (*poll)(eventloop_t *el, struct timeval *tvp);
+    /* Stream I/O, left to the system calls when NULL */
+    int (*stream)(eventloop_t *el, int fd);
+    ssize_t (*read)(eventloop_t *el, int fd, void *buf, size_t len);
+    ssize_t (*writev)(eventloop_t *el, int fd, const struct iovec *iov, void **refs, int iovcnt);
+    void (*close)(eventloop_t *el, int fd);
+} el_backend_t;
+
 #ifdef __linux__
 #include "rr_epoll.c"
+#include "rr_uring.c"
 #endif
 
 #if defined(__APPLE__) || defined(__FREEBSD__) || defined(__OPENBSD__) || defined(__NETBSD__)
 #include "rr_kqueue.c"
 #endif
 
-/* ev_timer_t callbacks for the queue */
-static inline void *timer_cpy(void *dst, const void *src) {
-    *(ev_timer_t *) dst = *(const ev_timer_t *) src;
-    return dst;
+/* States of the timers out of the wheel */
+#define TIMER_FIRING    -2  /* running its callback */
+#define TIMER_DELETED   -3  /* removed by its own callback */
+
+#define WHEEL_MASK          (EL_WHEEL_SLOTS-1)
+#define WHEEL_SPAN(level)   (1LL << (EL_WHEEL_BITS*(level)))
+#define WHEEL_INDEX(tick, level) ((int) (((tick) >> (EL_WHEEL_BITS*(level))) & WHEEL_MASK))
+
+static void timer_list_init(ev_timer_link_t *head) {
+    head->prev = head->next = head;
 }
 
-static inline int timer_cmp(const void *lv, const void *rv) {
-    const ev_timer_t *l = (const ev_timer_t *) lv;
-    const ev_timer_t *r = (const ev_timer_t *) rv;
+static void timer_list_append(ev_timer_link_t *head, ev_timer_t *t) {
+    t->link.prev = head->prev;
+    t->link.next = head;
+    head->prev->next = &t->link;
+    head->prev = &t->link;
+}
 
-    if ((l->sec < r->sec) || (l->sec == r->sec && l->ms < r->ms))
-        return -1;
-    else if (l->sec == r->sec && l->ms == r->ms)
-        return 0;
-    else
-        return 1;
+static void timer_list_unlink(ev_timer_t *t) {
+    t->link.prev->next = t->link.next;
+    t->link.next->prev = t->link.prev;
 }
 
-static inline void timer_swp(void *lv, void *rv) {
-    ev_timer_t tmp;
+/* Move all the timers of the list src to the empty list dst */
+static void timer_list_move(ev_timer_link_t *src, ev_timer_link_t *dst) {
+    if (src->next == src) {
+        timer_list_init(dst);
+        return;
+    }
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    timer_list_init(src);
+}
 
-    tmp = *(ev_timer_t *) lv;
-    *(ev_timer_t *) lv = *(ev_timer_t *) rv;
-    *(ev_timer_t *) rv = tmp;
+/* Put a timer in the slot of the level covering its delay. The timers beyond
+ * the last level go to its farthest slot, and move down the levels from there
+ * once they get close enough. */
+static void wheel_add(timer_wheel_t *w, ev_timer_t *t) {
+    long long when = t->when, delta = when - w->tick;
+    int level = 0;
+
+    if (delta < 0) {
+        when = w->tick;
+    } else if (delta >= WHEEL_SPAN(EL_WHEEL_LEVELS)) {
+        when = w->tick + WHEEL_SPAN(EL_WHEEL_LEVELS) - 1;
+        level = EL_WHEEL_LEVELS-1;
+    } else {
+        while (delta >= WHEEL_SPAN(level+1)) level++;
+    }
+    t->level = level;
+    t->slot = WHEEL_INDEX(when, level);
+    timer_list_append(&w->slots[level][t->slot], t);
+    w->used[level] |= 1ULL << t->slot;
 }
 
-eventloop_t *el_loop_create(int size) {
+static void wheel_del(timer_wheel_t *w, ev_timer_t *t) {
+    timer_list_unlink(t);
+    if (t->level >= 0 && w->slots[t->level][t->slot].next == &w->slots[t->level][t->slot])
+        w->used[t->level] &= ~(1ULL << t->slot);
+}
+
+/* Spread the timers of the current slot of a level over the levels below,
+ * returns the index of the slot */
+static int wheel_cascade(timer_wheel_t *w, int level) {
+    int index = WHEEL_INDEX(w->tick, level);
+    ev_timer_link_t timers;
+
+    timer_list_move(&w->slots[level][index], &timers);
+    w->used[level] &= ~(1ULL << index);
+    while (timers.next != &timers) {
+        ev_timer_t *t = (ev_timer_t *) timers.next;
+
+        timer_list_unlink(t);
+        wheel_add(w, t);
+    }
+    return index;
+}
+
+/* The earliest time the next timer may fire at. A timer of the first level
+ * fires at the time of its slot, the ones of the other levels at the start of
+ * their slot at the earliest. */
+static long long wheel_next(timer_wheel_t *w) {
+    long long next = LLONG_MAX, at;
+    int level, index, offset;
+    uint64_t used;
+
+    for (level = 0; level < EL_WHEEL_LEVELS; level++) {
+        if (!w->used[level]) continue;
+        /* The current slot of the upper levels has been cascaded already, so
+         * the timers found there belong to the next turn */
+        index = WHEEL_INDEX(w->tick, level) + (level > 0);
+        used = w->used[level];
+        used = index % 64 ? (used >> index % 64) | (used << (64 - index % 64)) : used;
+        offset = __builtin_ctzll(used) + (level > 0);
+        at = ((w->tick >> (EL_WHEEL_BITS*level)) + offset) << (EL_WHEEL_BITS*level);
+        if (at < next) next = at;
+    }
+    return next;
+}
+
+eventloop_t *el_loop_create(int size, int backend) {
     eventloop_t *el;
-    int i;
+    int i, j;
 
     if ((el = rr_malloc(sizeof(*el))) == NULL) goto err;
     el->events = rr_malloc(sizeof(event_t)*size);
     el->fired = rr_malloc(sizeof(fired_event_t)*size);
-    el->timers = minheap_create(1, sizeof(ev_timer_t), timer_cmp, timer_cpy, timer_swp);
-    if (el->events == NULL || el->fired == NULL || el->timers == NULL) goto err;
+    if (el->events == NULL || el->fired == NULL) goto err;
     el->size = size;
     el->stop = 0;
     el->maxfd = -1;
     el->before_polling = NULL;
-    if (el_context_create(el) == -1) goto err;
+    el->ref_hold = NULL;
+    el->ref_release = NULL;
+    el->now = rr_dt_monotonic_ms();
+    el->timers.tick = el->now;
+    el->timers.count = 0;
+    for (i = 0; i < EL_WHEEL_LEVELS; i++) {
+        el->timers.used[i] = 0;
+        for (j = 0; j < EL_WHEEL_SLOTS; j++)
+            timer_list_init(&el->timers.slots[i][j]);
+    }
+    el->backend = &el_backend_poll;
+#ifdef __linux__
+    if (backend == RR_EV_BACKEND_IO_URING) {
+        if (el_backend_uring.create(el) == 0)
+            el->backend = &el_backend_uring;
+        else
+            rr_log(RR_LOG_WARNING, "io_uring is not available, falling back to %s",
+                   el->backend->name);
+    }
+#else
+    if (backend == RR_EV_BACKEND_IO_URING)
+        rr_log(RR_LOG_WARNING, "io_uring is only available on Linux, falling back to %s",
+               el->backend->name);
+#endif
+    if (el->backend == &el_backend_poll && el->backend->create(el) == -1) goto err;
     for (i = 0; i < size; i++)
         el->events[i].mask = RR_EV_NONE;
     return el;
@@ -64,15 +182,27 @@ err:
     if (el) {
         rr_free(el->events);
         rr_free(el->fired);
-        minheap_free(el->timers);
         rr_free(el);
     }
     return NULL;
 }
 
 void el_loop_free(eventloop_t *el) {
-    el_context_free(el);
-    minheap_free(el->timers);
+    int i, j;
+
+    el->backend->free(el);
+    for (i = 0; i < EL_WHEEL_LEVELS; i++) {
+        for (j = 0; j < EL_WHEEL_SLOTS; j++) {
+            ev_timer_link_t *slot = &el->timers.slots[i][j];
+
+            while (slot->next != slot) {
+                ev_timer_t *t = (ev_timer_t *) slot->next;
+
+                timer_list_unlink(t);
+                rr_free(t);
+            }
+        }
+    }
     rr_free(el->events);
     rr_free(el->fired);
     rr_free(el);
@@ -82,10 +212,23 @@ void el_loop_set_before_polling(eventloop_t *el, before_polling_callback *callba
     el->before_polling = callback;
 }
 
+void el_loop_set_ref_procs(eventloop_t *el, ref_callback *hold, ref_callback *release) {
+    el->ref_hold = hold;
+    el->ref_release = release;
+}
+
+const char *el_loop_backend(eventloop_t *el) {
+    return el->backend->name;
+}
+
 int el_loop_get_size(eventloop_t *el) {
     return el->size;
 }
 
+long long el_loop_now(eventloop_t *el) {
+    return el->now;
+}
+
 void el_loop_stop(eventloop_t *el) {
     el->stop = 1;
 }
@@ -97,7 +240,7 @@ int el_event_add(eventloop_t *el, int fd, int mask, ev_callback *proc, void *ud)
     }
     event_t *e = &el->events[fd];
 
-    if (el_context_add(el, fd, mask) == -1) return RR_EV_ERR;
+    if (el->backend->add(el, fd, mask) == -1) return RR_EV_ERR;
     e->mask |= mask;
     if (mask & RR_EV_READ) e->read_cb = proc;
     if (mask & RR_EV_WRITE) e->write_cb = proc;
@@ -111,7 +254,7 @@ void el_event_del(eventloop_t *el, int fd, int mask) {
     event_t *e = &el->events[fd];
     if (e->mask == RR_EV_NONE) return;
 
-    el_context_del(el, fd, mask);
+    el->backend->del(el, fd, mask);
     e->mask = e->mask & (~mask);
     if (fd == el->maxfd && e->mask == RR_EV_NONE) {
         /* Update the max fd */
@@ -123,6 +266,38 @@ void el_event_del(eventloop_t *el, int fd, int mask) {
     }
 }
 
+int el_stream_open(eventloop_t *el, int fd) {
+    if (fd >= el->size) {
+        errno = ERANGE;
+        return RR_EV_ERR;
+    }
+    if (el->backend->stream && el->backend->stream(el, fd) == -1) return RR_EV_ERR;
+    return RR_EV_OK;
+}
+
+ssize_t el_read(eventloop_t *el, int fd, void *buf, size_t len) {
+    if (el->backend->read) return el->backend->read(el, fd, buf, len);
+    return read(fd, buf, len);
+}
+
+ssize_t el_writev(eventloop_t *el, int fd, const struct iovec *iov, int iovcnt) {
+    if (el->backend->writev) return el->backend->writev(el, fd, iov, NULL, iovcnt);
+    return writev(fd, iov, iovcnt);
+}
+
+ssize_t el_writev_ref(eventloop_t *el, int fd, const struct iovec *iov, void **refs, int iovcnt) {
+    if (el->backend->writev) return el->backend->writev(el, fd, iov, refs, iovcnt);
+    return writev(fd, iov, iovcnt);
+}
+
+void el_close(eventloop_t *el, int fd) {
+    if (el->backend->close && fd < el->size) {
+        el->backend->close(el, fd);
+        return;
+    }
+    close(fd);
+}
+
 int el_event_get(eventloop_t *el, int fd) {
     if (fd >= el->size) return RR_EV_NONE;
     event_t *e = &el->events[fd];
@@ -134,7 +309,8 @@ int el_loop_poll(eventloop_t *el, struct timeval *tvp) {
     int processed = 0, nevents;
     int j;
 
-    nevents = el_context_poll(el, tvp);
+    nevents = el->backend->poll(el, tvp);
+    el->now = rr_dt_monotonic_ms();
     for (j = 0; j < nevents; j++) {
         event_t *e = &el->events[el->fired[j].fd];
         int mask = el->fired[j].mask;
@@ -158,55 +334,97 @@ int el_loop_poll(eventloop_t *el, struct timeval *tvp) {
     return processed;
 }
 
-int el_timer_add(eventloop_t *el, long long milliseconds, timer_callback *proc, void *ud) {
-    ev_timer_t t;
+ev_timer_t *el_timer_add(eventloop_t *el, long long milliseconds, timer_callback *proc, void *ud) {
+    ev_timer_t *t;
 
-    rr_dt_expire_at(milliseconds, &t.sec, &t.ms);
-    t.timer_cb = proc;
-    t.ud = ud;
-    if (minheap_push(el->timers, &t)) return RR_EV_ERR;
-    return RR_EV_OK;
+    if ((t = rr_malloc(sizeof(*t))) == NULL) return NULL;
+    t->when = el->now + milliseconds;
+    t->timer_cb = proc;
+    t->ud = ud;
+    wheel_add(&el->timers, t);
+    el->timers.count++;
+    return t;
 }
 
-int el_timer_process(eventloop_t *el) {
-    int processed = 0, ret;
-    uint32_t len = minheap_len(el->timers);
-
-    while (len) {
-        ev_timer_t *t = (ev_timer_t *) minheap_min(el->timers);
-        if (!rr_dt_is_past(t->sec, t->ms)) break;
-
-        t = (ev_timer_t *) minheap_pop(el->timers);
-        long long millisecond = t->timer_cb(el, t->ud);
-        /* if the timer is still active, push it back to heap */
-        if (millisecond > 0) {
-            rr_dt_expire_at(millisecond, &t->sec, &t->ms);
-            ret = minheap_push(el->timers, t);
-            assert(!ret);
+void el_timer_del(eventloop_t *el, ev_timer_t *t) {
+    if (t->level == TIMER_DELETED) return;
+    /* Left for el_timer_process to free once the callback returns */
+    if (t->level == TIMER_FIRING) {
+        t->level = TIMER_DELETED;
+        return;
+    }
+    wheel_del(&el->timers, t);
+    el->timers.count--;
+    rr_free(t);
+}
+
+/* Fire the timers of the expired list one by one, as their callbacks may
+ * remove the ones after them */
+static int el_timer_fire(eventloop_t *el, ev_timer_link_t *expired, long long now) {
+    int processed = 0;
+
+    while (expired->next != expired) {
+        ev_timer_t *t = (ev_timer_t *) expired->next;
+        long long millisecond;
+
+        timer_list_unlink(t);
+        t->level = TIMER_FIRING;
+        millisecond = t->timer_cb(el, t->ud);
+        /* if the timer is still active, put it back to the wheel */
+        if (millisecond > 0 && t->level != TIMER_DELETED) {
+            t->when = now + millisecond;
+            wheel_add(&el->timers, t);
+        } else {
+            el->timers.count--;
+            rr_free(t);
         }
         processed++;
-        len--;
     }
     return processed;
 }
 
-static bool el_poll_get_timeout(eventloop_t *el, struct timeval *tvp) {
-    long now_sec, now_ms;
+int el_timer_process(eventloop_t *el) {
+    timer_wheel_t *w = &el->timers;
+    long long now = el->now;
+    ev_timer_link_t expired;
+    int processed = 0, index, level;
+
+    while (w->tick <= now) {
+        if (!w->count) {
+            w->tick = now;
+            break;
+        }
+        index = WHEEL_INDEX(w->tick, 0);
+        if (index == 0) {
+            /* A turn of the first level is over, cascade the timers of the
+             * next slot of the upper levels */
+            for (level = 1; level < EL_WHEEL_LEVELS && wheel_cascade(w, level) == 0; level++);
+        } else if (!(w->used[0] >> index)) {
+            /* Nothing left in this turn of the first level */
+            w->tick = (w->tick | WHEEL_MASK) + 1;
+            if (w->tick > now + 1) w->tick = now + 1;
+            continue;
+        }
+
+        timer_list_move(&w->slots[0][index], &expired);
+        w->used[0] &= ~(1ULL << index);
+        w->tick++;
+        processed += el_timer_fire(el, &expired, now);
+    }
+    return processed;
+}
 
-    if (!minheap_len(el->timers)) return false;
+static bool el_poll_get_timeout(eventloop_t *el, struct timeval *tvp) {
+    long long ms;
 
-    ev_timer_t *t = (ev_timer_t *) minheap_min(el->timers);
-    rr_dt_now(&now_sec, &now_ms);
+    if (!el->timers.count) return false;
 
-    tvp->tv_sec = t->sec - now_sec;
-    if (t->ms < now_ms) {
-        tvp->tv_usec = ((t->ms+1000) - now_ms)*1000;
-        tvp->tv_sec--;
-    } else {
-        tvp->tv_usec = (t->ms - now_ms)*1000;
-    }
-    if (tvp->tv_sec < 0) tvp->tv_sec = 0;
-    if (tvp->tv_usec < 0) tvp->tv_usec = 0;
+    /* The time is refreshed, the iteration may have taken a while since */
+    el->now = rr_dt_monotonic_ms();
+    ms = wheel_next(&el->timers) - el->now;
+    if (ms < 0) ms = 0;
+    tvp->tv_sec = ms/1000;
+    tvp->tv_usec = (ms%1000)*1000;
     return true;
 }
 
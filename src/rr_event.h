@@ -1,9 +1,10 @@
 #ifndef _RR_EVENT_H
 #define _RR_EVENT_H
 
-#include "rr_minheap.h"
-
+#include <stdint.h>
 #include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
 
 #define   RR_EV_OK      0
 #define   RR_EV_ERR     -1
@@ -12,11 +13,17 @@
 #define   RR_EV_READ    1
 #define   RR_EV_WRITE   2
 
+/* Polling backends, the default one is epoll or kqueue */
+#define   RR_EV_BACKEND_DEFAULT   0
+#define   RR_EV_BACKEND_IO_URING  1
+
 struct eventloop_t;
+struct el_backend_t;
 
 typedef void ev_callback(struct eventloop_t *el, int fd, void *ud, int mask);
 typedef int timer_callback(struct eventloop_t *el, void *ud);
 typedef void before_polling_callback(struct eventloop_t *el);
+typedef void ref_callback(void *ref);
 
 /* Event context */
 typedef struct event_t {
@@ -32,28 +39,62 @@ typedef struct fired_event_t {
     int mask;
 } fired_event_t;
 
-/* Timer event */
+/*
+ * Timers are kept in a hierarchical timing wheel of EL_WHEEL_LEVELS levels of
+ * EL_WHEEL_SLOTS slots. A slot of the first level spans one millisecond, and
+ * the slots of every other level span a whole turn of the level below.
+ */
+#define   EL_WHEEL_BITS     6
+#define   EL_WHEEL_SLOTS    (1 << EL_WHEEL_BITS) /* as many as the bits of used[] */
+#define   EL_WHEEL_LEVELS   4
+
+/* Links of the timers of a slot, the slot itself being the head of the list */
+typedef struct ev_timer_link_t {
+    struct ev_timer_link_t *prev;
+    struct ev_timer_link_t *next;
+} ev_timer_link_t;
+
+/* Timer event, which is also the handle of the timer */
 typedef struct ev_timer_t {
-    long sec;                 /* fire timer at: second part */
-    long ms;                  /* fire timer at: millisecond part */
+    ev_timer_link_t link;     /* links in the list of its slot */
+    long long when;           /* fire timer at, in milliseconds */
+    int level;                /* level of its slot, or one of the TIMER_* states */
+    int slot;                 /* slot in the level */
     void *ud;                 /* user data */
     timer_callback *timer_cb; /* timer callback */
 } ev_timer_t;
 
+typedef struct timer_wheel_t {
+    long long tick;                                     /* next millisecond to process */
+    unsigned long count;                                /* number of timers */
+    uint64_t used[EL_WHEEL_LEVELS];                     /* slots holding timers */
+    ev_timer_link_t slots[EL_WHEEL_LEVELS][EL_WHEEL_SLOTS];
+} timer_wheel_t;
+
 /* State of an event loop */
 typedef struct eventloop_t {
     int maxfd;                              /* highest file descriptor currently registered */
     int size;                               /* the capacity of the loop forfile descriptors */
     event_t *events;                        /* registered events                            */
     fired_event_t *fired;                   /* fired events                                 */
-    minheap_t *timers;                      /* timer events                                 */
+    timer_wheel_t timers;                   /* timer events                                 */
+    long long now;                          /* monotonic time of the iteration, in milliseconds */
     int stop;                               /* flag for stopping the event loop             */
     void *context;                          /* wrap the context for epoll, kqueue etc.      */
+    const struct el_backend_t *backend;     /* the polling backend owning the context       */
     before_polling_callback *before_polling;/* callback fucntion which gets called before polling */
+    ref_callback *ref_hold;                 /* take a reference to the data written by reference */
+    ref_callback *ref_release;              /* and drop it once sent */
 } eventloop_t;
 
-/* Create a event loop with the given size */
-eventloop_t *el_loop_create(int size);
+/*
+ * Create a event loop with the given size and polling backend, it falls back
+ * to the default backend when the requested one is not available
+ */
+eventloop_t *el_loop_create(int size, int backend);
+
+/* Get the name of the polling backend of the event loop */
+const char *el_loop_backend(eventloop_t *el);
 
 /* Release the event loop and free the resource */
 void el_loop_free(eventloop_t *el);
@@ -64,6 +105,13 @@ void el_loop_stop(eventloop_t *el);
 /* Get event loop size */
 int el_loop_get_size(eventloop_t *el);
 
+/*
+ * Get the time of the current loop iteration, in milliseconds of the monotonic
+ * clock. It is refreshed when the polling returns, and the delays of the timers
+ * added during the iteration are counted from it.
+ */
+long long el_loop_now(eventloop_t *el);
+
 /*
  * Poll and process all the fired file events
  * Returns the total number of events processed
@@ -72,6 +120,9 @@ int el_loop_poll(eventloop_t *el, struct timeval *tvp);
 
 void el_loop_set_before_polling(eventloop_t *el, before_polling_callback *callback);
 
+/* Set the callbacks taking and dropping the references of el_writev_ref */
+void el_loop_set_ref_procs(eventloop_t *el, ref_callback *hold, ref_callback *release);
+
 /*
  * Process all the timer
  * Returns the total number of timers processed
@@ -98,13 +149,44 @@ void el_event_del(eventloop_t *el, int fd, int mask);
 /* Get the event mask for the given fd */
 int el_event_get(eventloop_t *el, int fd);
 
+/*
+ * Hand a connected socket over to the loop, the backend may then receive its
+ * data ahead of the read events and queue its writes to send them along with
+ * the next polling. It is then read with el_read, written with el_writev and
+ * closed with el_close, which behave as read, writev and close. They may be
+ * called from other threads while the loop is not polling, a fd being used by
+ * a single thread at a time.
+ * return: RR_EV_OK or RR_EV_ERR
+ */
+int el_stream_open(eventloop_t *el, int fd);
+
+ssize_t el_read(eventloop_t *el, int fd, void *buf, size_t len);
+
+ssize_t el_writev(eventloop_t *el, int fd, const struct iovec *iov, int iovcnt);
+
+/*
+ * Same as el_writev, refs[i] being NULL or the object owning the data of
+ * iov[i], which must not change until it is released. The backend may then
+ * send that data from where it is rather than copying it, holding a reference
+ * to the object until it is sent.
+ */
+ssize_t el_writev_ref(eventloop_t *el, int fd, const struct iovec *iov, void **refs, int iovcnt);
+
+/* Close the fd, once the data queued to send is sent */
+void el_close(eventloop_t *el, int fd);
+
 /*
  * Add a timer event to event loop
  * params:
- *     proc: event callback
+ *     milliseconds: delay before the timer fires
+ *     proc: event callback, returning the delay before firing again, or 0 to
+ *           remove the timer
  *     ud: user data
- * return: RR_EV_OK or RR_EV_ERR
+ * return: the handle of the timer, valid until the timer is removed, or NULL
  */
-int el_timer_add(eventloop_t *el, long long milliseconds, timer_callback *proc, void *ud);
+ev_timer_t *el_timer_add(eventloop_t *el, long long milliseconds, timer_callback *proc, void *ud);
+
+/* Remove a timer, the callback of the timer may remove the timer itself */
+void el_timer_del(eventloop_t *el, ev_timer_t *timer);
 
 #endif
@@ -183,11 +183,11 @@ static void fts_index_del(fts_t *fts, fts_doc_t *doc) {
 }
 
 static void fts_cat_index(fts_t *fts) {
-    dict_iterator_t *iter;
+    dict_iterator_t iter;
 
-    iter = dict_iter_create(fts->index);
-    while (dict_iter_hasnext(iter)) {
-        dict_kv_t kv = dict_iter_next(iter);
+    dict_iter_init(fts->index, &iter);
+    while (dict_iter_hasnext(&iter)) {
+        dict_kv_t kv = dict_iter_next(&iter);
         rr_debug("key: %s", kv.key);
         list *l = kv.value;
         listIter *liter = listGetIterator(l, AL_START_HEAD);
@@ -200,7 +200,7 @@ static void fts_cat_index(fts_t *fts) {
         }
         listReleaseIterator(liter);
     }
-    dict_iter_free(iter);
+    dict_iter_release(&iter);
 }
 
 bool fts_add(fts_t *fts, robj *title, robj *doc) {
@@ -334,11 +334,14 @@ struct fts_iterator_t *fts_search(fts_t *fts, robj *query, unsigned long *size)
     dict_t *scores = search_with_bm25_score(fts, query);
     *size = dict_length(scores);
     struct fts_iterator_t *it = create_fts_iterator(*size);
-    dict_iterator_t *dict_it = dict_iter_create(scores);
-    while (dict_iter_hasnext(dict_it)) {
-        dict_kv_t score = dict_iter_next(dict_it);
+    dict_iterator_t dict_it;
+
+    dict_iter_init(scores, &dict_it);
+    while (dict_iter_hasnext(&dict_it)) {
+        dict_kv_t score = dict_iter_next(&dict_it);
         minheap_push(it->docs, score.value);
     }
+    dict_iter_release(&dict_it);
     dict_free(scores);
     return it;
 }
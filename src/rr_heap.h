@@ -0,0 +1,186 @@
+#ifndef _RR_HEAP_H
+#define _RR_HEAP_H
+
+/*
+ * Type specialized d-ary min-heaps.
+ *
+ * Unlike minheap_t, which goes through the comparing, copying and swapping
+ * callbacks on every step, the heaps generated here store the items in a
+ * plain C array of the given type and compare them with an inlined `less`
+ * expression. Sifting moves a hole along the path and writes the item only
+ * once at its final slot, instead of swapping on every level.
+ *
+ * The array is laid out so that the children of every item start at a cache
+ * line boundary, with 16 bytes items and an arity of 4 all the children of a
+ * node share a single cache line, and a pop costs log4(n) cache misses
+ * instead of log2(n).
+ *
+ * Usage:
+ *
+ *   HEAP_HEAD(hq_delay_heap, hq_delayed_t)
+ *
+ * declares the type `hq_delay_heap_t`, and in the implementation file
+ *
+ *   #define HQ_DELAY_LESS(l, r) ((l)->at < (r)->at)
+ *   HEAP_GENERATE(hq_delay_heap, hq_delayed_t, HQ_DELAY_LESS)
+ *
+ * defines hq_delay_heap_init, hq_delay_heap_release, hq_delay_heap_push,
+ * hq_delay_heap_pop, hq_delay_heap_min, hq_delay_heap_len,
+ * hq_delay_heap_append and hq_delay_heap_heapify for a binary heap. `less`
+ * takes two pointers to items and must be a strict weak ordering.
+ *
+ * HEAP_GENERATE_ARITY(name, head, type, less, d) generates the same functions
+ * prefixed by `name` for a d-ary heap stored in a `head##_t`, so more than one
+ * layout can operate on the same storage.
+ *
+ * HEAP_GENERATE_INDEXED(name, head, type, less, d, set_index) additionally
+ * calls `set_index(item pointer, position)` whenever an item lands on a new
+ * position, so that the users can keep track of where their items are, and
+ * name##_remove and name##_fix can be used to delete or reprioritize an
+ * arbitrary item in O(log n).
+ */
+
+#include "rr_malloc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#define HEAP_CACHELINE 64
+
+#define HEAP_HEAD(name, type)                                                 \
+typedef struct name##_t {                                                     \
+    type *items;        /* items in the heap order */                         \
+    void *mem;          /* allocated memory, items are aligned in it */       \
+    unsigned long len;  /* number of items in the heap */                     \
+    unsigned long cap;  /* number of allocated items */                       \
+} name##_t;
+
+#define HEAP_NO_INDEX(item, i)
+
+#define HEAP_GENERATE(name, type, less)                                       \
+    HEAP_GENERATE_ARITY(name, name, type, less, 2)
+
+#define HEAP_GENERATE_ARITY(name, head, type, less, d)                        \
+    HEAP_GENERATE_INDEXED(name, head, type, less, d, HEAP_NO_INDEX)
+
+#define HEAP_GENERATE_INDEXED(name, head, type, less, d, set_index)           \
+/* Resize the storage, the first child of the root, i.e. items[1], is kept    \
+ * aligned to a cache line */                                                 \
+static inline void name##_resize(head##_t *h, unsigned long cap) {            \
+    size_t offset = h->mem ? (char *) h->items - (char *) h->mem : 0;         \
+    uintptr_t first;                                                          \
+    char *mem;                                                                \
+                                                                              \
+    mem = rr_realloc(h->mem, sizeof(type) * cap + HEAP_CACHELINE);            \
+    first = (uintptr_t) mem + sizeof(type);                                   \
+    first = (first + HEAP_CACHELINE - 1) & ~(uintptr_t) (HEAP_CACHELINE - 1); \
+    h->items = (type *) (first - sizeof(type));                               \
+    if ((char *) h->items - mem != (ptrdiff_t) offset)                        \
+        memmove(h->items, mem + offset, sizeof(type) * h->len);               \
+    h->mem = mem;                                                             \
+    h->cap = cap;                                                             \
+}                                                                             \
+                                                                              \
+static inline void name##_init(head##_t *h, unsigned long cap) {              \
+    h->len = 0;                                                               \
+    h->mem = NULL;                                                            \
+    name##_resize(h, cap ? cap : 1);                                          \
+}                                                                             \
+                                                                              \
+static inline void name##_release(head##_t *h) {                              \
+    rr_free(h->mem);                                                          \
+    h->items = h->mem = NULL;                                                 \
+    h->len = h->cap = 0;                                                      \
+}                                                                             \
+                                                                              \
+static inline unsigned long name##_len(const head##_t *h) {                   \
+    return h->len;                                                            \
+}                                                                             \
+                                                                              \
+static inline type *name##_min(head##_t *h) {                                 \
+    return h->len ? &h->items[0] : NULL;                                      \
+}                                                                             \
+                                                                              \
+/* Move the hole at i up until the item fits in */                            \
+static inline void name##_sift_up(head##_t *h, unsigned long i, type item) {  \
+    while (i > 0) {                                                           \
+        unsigned long parent = (i - 1) / (d);                                 \
+        if (!less(&item, &h->items[parent])) break;                           \
+        h->items[i] = h->items[parent];                                       \
+        set_index(&h->items[i], i);                                           \
+        i = parent;                                                           \
+    }                                                                         \
+    h->items[i] = item;                                                       \
+    set_index(&h->items[i], i);                                               \
+}                                                                             \
+                                                                              \
+/* Move the hole at i down until the item fits in */                          \
+static inline void name##_sift_down(head##_t *h, unsigned long i, type item) {\
+    unsigned long child, min, last;                                           \
+                                                                              \
+    while ((child = (d) * i + 1) < h->len) {                                  \
+        last = child + (d) < h->len ? child + (d) : h->len;                   \
+        for (min = child++; child < last; child++)                            \
+            if (less(&h->items[child], &h->items[min])) min = child;          \
+        if (!less(&h->items[min], &item)) break;                              \
+        h->items[i] = h->items[min];                                          \
+        set_index(&h->items[i], i);                                           \
+        i = min;                                                              \
+    }                                                                         \
+    h->items[i] = item;                                                       \
+    set_index(&h->items[i], i);                                               \
+}                                                                             \
+                                                                              \
+/* Put the item at i, where a hole is, in order */                            \
+static inline void name##_sift(head##_t *h, unsigned long i, type item) {     \
+    if (i > 0 && less(&item, &h->items[(i - 1) / (d)]))                       \
+        name##_sift_up(h, i, item);                                           \
+    else                                                                      \
+        name##_sift_down(h, i, item);                                         \
+}                                                                             \
+                                                                              \
+static inline void name##_push(head##_t *h, const type *item) {               \
+    if (h->len == h->cap) name##_resize(h, h->cap * 2);                       \
+    name##_sift_up(h, h->len++, *item);                                       \
+}                                                                             \
+                                                                              \
+/* Append the item without restoring the heap order, name##_heapify has to be \
+ * called once done with a batch of appends */                                \
+static inline void name##_append(head##_t *h, const type *item) {             \
+    if (h->len == h->cap) name##_resize(h, h->cap * 2);                       \
+    h->items[h->len] = *item;                                                 \
+    set_index(&h->items[h->len], h->len);                                     \
+    h->len++;                                                                 \
+}                                                                             \
+                                                                              \
+/* Remove the minimum item and copy it to `item`, returns 0 on success or -1  \
+ * if the heap is empty */                                                    \
+static inline int name##_pop(head##_t *h, type *item) {                       \
+    if (h->len == 0) return -1;                                               \
+    *item = h->items[0];                                                      \
+    if (--h->len) name##_sift_down(h, 0, h->items[h->len]);                   \
+    return 0;                                                                 \
+}                                                                             \
+                                                                              \
+/* Remove the item at i and copy it to `item` */                              \
+static inline void name##_remove(head##_t *h, unsigned long i, type *item) {  \
+    *item = h->items[i];                                                      \
+    if (--h->len != i) name##_sift(h, i, h->items[h->len]);                   \
+}                                                                             \
+                                                                              \
+/* Restore the heap order once the item at i has been changed */              \
+static inline void name##_fix(head##_t *h, unsigned long i) {                 \
+    name##_sift(h, i, h->items[i]);                                           \
+}                                                                             \
+                                                                              \
+/* Restore the heap order of the whole array bottom-up in O(n) */             \
+static inline void name##_heapify(head##_t *h) {                              \
+    unsigned long i;                                                          \
+                                                                              \
+    if (h->len < 2) return;                                                   \
+    for (i = (h->len - 2) / (d) + 1; i-- > 0; )                               \
+        name##_sift_down(h, i, h->items[i]);                                  \
+}
+
+#endif /* ifndef _RR_HEAP_H */
@@ -0,0 +1,361 @@
+#include "rr_heapq.h"
+#include "rr_malloc.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define HQ_LESS(l, r) ((l)->score < (r)->score)
+#define HQ_SET_POS(item, i) ((item)->member->pos = (i))
+#define HQ_DELAY_LESS(l, r) ((l)->at < (r)->at)
+#define HQ_LEASE_LESS(l, r) ((*(l))->deadline < (*(r))->deadline)
+#define HQ_LEASE_SET_POS(item, i) ((*(item))->pos = (i))
+
+/* Both layouts work on the same storage, so switching from one to the other
+ * only takes a heapify */
+HEAP_GENERATE_INDEXED(hq_bheap, hq_heap, hq_item_t, HQ_LESS, 2, HQ_SET_POS)
+HEAP_GENERATE_INDEXED(hq_dheap, hq_heap, hq_item_t, HQ_LESS, HEAPQ_DARY_ARITY, HQ_SET_POS)
+HEAP_GENERATE(hq_delay_heap, hq_delayed_t, HQ_DELAY_LESS)
+HEAP_GENERATE_INDEXED(hq_lease_heap, hq_lease_heap, hq_lease_ref_t,
+                      HQ_LEASE_LESS, 2, HQ_LEASE_SET_POS)
+
+heapq_t *heapq_create(void) {
+    heapq_t *hq = rr_malloc(sizeof(*hq));
+
+    hq_bheap_init(&hq->heap, 8);
+    hq->members = dict_create();
+    hq->arity = 2;
+    /* most of the heapqs never schedule anything, allocate on demand */
+    memset(&hq->delayed, 0, sizeof(hq->delayed));
+    hq->timer = NULL;
+    hq->timer_at = 0;
+    memset(&hq->leases, 0, sizeof(hq->leases));
+    hq->leased = NULL;
+    hq->next_lease_id = 1;
+    hq->cap = 0;
+    hq->index = NULL;
+    return hq;
+}
+
+void heapq_free(heapq_t *hq) {
+    unsigned long i;
+
+    for (i = 0; i < hq->heap.len; i++) {
+        decrRefCount(hq->heap.items[i].member->obj);
+        rr_free(hq->heap.items[i].member);
+    }
+    hq_bheap_release(&hq->heap);
+    for (i = 0; i < hq->delayed.len; i++)
+        decrRefCount(hq->delayed.items[i].obj);
+    hq_delay_heap_release(&hq->delayed);
+    for (i = 0; i < hq->leases.len; i++) {
+        decrRefCount(hq->leases.items[i]->obj);
+        rr_free(hq->leases.items[i]);
+    }
+    hq_lease_heap_release(&hq->leases);
+    if (hq->leased) dict_free(hq->leased);
+    if (hq->index) skiplist_free(hq->index);
+    dict_free(hq->members);
+    rr_free(hq);
+}
+
+void heapq_to_dary(heapq_t *hq) {
+    if (hq->arity == HEAPQ_DARY_ARITY) return;
+    hq->arity = HEAPQ_DARY_ARITY;
+    hq_dheap_heapify(&hq->heap);
+}
+
+/* Remove the item at the position and release its member, returns the member
+ * object along with its reference */
+static robj *heapq_remove_at(heapq_t *hq, unsigned long pos, double *score) {
+    hq_item_t item;
+    robj *obj;
+
+    if (hq->arity == 2)
+        hq_bheap_remove(&hq->heap, pos, &item);
+    else
+        hq_dheap_remove(&hq->heap, pos, &item);
+
+    obj = item.member->obj;
+    if (hq->index) skiplist_delete(hq->index, item.score, obj->ptr);
+    dict_del(hq->members, obj->ptr);
+    rr_free(item.member);
+    if (score) *score = item.score;
+    return obj;
+}
+
+static void heapq_fix(heapq_t *hq, unsigned long pos) {
+    if (hq->arity == 2)
+        hq_bheap_fix(&hq->heap, pos);
+    else
+        hq_dheap_fix(&hq->heap, pos);
+}
+
+bool heapq_update(heapq_t *hq, const char *member, double score) {
+    hq_member_t *m;
+
+    if ((m = dict_get(hq->members, member)) == NULL) return false;
+    if (hq->index) {
+        skiplist_delete(hq->index, hq->heap.items[m->pos].score, member);
+        skiplist_insert(hq->index, score, m->obj->ptr);
+    }
+    hq->heap.items[m->pos].score = score;
+    heapq_fix(hq, m->pos);
+    return true;
+}
+
+/* heapq_push, handing the member evicted by the cap to the caller, if any */
+static bool heapq_push_evict(heapq_t *hq, double score, robj *obj, robj **evicted) {
+    hq_member_t *m;
+    hq_item_t item;
+
+    *evicted = NULL;
+    if (heapq_update(hq, obj->ptr, score)) return false;
+    if (hq->cap && hq->heap.len >= hq->cap) {
+        if (score <= hq->heap.items[0].score) return false;
+        *evicted = heapq_remove_at(hq, 0, NULL);
+    }
+
+    m = rr_malloc(sizeof(*m));
+    m->obj = obj;
+    incrRefCount(obj);
+    dict_set(hq->members, obj->ptr, m);
+
+    if (hq->index) skiplist_insert(hq->index, score, obj->ptr);
+
+    item.score = score;
+    item.member = m;
+    if (hq->arity == 2)
+        hq_bheap_push(&hq->heap, &item);
+    else
+        hq_dheap_push(&hq->heap, &item);
+    return true;
+}
+
+bool heapq_push(heapq_t *hq, double score, robj *obj) {
+    robj *evicted;
+    bool added = heapq_push_evict(hq, score, obj, &evicted);
+
+    if (evicted) decrRefCount(evicted);
+    return added;
+}
+
+unsigned long heapq_push_many(heapq_t *hq, const double *scores, robj **objs,
+                              unsigned long n) {
+    unsigned long i, added = 0;
+    hq_member_t *m;
+    hq_item_t item;
+
+    /* n pushes take O(n log(len + n)), while rebuilding the heap takes
+     * O(len + n), so rebuild once the batch is as large as the heap. Capped
+     * heaps stay small, so pushing takes O(n log cap) at most */
+    if (n < hq->heap.len || hq->cap) {
+        for (i = 0; i < n; i++)
+            if (heapq_push(hq, scores[i], objs[i])) added++;
+        return added;
+    }
+
+    for (i = 0; i < n; i++) {
+        if ((m = dict_get(hq->members, objs[i]->ptr)) != NULL) {
+            if (hq->index) {
+                skiplist_delete(hq->index, hq->heap.items[m->pos].score,
+                                objs[i]->ptr);
+                skiplist_insert(hq->index, scores[i], m->obj->ptr);
+            }
+            hq->heap.items[m->pos].score = scores[i];
+            continue;
+        }
+        m = rr_malloc(sizeof(*m));
+        m->obj = objs[i];
+        incrRefCount(objs[i]);
+        dict_set(hq->members, objs[i]->ptr, m);
+        if (hq->index) skiplist_insert(hq->index, scores[i], objs[i]->ptr);
+
+        item.score = scores[i];
+        item.member = m;
+        hq_bheap_append(&hq->heap, &item);
+        added++;
+    }
+    if (hq->arity == 2)
+        hq_bheap_heapify(&hq->heap);
+    else
+        hq_dheap_heapify(&hq->heap);
+    return added;
+}
+
+long heapq_merge_one(heapq_t *dst, double score, long long at, robj *obj, dict_t *landed) {
+    robj *evicted;
+    long moved = 0;
+
+    if (at) {
+        heapq_push_at(dst, at, score, obj);
+        return 1;
+    }
+    if (heapq_push_evict(dst, score, obj, &evicted)) {
+        moved++;
+        if (landed) dict_set(landed, obj->ptr, obj);
+    }
+    if (evicted) {
+        if (landed && dict_del(landed, evicted->ptr)) moved--;
+        decrRefCount(evicted);
+    }
+    return moved;
+}
+
+long heapq_merge(heapq_t *dst, heapq_t *src, unsigned long count, dict_t *landed) {
+    unsigned long n = 0;
+    long moved = 0;
+    long long at;
+    double score;
+    robj *obj;
+
+    while (n < count && heapq_take(src, &obj, &score, &at)) {
+        moved += heapq_merge_one(dst, score, at, obj, landed);
+        decrRefCount(obj);
+        n++;
+    }
+    return moved;
+}
+
+void heapq_set_cap(heapq_t *hq, unsigned long cap) {
+    hq->cap = cap;
+    while (cap && hq->heap.len > cap)
+        decrRefCount(heapq_remove_at(hq, 0, NULL));
+}
+
+bool heapq_pop(heapq_t *hq, robj **obj, double *score) {
+    if (!hq->heap.len) return false;
+    *obj = heapq_remove_at(hq, 0, score);
+    return true;
+}
+
+bool heapq_take(heapq_t *hq, robj **obj, double *score, long long *at) {
+    hq_delayed_t item;
+
+    *at = 0;
+    if (heapq_pop(hq, obj, score)) return true;
+    if (hq_delay_heap_pop(&hq->delayed, &item) != 0) return false;
+    *obj = item.obj;
+    *score = item.score;
+    *at = item.at;
+    return true;
+}
+
+hq_item_t *heapq_min(heapq_t *hq) {
+    return hq_bheap_min(&hq->heap);
+}
+
+bool heapq_score(heapq_t *hq, const char *member, double *score) {
+    hq_member_t *m;
+
+    if ((m = dict_get(hq->members, member)) == NULL) return false;
+    *score = hq->heap.items[m->pos].score;
+    return true;
+}
+
+bool heapq_remove(heapq_t *hq, const char *member) {
+    hq_member_t *m;
+
+    if ((m = dict_get(hq->members, member)) == NULL) return false;
+    decrRefCount(heapq_remove_at(hq, m->pos, NULL));
+    return true;
+}
+
+void heapq_push_at(heapq_t *hq, long long at, double score, robj *obj) {
+    hq_delayed_t item;
+
+    if (!hq->delayed.mem) hq_delay_heap_init(&hq->delayed, 4);
+    item.at = at;
+    item.score = score;
+    item.obj = obj;
+    incrRefCount(obj);
+    hq_delay_heap_push(&hq->delayed, &item);
+}
+
+unsigned long heapq_promote(heapq_t *hq, long long now) {
+    unsigned long promoted = 0;
+    hq_delayed_t *min, item;
+
+    while ((min = hq_delay_heap_min(&hq->delayed)) && min->at <= now) {
+        hq_delay_heap_pop(&hq->delayed, &item);
+        heapq_push(hq, item.score, item.obj);
+        decrRefCount(item.obj);
+        promoted++;
+    }
+    return promoted;
+}
+
+long long heapq_next_at(heapq_t *hq) {
+    hq_delayed_t *min = hq_delay_heap_min(&hq->delayed);
+
+    return min ? min->at : -1;
+}
+
+hq_lease_t *heapq_lease(heapq_t *hq, long long deadline) {
+    hq_lease_t *lease;
+    char id[32];
+
+    if (!hq->heap.len) return NULL;
+    if (!hq->leased) {
+        hq->leased = dict_create();
+        hq_lease_heap_init(&hq->leases, 4);
+    }
+
+    lease = rr_malloc(sizeof(*lease));
+    lease->obj = heapq_remove_at(hq, 0, &lease->score);
+    lease->id = hq->next_lease_id++;
+    lease->deadline = deadline;
+    snprintf(id, sizeof(id), "%llu", lease->id);
+    dict_set(hq->leased, id, lease);
+    hq_lease_heap_push(&hq->leases, &lease);
+    return lease;
+}
+
+/* Remove the lease from both the heap and the index, and free it */
+static robj *heapq_unlease(heapq_t *hq, hq_lease_t *lease, double *score) {
+    hq_lease_t *removed;
+    char id[32];
+    robj *obj = lease->obj;
+
+    hq_lease_heap_remove(&hq->leases, lease->pos, &removed);
+    snprintf(id, sizeof(id), "%llu", lease->id);
+    dict_del(hq->leased, id);
+    *score = lease->score;
+    rr_free(lease);
+    return obj;
+}
+
+bool heapq_ack(heapq_t *hq, const char *id) {
+    hq_lease_t *lease;
+    double score;
+
+    if (!hq->leased || (lease = dict_get(hq->leased, id)) == NULL)
+        return false;
+    decrRefCount(heapq_unlease(hq, lease, &score));
+    return true;
+}
+
+unsigned long heapq_expire_leases(heapq_t *hq, long long now) {
+    unsigned long expired = 0;
+    hq_lease_t **min;
+    double score;
+    robj *obj;
+
+    while ((min = hq_lease_heap_min(&hq->leases)) && (*min)->deadline <= now) {
+        obj = heapq_unlease(hq, *min, &score);
+        heapq_push(hq, score, obj);
+        decrRefCount(obj);
+        expired++;
+    }
+    return expired;
+}
+
+skiplist_t *heapq_index(heapq_t *hq) {
+    unsigned long i;
+
+    if (hq->index) return hq->index;
+    hq->index = skiplist_create();
+    for (i = 0; i < hq->heap.len; i++)
+        skiplist_insert(hq->index, hq->heap.items[i].score,
+                        hq->heap.items[i].member->obj->ptr);
+    return hq->index;
+}
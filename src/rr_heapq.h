@@ -0,0 +1,161 @@
+#ifndef _RR_HEAPQ_H
+#define _RR_HEAPQ_H
+
+#include "robj.h"
+#include "rr_dict.h"
+#include "rr_heap.h"
+#include "rr_skiplist.h"
+
+#include <stdbool.h>
+
+#define HEAPQ_DARY_ARITY 4
+
+/* Members are unique in a heapq, every member knows its position in the
+ * heap so that it can be found from the member index in O(1) */
+typedef struct hq_member_t {
+    robj *obj;
+    unsigned long pos;
+} hq_member_t;
+
+typedef struct hq_item_t {
+    double score;
+    hq_member_t *member;
+} hq_item_t;
+
+HEAP_HEAD(hq_heap, hq_item_t)
+
+/* Item scheduled to be pushed to the heap at a given time */
+typedef struct hq_delayed_t {
+    long long at;  /* unix time in milliseconds */
+    double score;
+    robj *obj;
+} hq_delayed_t;
+
+HEAP_HEAD(hq_delay_heap, hq_delayed_t)
+
+/* Item handed out to a consumer until it's acknowledged or the lease expires */
+typedef struct hq_lease_t {
+    unsigned long long id;
+    long long deadline;  /* unix time in milliseconds */
+    double score;
+    robj *obj;
+    unsigned long pos;   /* position in the lease heap */
+} hq_lease_t;
+
+/* The lease heap holds pointers, as the leases are indexed by id as well */
+typedef hq_lease_t *hq_lease_ref_t;
+
+HEAP_HEAD(hq_lease_heap, hq_lease_ref_t)
+
+typedef struct heapq_t {
+    hq_heap_t heap;
+    dict_t *members;          /* member -> hq_member_t */
+    int arity;                /* 2 or HEAPQ_DARY_ARITY */
+    hq_delay_heap_t delayed;  /* items not ready yet, ordered by time */
+    struct ev_timer_t *timer; /* armed promotion timer, NULL if none */
+    long long timer_at;       /* time the promotion timer is armed for */
+    hq_lease_heap_t leases;   /* leased items, ordered by deadline */
+    dict_t *leased;           /* lease id -> hq_lease_t, NULL if never leased */
+    unsigned long long next_lease_id;
+    unsigned long cap;        /* keep only the cap highest members, 0 if unbounded */
+    skiplist_t *index;        /* members by score, NULL until the first range query */
+} heapq_t;
+
+heapq_t *heapq_create(void);
+
+/* Release the heap and all the objects in it */
+void heapq_free(heapq_t *hq);
+
+/* Switch the heap to the d-ary layout, it's O(n) */
+void heapq_to_dary(heapq_t *hq);
+
+/* Add the member with the given score, or update the score if the member is
+ * already in the heap. A capped heap which is full evicts its lowest member
+ * to make room, unless the new member has an even lower score, in which case
+ * it's dropped. Returns true if the member is added, in which case the heap
+ * takes a reference of the object. */
+bool heapq_push(heapq_t *hq, double score, robj *obj);
+
+/* Push n members at once, as heapq_push does for each of them, a later
+ * duplicate in the batch overrides the score of an earlier one. Large batches
+ * are appended and the heap is rebuilt in O(len + n). Returns the number of
+ * members added. */
+unsigned long heapq_push_many(heapq_t *hq, const double *scores, robj **objs,
+                              unsigned long n);
+
+/* Move up to count members of src to dst, from the lowest score up and then
+ * the delayed ones, as if they were pushed by heapq_push and heapq_push_at.
+ * The leased members stay in src. Returns the change in the number of members
+ * of src found in dst: the ones merged into a member of dst or dropped by its
+ * cap don't count. The ones evicted by the cap of dst only come off the count
+ * with `landed`, a dict of the members landed so far kept by the caller, as
+ * nothing else tells them apart from the other members of dst. */
+long heapq_merge(heapq_t *dst, heapq_t *src, unsigned long count, dict_t *landed);
+
+/* Push a member taken by heapq_take from another heapq into dst as heapq_merge
+ * does. Returns the change in the number of members landed in dst. */
+long heapq_merge_one(heapq_t *dst, double score, long long at, robj *obj, dict_t *landed);
+
+/* Cap the heap to the given number of members, evicting the lowest ones if it
+ * holds more than that. 0 makes it unbounded. */
+void heapq_set_cap(heapq_t *hq, unsigned long cap);
+
+/* Remove the member with the lowest score, the reference of the member object
+ * is transferred to the caller, `score` can be NULL if it's not needed.
+ * Returns false if the heap is empty */
+bool heapq_pop(heapq_t *hq, robj **obj, double *score);
+
+/* Remove the member with the lowest score, or once there is none the earliest
+ * delayed one, whose time is set in `at`, 0 otherwise. The reference of the
+ * member object is transferred to the caller. Returns false if both are empty. */
+bool heapq_take(heapq_t *hq, robj **obj, double *score, long long *at);
+
+/* Item with the lowest score, or NULL if the heap is empty */
+hq_item_t *heapq_min(heapq_t *hq);
+
+/* Look up, reprioritize or remove a member in O(log n), all of them return
+ * false if the member is missing */
+bool heapq_score(heapq_t *hq, const char *member, double *score);
+bool heapq_update(heapq_t *hq, const char *member, double score);
+bool heapq_remove(heapq_t *hq, const char *member);
+
+/* Schedule the member to be pushed with the score at the unix time `at`, in
+ * milliseconds. The heap takes a reference of the object. */
+void heapq_push_at(heapq_t *hq, long long at, double score, robj *obj);
+
+/* Push all the delayed items due at `now` to the heap, returns the number of
+ * items pushed */
+unsigned long heapq_promote(heapq_t *hq, long long now);
+
+/* Time of the earliest delayed item, or -1 if there's none */
+long long heapq_next_at(heapq_t *hq);
+
+/* Pop the member with the lowest score and lease it until the deadline,
+ * returns the lease or NULL if the heap is empty. The lease belongs to the
+ * heap and stays valid until it's acknowledged or expires. */
+hq_lease_t *heapq_lease(heapq_t *hq, long long deadline);
+
+/* Release the lease for good, returns false if there's no such lease */
+bool heapq_ack(heapq_t *hq, const char *id);
+
+/* Push back the members whose lease expired at `now`, returns the number of
+ * members pushed back */
+unsigned long heapq_expire_leases(heapq_t *hq, long long now);
+
+/* Build the score index if there's none yet, it's kept up to date from then on.
+ * It takes O(n log n), and the pushes and pops take twice as long after. */
+skiplist_t *heapq_index(heapq_t *hq);
+
+static inline unsigned long heapq_len(heapq_t *hq) {
+    return hq->heap.len;
+}
+
+static inline unsigned long heapq_delayed_len(heapq_t *hq) {
+    return hq->delayed.len;
+}
+
+static inline unsigned long heapq_leased_len(heapq_t *hq) {
+    return hq->leases.len;
+}
+
+#endif /* ifndef _RR_HEAPQ_H */
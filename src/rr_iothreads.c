@@ -0,0 +1,153 @@
+/*
+ * I/O threads.
+ *
+ * Commands are always executed by the main thread, but reading and parsing
+ * the queries, and writing the replies, can be spread over a few threads.
+ * The main thread hands out the clients with pending reads or writes at every
+ * event loop iteration, takes its own share, and waits for the threads to be
+ * done before moving on, so the clients are never touched concurrently.
+ */
+#include "rr_ftmacro.h"
+
+#include "rr_rhino_rox.h"
+#include "rr_iothreads.h"
+#include "rr_server.h"
+#include "rr_logging.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of checks for a job before falling back to the mutex */
+#define IO_THREADS_SPIN 1000000
+
+/* Number of clients handed to a thread and not done yet. Each counter has a
+ * cache line of its own, as its thread spins on it while the main thread
+ * polls all of them. */
+typedef struct io_pending_t {
+    unsigned long value;
+    char padding[64 - sizeof(unsigned long)];
+} io_pending_t;
+
+static pthread_t io_threads[IO_THREADS_MAX_NUM];
+static pthread_mutex_t io_mutex[IO_THREADS_MAX_NUM];  /* parks the threads */
+static list *io_lists[IO_THREADS_MAX_NUM];
+static io_pending_t io_pending[IO_THREADS_MAX_NUM] __attribute__((aligned(64)));
+
+/* The acquire pairs with the release of set_pending, so that the clients are
+ * seen as they were left by the other side */
+static unsigned long get_pending(int id) {
+    return __atomic_load_n(&io_pending[id].value, __ATOMIC_ACQUIRE);
+}
+
+static void set_pending(int id, unsigned long pending) {
+    __atomic_store_n(&io_pending[id].value, pending, __ATOMIC_RELEASE);
+}
+
+static void empty_list(list *l) {
+    while (listLength(l)) listDelNode(l, listFirst(l));
+}
+
+static void run_list(int id, int op) {
+    listIter li;
+    listNode *ln;
+
+    listRewind(io_lists[id], &li);
+    while ((ln = listNext(&li))) {
+        rr_client_t *c = listNodeValue(ln);
+
+        if (op == IO_THREADS_OP_READ) {
+            rr_client_io_read(c);
+        } else if (reply_write_buffers(c) != RR_OK) {
+            c->flags |= CLIENT_IO_ERROR;
+        }
+    }
+    empty_list(io_lists[id]);
+}
+
+static void *io_thread_main(void *arg) {
+    int id = (int) (long) arg;
+    unsigned long pending = 0;
+    long j;
+
+    for (;;) {
+        for (j = 0; j < IO_THREADS_SPIN; j++)
+            if ((pending = get_pending(id)) != 0) break;
+
+        /* Parked by the main thread holding the mutex */
+        if (pending == 0) {
+            pthread_mutex_lock(&io_mutex[id]);
+            pthread_mutex_unlock(&io_mutex[id]);
+            continue;
+        }
+
+        run_list(id, server.io_threads_op);
+        set_pending(id, 0);
+    }
+    return NULL;
+}
+
+void rr_iot_init(int num) {
+    long i;
+    int err;
+
+    server.io_threads_num = num;
+    server.io_threads_active = false;
+    server.io_threads_op = IO_THREADS_OP_IDLE;
+    for (i = 0; i < num; i++) {
+        io_lists[i] = listCreate();
+        set_pending(i, 0);
+        if (i == 0) continue;  /* the main thread */
+
+        pthread_mutex_init(&io_mutex[i], NULL);
+        pthread_mutex_lock(&io_mutex[i]);
+        err = pthread_create(&io_threads[i], NULL, io_thread_main, (void *) i);
+        if (err != 0) {
+            rr_log(RR_LOG_CRITICAL, "Can not create I/O thread: %s", strerror(err));
+            exit(1);
+        }
+    }
+}
+
+void rr_iot_start(void) {
+    int i;
+
+    if (server.io_threads_active) return;
+    for (i = 1; i < server.io_threads_num; i++)
+        pthread_mutex_unlock(&io_mutex[i]);
+    server.io_threads_active = true;
+}
+
+void rr_iot_stop(void) {
+    int i;
+
+    if (!server.io_threads_active) return;
+    for (i = 1; i < server.io_threads_num; i++)
+        pthread_mutex_lock(&io_mutex[i]);
+    server.io_threads_active = false;
+}
+
+void rr_iot_run(list *clients, int op) {
+    listIter li;
+    listNode *ln;
+    unsigned long n = 0, pending;
+    int i;
+
+    listRewind(clients, &li);
+    while ((ln = listNext(&li)))
+        listAddNodeTail(io_lists[n++ % server.io_threads_num], listNodeValue(ln));
+
+    server.io_threads_op = op;
+    for (i = 1; i < server.io_threads_num; i++) {
+        pending = listLength(io_lists[i]);
+        if (pending) set_pending(i, pending);
+    }
+    run_list(0, op);
+
+    do {
+        pending = 0;
+        for (i = 1; i < server.io_threads_num; i++)
+            pending += get_pending(i);
+    } while (pending);
+    server.io_threads_op = IO_THREADS_OP_IDLE;
+}
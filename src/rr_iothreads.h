@@ -0,0 +1,30 @@
+#ifndef _RR_IOTHREADS_H
+#define _RR_IOTHREADS_H
+
+#include "adlist.h"
+
+#include <stdbool.h>
+
+#define IO_THREADS_MAX_NUM 128
+
+#define IO_THREADS_OP_IDLE  0
+#define IO_THREADS_OP_READ  1
+#define IO_THREADS_OP_WRITE 2
+
+/* Create the I/O threads, num counts the main thread as well, so 1 means no
+ * extra threads. The threads are parked until rr_iot_start is called. */
+void rr_iot_init(int num);
+
+/* Wake up or park the I/O threads, parked threads take no CPU time while the
+ * active ones spin waiting for jobs */
+void rr_iot_start(void);
+void rr_iot_stop(void);
+
+/* Read or write the clients of the list in parallel, spreading them over the
+ * I/O threads and the main thread. It returns once all of them are done.
+ *
+ * The threads only touch the clients they are handed, so the main thread is
+ * in charge of everything else, such as freeing the clients with errors. */
+void rr_iot_run(list *clients, int op);
+
+#endif /* ifndef _RR_IOTHREADS_H */
@@ -55,13 +55,14 @@ void rr_log(int level, const char *fmt, ...) {
     char buf[64];
     int off, log_stdout = 0;
     struct timeval tv;
+    struct tm tm;
 
     if (log_file[0] == '\0') log_stdout = 1;
     fp = log_stdout ? stdout : fopen(log_file, "a");
     if (fp == NULL) return;
 
     gettimeofday(&tv, NULL);
-    off = strftime(buf, sizeof(buf), "%F %T.", localtime(&tv.tv_sec));
+    off = strftime(buf, sizeof(buf), "%F %T.", localtime_r(&tv.tv_sec, &tm));
     snprintf(buf+off, sizeof(buf)-off, "%03d", (int)tv.tv_usec/1000);
     fprintf(fp, "%s %s %s\n", buf, LOG_LEVEL[level], msg);
     fflush(fp);
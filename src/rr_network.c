@@ -38,6 +38,17 @@ static int rr_net_reuseaddr(char *err, int fd) {
     return RR_NET_OK;
 }
 
+/* Let several sockets listen to the same port, the kernel spreading the
+ * connections over them */
+static int rr_net_reuseport(char *err, int fd) {
+    int reuse = 1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) == -1) {
+        rr_net_error(err, "setsockopt(SO_REUSEPORT): %s", strerror(errno));
+        return RR_NET_ERR;
+    }
+    return RR_NET_OK;
+}
+
 int rr_net_nonblock(char *err, int fd) {
     int flag = fcntl(fd, F_GETFL, 0);
     if (flag == -1) {
@@ -141,7 +152,8 @@ int rr_unix_accept(char *err, int socket) {
     return fd;
 }
 
-int rr_net_tcpserver(char *err, int port, char *bindaddr, int af, int backlog) {
+int rr_net_tcpserver(char *err, int port, char *bindaddr, int af, int backlog,
+                     int reuseport) {
     int s, error;
     char _port[6];  /* strlen("65535") */
     struct addrinfo hints, *servinfo, *p;
@@ -162,6 +174,7 @@ int rr_net_tcpserver(char *err, int port, char *bindaddr, int af, int backlog) {
 
         if (af == AF_INET6 && rr_net_only_inet6(err,s) == RR_NET_ERR) goto error;
         if (rr_net_reuseaddr(err,s) == RR_NET_ERR) goto error;
+        if (reuseport && rr_net_reuseport(err,s) == RR_NET_ERR) goto error;
         if (rr_net_listen(err, s, p->ai_addr, p->ai_addrlen, backlog) == RR_NET_ERR) goto error;
         goto end;
     }
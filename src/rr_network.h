@@ -32,7 +32,8 @@ int rr_unix_accept(char *err, int socket);
  * af: af specifies the ai_family, e.g. AF_INET or AF_INET6
  * backlog: the queue size of listen socket
  */
-int rr_net_tcpserver(char *err, int port, char *bindaddr, int af, int backlog);
+int rr_net_tcpserver(char *err, int port, char *bindaddr, int af, int backlog,
+                     int reuseport);
 
 /*
  * create a unix domain socket server (i.e bind & listen)
@@ -0,0 +1,749 @@
+/*
+ * Shared-nothing reactors.
+ *
+ * With more than one reactor, every reactor is a thread running its own event
+ * loop on its own server state: a listening socket bound to the shared port
+ * with SO_REUSEPORT, the clients and the databases. The keys are spread over
+ * the reactors by hash, and a reactor only ever touches the keys it owns.
+ *
+ * A client stays on the reactor that accepted it. A command about keys of
+ * another reactor is sent to that reactor as a call, which a client without
+ * connection, the proxy, runs there. The reply goes back the same way and is
+ * appended to the replies of the client, which is blocked meanwhile so that
+ * the replies keep the order of the commands.
+ *
+ * The calls travel through an inbox per reactor, a lock free stack the other
+ * reactors push messages to. The reactor takes the whole stack at once when
+ * woken up, which only the message landing in an empty inbox does.
+ *
+ * Commands reaching beyond a single reactor are split in calls:
+ *
+ *  - LEN and SCAN run on every reactor, the replies are summed up or merged.
+ *  - QMERGE runs on the reactor of dst, which takes the members of src from
+ *    its reactor a step at a time, see rr_cmd_hqmerge.
+ *  - BQPOP pops from the keys in turn with QPOPN, and if they are all empty
+ *    waits for any of them to get members with QWAIT before trying again.
+ */
+#include "rr_ftmacro.h"
+
+#include "rr_rhino_rox.h"
+#include "rr_reactor.h"
+#include "rr_cmd_heapq.h"
+#include "rr_blocking.h"
+#include "rr_logging.h"
+#include "rr_malloc.h"
+#include "rr_network.h"
+#include "adlist.h"
+#include "sds.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+
+#define REACTOR_MSG_CALL 0        /* run the call */
+#define REACTOR_MSG_REPLY 1       /* the call is done */
+#define REACTOR_MSG_CANCEL 2      /* drop the call */
+#define REACTOR_MSG_CANCELLED 3   /* the call was dropped */
+
+/* A command run by another reactor. The calling reactor frees it once the
+ * target reactor is done with it, that is after the reply, and after the
+ * acknowledgement of the cancellation if it was cancelled. */
+typedef struct rr_call_t {
+    int from;                   /* calling reactor */
+    int to;                     /* target reactor */
+    int dbid;
+    int argc;
+    robj **argv;                /* command, until the target runs it */
+    rr_client_t *proxy;         /* client running the command, target only */
+    list *reply;                /* replies, NULL if cancelled before the end */
+    sds flat;                   /* replies read by rr_call_reply_read */
+    size_t pos;
+    int pending;                /* messages to come from the target */
+    bool cancelled;
+    rr_call_proc *proc;
+    void *ud;
+} rr_call_t;
+
+typedef struct reactor_msg_t {
+    struct reactor_msg_t *next;
+    int type;
+    rr_call_t *call;
+} reactor_msg_t;
+
+typedef struct rr_reactor_t {
+    pthread_t thread;
+    struct rr_server_t *state;  /* server state of the reactor */
+    int notify_fds[2];          /* pipe waking the reactor up */
+    reactor_msg_t *inbox;       /* messages sent to the reactor, newest first */
+} rr_reactor_t;
+
+#define JOB_FORWARD 0
+#define JOB_LEN 1
+#define JOB_SCAN 2
+#define JOB_BQPOP 3
+
+/* Calls a client is blocked on */
+typedef struct reactor_job_t {
+    rr_client_t *c;
+    int type;
+    int pending;                           /* calls not replied yet */
+    rr_call_t *calls[REACTORS_MAX_NUM];    /* calls by target reactor */
+    sds err;                               /* first error replied */
+    long long len;                         /* LEN */
+    list *keys;                            /* SCAN, keys found so far */
+    sds cursor;                            /* SCAN, lowest unfinished cursor */
+    long long count;                       /* SCAN, keys to reply at most */
+    robj **argv;                           /* BQPOP */
+    int argc;
+    int next;                              /* BQPOP, key to pop from */
+    ev_timer_t *timer;                     /* BQPOP, timeout */
+    bool expired;
+} reactor_job_t;
+
+static rr_reactor_t reactors[REACTORS_MAX_NUM];
+static rr_configuration *reactors_cfg;
+
+/* Every reactor waits for the others to be ready before serving */
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond = PTHREAD_COND_INITIALIZER;
+static int ready_num = 0;
+
+static void wait_reactors_ready(void) {
+    pthread_mutex_lock(&ready_lock);
+    ready_num++;
+    pthread_cond_broadcast(&ready_cond);
+    while (ready_num < server.reactors_num)
+        pthread_cond_wait(&ready_cond, &ready_lock);
+    pthread_mutex_unlock(&ready_lock);
+}
+
+static void reactor_send(int id, int type, rr_call_t *call) {
+    rr_reactor_t *r = &reactors[id];
+    reactor_msg_t *msg = rr_malloc(sizeof(*msg)), *head;
+
+    msg->type = type;
+    msg->call = call;
+    head = __atomic_load_n(&r->inbox, __ATOMIC_RELAXED);
+    do {
+        msg->next = head;
+    } while (!__atomic_compare_exchange_n(&r->inbox, &head, msg, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+    /* The reactor takes the whole inbox once woken up, so that only an empty
+     * inbox needs a wake up. A full pipe means it's to be woken up already. */
+    if (head == NULL && write(r->notify_fds[1], "", 1) == -1 && errno != EAGAIN)
+        rr_log(RR_LOG_ERROR, "Waking up reactor %d: %s", id, strerror(errno));
+}
+
+static void call_free(rr_call_t *call) {
+    int i;
+
+    for (i = 0; call->argv && i < call->argc; i++)
+        decrRefCount(call->argv[i]);
+    rr_free(call->argv);
+    if (call->reply) listRelease(call->reply);
+    sdsfree(call->flat);
+    rr_free(call);
+}
+
+static void call_run(rr_call_t *call) {
+    rr_client_t *c = rr_client_create(-1);
+
+    call->proxy = c;
+    c->call = call;
+    c->db = server.dbs[call->dbid];
+    rr_free(c->argv);
+    c->argv = call->argv;
+    c->argc = c->argv_size = call->argc;
+    call->argv = NULL;
+    c->flags |= CLIENT_PENDING_COMMAND;
+    rr_client_process_input(c);
+}
+
+void rr_reactor_call_reply(rr_client_t *c) {
+    rr_call_t *call = c->call;
+
+    assert(!(c->flags & CLIENT_BLOCKED));
+    if (c->buf_offset) {
+        listAddNodeHead(c->reply, createRawStringObject(c->buf, c->buf_offset));
+        c->buf_offset = 0;
+    }
+    call->reply = c->reply;
+    c->reply = listCreate();
+    c->call = NULL;
+    call->proxy = NULL;
+    rr_client_free(c);
+    reactor_send(call->from, REACTOR_MSG_REPLY, call);
+}
+
+static void call_cancel(rr_call_t *call) {
+    rr_client_t *c = call->proxy;
+
+    /* Unless the reply is on its way already */
+    if (c) {
+        c->call = NULL;
+        call->proxy = NULL;
+        rr_client_free(c);
+        reactor_send(call->from, REACTOR_MSG_REPLY, call);
+    }
+    reactor_send(call->from, REACTOR_MSG_CANCELLED, call);
+}
+
+static void call_replied(rr_call_t *call, int type) {
+    if (type == REACTOR_MSG_REPLY && !call->cancelled)
+        call->proc(call, call->ud);
+    if (--call->pending == 0) call_free(call);
+}
+
+static void handle_inbox(eventloop_t *el, int fd, void *ud, int mask) {
+    rr_reactor_t *r = ud;
+    reactor_msg_t *msg, *next, *fifo = NULL;
+    char buf[64];
+    UNUSED(el);
+    UNUSED(mask);
+
+    while (read(fd, buf, sizeof(buf)) > 0);
+
+    /* Take all the messages, oldest first */
+    msg = __atomic_exchange_n(&r->inbox, NULL, __ATOMIC_ACQUIRE);
+    while (msg) {
+        next = msg->next;
+        msg->next = fifo;
+        fifo = msg;
+        msg = next;
+    }
+
+    while ((msg = fifo) != NULL) {
+        fifo = msg->next;
+        switch (msg->type) {
+        case REACTOR_MSG_CALL: call_run(msg->call); break;
+        case REACTOR_MSG_CANCEL: call_cancel(msg->call); break;
+        default: call_replied(msg->call, msg->type); break;
+        }
+        rr_free(msg);
+    }
+}
+
+static void reactor_listen(rr_reactor_t *r) {
+    if (pipe(r->notify_fds) == -1) {
+        rr_log(RR_LOG_CRITICAL, "Can not create the reactor pipe: %s", strerror(errno));
+        exit(1);
+    }
+    if (rr_net_nonblock(server.err, r->notify_fds[0]) == RR_NET_ERR ||
+        rr_net_nonblock(server.err, r->notify_fds[1]) == RR_NET_ERR ||
+        el_event_add(server.el, r->notify_fds[0], RR_EV_READ, handle_inbox, r)
+            == RR_EV_ERR) {
+        rr_log(RR_LOG_CRITICAL, "Can not listen to the reactor pipe");
+        exit(1);
+    }
+}
+
+static void *reactor_main(void *arg) {
+    rr_reactor_t *r = arg;
+    sigset_t set;
+
+    /* Leave the signals to the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    rr_server_self = r->state;
+    rr_server_init_reactor(reactors_cfg, r - reactors);
+    reactor_listen(r);
+    wait_reactors_ready();
+
+    el_main(server.el);
+    return NULL;
+}
+
+void rr_reactor_init(rr_configuration *cfg) {
+    int i, err;
+
+    if (cfg->reactors == 1) return;
+
+    reactors_cfg = cfg;
+    for (i = 0; i < cfg->reactors; i++) {
+        rr_reactor_t *r = &reactors[i];
+
+        r->inbox = NULL;
+        if (i == 0) {  /* the main thread */
+            r->state = &server;
+            reactor_listen(r);
+            continue;
+        }
+
+        /* Start with the settings of the main reactor, the reactor sets up
+         * its own state */
+        r->state = rr_malloc(sizeof(*r->state));
+        *r->state = server;
+        r->state->pidfile = NULL;
+        r->state->unix_socket_sock = NULL;
+        err = pthread_create(&r->thread, NULL, reactor_main, r);
+        if (err != 0) {
+            rr_log(RR_LOG_CRITICAL, "Can not create reactor thread: %s", strerror(err));
+            exit(1);
+        }
+    }
+    wait_reactors_ready();
+}
+
+/* FNV-1a, any hash does as long as all the reactors agree on it */
+int rr_reactor_of_key(robj *key) {
+    const unsigned char *p = key->ptr;
+    size_t len = sdslen(key->ptr);
+    uint32_t h = 2166136261u;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 16777619u;
+    }
+    return h % server.reactors_num;
+}
+
+rr_call_t *rr_reactor_call(int id, int dbid, robj **argv, int argc,
+                           rr_call_proc *proc, void *ud) {
+    rr_call_t *call = rr_malloc(sizeof(*call));
+
+    call->from = server.reactor_id;
+    call->to = id;
+    call->dbid = dbid;
+    call->argc = argc;
+    call->argv = argv;
+    call->proxy = NULL;
+    call->reply = NULL;
+    call->flat = NULL;
+    call->pos = 0;
+    call->pending = 1;
+    call->cancelled = false;
+    call->proc = proc;
+    call->ud = ud;
+    reactor_send(id, REACTOR_MSG_CALL, call);
+    return call;
+}
+
+void rr_reactor_call_cancel(rr_call_t *call) {
+    if (call->cancelled) return;
+    call->cancelled = true;
+    call->pending++;
+    reactor_send(call->to, REACTOR_MSG_CANCEL, call);
+}
+
+int rr_call_reply_read(rr_call_t *call, long long *ll, const char **str, size_t *len) {
+    char *p, *end;
+    int type;
+
+    if (call->flat == NULL) {
+        listIter li;
+        listNode *ln;
+
+        call->flat = sdsempty();
+        listRewind(call->reply, &li);
+        while ((ln = listNext(&li)) != NULL) {
+            robj *o = listNodeValue(ln);
+            call->flat = sdscatsds(call->flat, o->ptr);
+        }
+    }
+    if (call->pos >= sdslen(call->flat)) return 0;
+
+    p = call->flat + call->pos;
+    end = strchr(p, '\r');
+    type = *p;
+    call->pos = end + 2 - call->flat;
+    switch (type) {
+    case '$':
+        *ll = strtoll(p+1, NULL, 10);
+        *str = *ll < 0 ? NULL : call->flat + call->pos;
+        *len = *ll < 0 ? 0 : (size_t) *ll;
+        if (*ll >= 0) call->pos += *ll + 2;
+        break;
+    case ':':
+    case '*':
+        *ll = strtoll(p+1, NULL, 10);
+        break;
+    default:
+        *str = p+1;
+        *len = end - (p+1);
+        break;
+    }
+    return type;
+}
+
+void rr_call_reply_to(rr_call_t *call, rr_client_t *c) {
+    reply_add_list(c, call->reply);
+}
+
+/* Take the arguments of the parsed command away from the client */
+static robj **argv_take(rr_client_t *c) {
+    robj **argv = rr_malloc(sizeof(robj *) * c->argc);
+
+    memcpy(argv, c->argv, sizeof(robj *) * c->argc);
+    c->argc = 0;
+    return argv;
+}
+
+static robj **argv_dup(robj **src, int argc) {
+    robj **argv = rr_malloc(sizeof(robj *) * argc);
+    int i;
+
+    for (i = 0; i < argc; i++)
+        argv[i] = createStringObject(src[i]->ptr, sdslen(src[i]->ptr));
+    return argv;
+}
+
+static reactor_job_t *job_create(rr_client_t *c, int type) {
+    reactor_job_t *job = rr_malloc(sizeof(*job));
+
+    memset(job, 0, sizeof(*job));
+    job->c = c;
+    job->type = type;
+    rr_client_block(c, NULL, 0, 0);
+    c->bpop.job = job;
+    return job;
+}
+
+static void job_free(reactor_job_t *job) {
+    int i;
+
+    for (i = 0; i < server.reactors_num; i++)
+        if (job->calls[i]) rr_reactor_call_cancel(job->calls[i]);
+    if (job->timer) el_timer_del(server.el, job->timer);
+    sdsfree(job->err);
+    if (job->keys) listRelease(job->keys);
+    sdsfree(job->cursor);
+    for (i = 0; i < job->argc; i++)
+        decrRefCount(job->argv[i]);
+    rr_free(job->argv);
+    rr_free(job);
+}
+
+/* Reply the first error if any, and unblock the client */
+static void job_done(reactor_job_t *job) {
+    rr_client_t *c = job->c;
+
+    if (job->err) reply_add_str(c, job->err, sdslen(job->err));
+    c->bpop.job = NULL;
+    rr_client_unblock(c);
+    job_free(job);
+}
+
+void rr_reactor_dispatch_cancel(rr_client_t *c) {
+    reactor_job_t *job = c->bpop.job;
+
+    c->bpop.job = NULL;
+    job_free(job);
+}
+
+/* Keep the first error the call replied, returns true if it was one */
+static bool job_error(reactor_job_t *job, rr_call_t *call) {
+    const char *str;
+    long long ll;
+    size_t len;
+
+    call->pos = 0;
+    if (rr_call_reply_read(call, &ll, &str, &len) != '-') {
+        call->pos = 0;
+        return false;
+    }
+    if (!job->err) job->err = sdscatlen(sdsnewlen(str-1, len+1), "\r\n", 2);
+    return true;
+}
+
+static void job_forwarded(rr_call_t *call, void *ud) {
+    reactor_job_t *job = ud;
+
+    job->calls[call->to] = NULL;
+    rr_call_reply_to(call, job->c);
+    job_done(job);
+}
+
+static int sds_cmp(const void *l, const void *r) {
+    return strcmp(*(const sds *) l, *(const sds *) r);
+}
+
+/* The keys of all the reactors up to the lowest cursor of the unfinished
+ * scans were all returned, and are the keys of the merged scan. Only COUNT of
+ * them are replied though, the last one being the cursor of the next call as
+ * on a single reactor. */
+static void job_scan_reply(reactor_job_t *job) {
+    rr_client_t *c = job->c;
+    sds *keys = rr_malloc(sizeof(sds) * (listLength(job->keys) + 1));
+    const char *cursor = job->cursor;
+    long n = 0, i;
+    listIter li;
+    listNode *ln;
+
+    listRewind(job->keys, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        sds key = listNodeValue(ln);
+
+        if (!job->cursor || strcmp(key, job->cursor) <= 0) keys[n++] = key;
+    }
+    qsort(keys, n, sizeof(sds), sds_cmp);
+    /* The empty key can't be a cursor, it's only the first key anyway */
+    if (n > job->count && *keys[job->count-1]) {
+        n = job->count;
+        cursor = keys[n-1];
+    }
+
+    reply_add_multi_bulk_len(c, 2);
+    reply_add_bulk_cstr(c, cursor ? cursor : "");
+    reply_add_multi_bulk_len(c, n);
+    for (i = 0; i < n; i++)
+        reply_add_bulk_cbuf(c, keys[i], sdslen(keys[i]));
+    rr_free(keys);
+}
+
+static void job_gathered(rr_call_t *call, void *ud) {
+    reactor_job_t *job = ud;
+    const char *str;
+    long long ll, n;
+    size_t len;
+
+    job->calls[call->to] = NULL;
+    job->pending--;
+    if (job_error(job, call)) {
+        /* Nothing to gather */
+    } else if (job->type == JOB_LEN) {
+        rr_call_reply_read(call, &ll, &str, &len);
+        job->len += ll;
+    } else {
+        rr_call_reply_read(call, &ll, &str, &len);
+        rr_call_reply_read(call, &ll, &str, &len);
+        if (len) {
+            sds cursor = sdsnewlen(str, len);
+
+            if (!job->cursor || strcmp(cursor, job->cursor) < 0) {
+                sdsfree(job->cursor);
+                job->cursor = cursor;
+            } else {
+                sdsfree(cursor);
+            }
+        }
+        rr_call_reply_read(call, &n, &str, &len);
+        while (n--) {
+            rr_call_reply_read(call, &ll, &str, &len);
+            listAddNodeTail(job->keys, sdsnewlen(str, len));
+        }
+    }
+    if (job->pending) return;
+
+    if (job->err)
+        ;
+    else if (job->type == JOB_LEN)
+        reply_add_longlong(job->c, job->len);
+    else
+        job_scan_reply(job);
+    job_done(job);
+}
+
+/* Run the command on every reactor and gather the replies */
+static void dispatch_all(rr_client_t *c, int type) {
+    reactor_job_t *job = job_create(c, type);
+    int i;
+
+    if (type == JOB_SCAN) {
+        job->keys = listCreate();
+        listSetFreeMethod(job->keys, (void (*)(void *)) sdsfree);
+        /* The reactors reply the syntax errors */
+        job->count = SCAN_DEFAULT_COUNT;
+        for (i = 2; i+1 < c->argc; i += 2) {
+            if (!strcasecmp(c->argv[i]->ptr, "count") &&
+                getLongLongFromObject(c->argv[i+1], &job->count) != RR_OK)
+                job->count = SCAN_DEFAULT_COUNT;
+        }
+    }
+    job->pending = server.reactors_num;
+    for (i = 0; i < server.reactors_num; i++)
+        job->calls[i] = rr_reactor_call(i, c->db->id, argv_dup(c->argv, c->argc),
+                                        c->argc, job_gathered, job);
+}
+
+static void dispatch_forward(rr_client_t *c, int id) {
+    reactor_job_t *job = job_create(c, JOB_FORWARD);
+    int argc = c->argc;
+
+    job->pending = 1;
+    job->calls[id] = rr_reactor_call(id, c->db->id, argv_take(c), argc,
+                                     job_forwarded, job);
+}
+
+static void bqpop_try(reactor_job_t *job);
+static void bqpop_wait(reactor_job_t *job);
+
+static int bqpop_timeout(eventloop_t *el, void *ud) {
+    reactor_job_t *job = ud;
+    UNUSED(el);
+
+    /* The timer is removed once it returns */
+    job->timer = NULL;
+    job->expired = true;
+    /* A pop in flight goes on, the client just won't wait afterwards */
+    if (job->next < job->argc-1) return 0;
+    reply_add_obj(job->c, shared.nullmultibulk);
+    job_done(job);
+    return 0;
+}
+
+static void bqpop_popped(rr_call_t *call, void *ud) {
+    reactor_job_t *job = ud;
+    robj *key = job->argv[job->next];
+    const char *str;
+    long long ll;
+    size_t len;
+
+    job->calls[call->to] = NULL;
+    job->pending--;
+    if (job_error(job, call)) {
+        job_done(job);
+        return;
+    }
+    if (rr_call_reply_read(call, &ll, &str, &len) != '*' || ll == 0) {
+        job->next++;
+        bqpop_try(job);
+        return;
+    }
+    rr_call_reply_read(call, &ll, &str, &len);
+    reply_add_multi_bulk_len(job->c, 2);
+    reply_add_bulk_obj(job->c, key);
+    reply_add_bulk_cbuf(job->c, str, len);
+    job_done(job);
+}
+
+static void bqpop_ready(rr_call_t *call, void *ud) {
+    reactor_job_t *job = ud;
+    int i;
+
+    job->calls[call->to] = NULL;
+    job->pending--;
+    if (job_error(job, call)) {
+        job_done(job);
+        return;
+    }
+
+    /* Some key got items, try them all again in order */
+    for (i = 0; i < server.reactors_num; i++) {
+        if (job->calls[i]) {
+            rr_reactor_call_cancel(job->calls[i]);
+            job->calls[i] = NULL;
+        }
+    }
+    job->pending = 0;
+    job->next = 1;
+    bqpop_try(job);
+}
+
+/* Pop from the next key, the keys being job->argv[1..argc-2]. QPOPN replies
+ * an array, which nothing but a member popped can pass for. */
+static void bqpop_try(reactor_job_t *job) {
+    robj *key = job->argv[job->next];
+    robj **argv;
+    int id;
+
+    if (job->next == job->argc-1) {
+        bqpop_wait(job);
+        return;
+    }
+    id = rr_reactor_of_key(key);
+    argv = rr_malloc(sizeof(robj *) * 3);
+    argv[0] = createStringObject("qpopn", 5);
+    argv[1] = createStringObject(key->ptr, sdslen(key->ptr));
+    argv[2] = createStringObject("1", 1);
+    job->pending++;
+    job->calls[id] = rr_reactor_call(id, job->c->db->id, argv, 3, bqpop_popped, job);
+}
+
+/* Wait for any of the keys to get items, with a QWAIT per reactor */
+static void bqpop_wait(reactor_job_t *job) {
+    robj **argv[REACTORS_MAX_NUM] = {NULL};
+    int argc[REACTORS_MAX_NUM] = {0};
+    int i, id;
+
+    if (job->expired) {
+        reply_add_obj(job->c, shared.nullmultibulk);
+        job_done(job);
+        return;
+    }
+
+    for (i = 1; i < job->argc-1; i++) {
+        robj *key = job->argv[i];
+
+        id = rr_reactor_of_key(key);
+        if (!argv[id]) {
+            argv[id] = rr_malloc(sizeof(robj *) * job->argc);
+            argv[id][argc[id]++] = createStringObject("qwait", 5);
+        }
+        argv[id][argc[id]++] = createStringObject(key->ptr, sdslen(key->ptr));
+    }
+    for (id = 0; id < server.reactors_num; id++) {
+        if (!argv[id]) continue;
+        job->pending++;
+        job->calls[id] = rr_reactor_call(id, job->c->db->id, argv[id], argc[id],
+                                         bqpop_ready, job);
+    }
+}
+
+/* BQPOP key [key ...] timeout, the keys belonging to different reactors */
+static void dispatch_bqpop(rr_client_t *c) {
+    reactor_job_t *job;
+    double timeout;
+
+    if (getDoubleFromObjectOrReply(c, c->argv[c->argc-1], &timeout,
+        "timeout is not a float or out of range")) return;
+    if (timeout < 0) {
+        reply_add_err(c, "timeout is negative");
+        return;
+    }
+
+    job = job_create(c, JOB_BQPOP);
+    job->argc = c->argc;
+    job->argv = argv_take(c);
+    job->next = 1;
+    /* Wait for at least a millisecond for the tiny positive timeouts */
+    if (timeout > 0)
+        job->timer = el_timer_add(server.el, timeout < 0.001 ? 1 : (long long) (timeout * 1000),
+                                  bqpop_timeout, job);
+    bqpop_try(job);
+}
+
+bool rr_reactor_dispatch(rr_client_t *c) {
+    struct redisCommand *cmd = cmd_lookup(c->argv[0]->ptr);
+    int i, last, id, owner = -1;
+    bool spread = false;
+
+    /* Leave the errors to the current reactor */
+    if (!cmd || (cmd->flags & CMD_INTERNAL) ||
+        (cmd->arity > 0 && cmd->arity != c->argc) || c->argc < -cmd->arity)
+        return false;
+
+    if (cmd->proc == rr_cmd_len || cmd->proc == rr_cmd_scan) {
+        dispatch_all(c, cmd->proc == rr_cmd_len ? JOB_LEN : JOB_SCAN);
+        return true;
+    }
+    if (cmd->firstkey == 0) return false;
+
+    last = cmd->lastkey < 0 ? c->argc + cmd->lastkey : cmd->lastkey;
+    for (i = cmd->firstkey; i <= last && i < c->argc; i += cmd->keystep) {
+        id = rr_reactor_of_key(c->argv[i]);
+        if (owner == -1)
+            owner = id;
+        else if (id != owner)
+            spread = true;
+    }
+
+    if (spread && cmd->proc == rr_cmd_bqpop) {
+        dispatch_bqpop(c);
+        return true;
+    }
+    /* QMERGE runs on the reactor of dst, which takes the members of src */
+    if (spread && cmd->proc != rr_cmd_hqmerge) {
+        reply_add_err(c, "keys of the command belong to different reactors");
+        return true;
+    }
+    if (owner == -1 || owner == server.reactor_id) return false;
+    dispatch_forward(c, owner);
+    return true;
+}
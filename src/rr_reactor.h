@@ -0,0 +1,53 @@
+#ifndef _RR_REACTOR_H
+#define _RR_REACTOR_H
+
+#include "rr_config.h"
+#include "rr_server.h"
+
+#include <stdbool.h>
+
+#define REACTORS_MAX_NUM 64
+
+struct rr_call_t;
+
+/* Called on the calling reactor with the reply of a call */
+typedef void rr_call_proc(struct rr_call_t *call, void *ud);
+
+/* Start the reactors other than the main one, each in its own thread with its
+ * own event loop, listening socket and share of the keyspace. It returns once
+ * all of them are ready to serve. */
+void rr_reactor_init(rr_configuration *cfg);
+
+/* Reactor owning the key */
+int rr_reactor_of_key(robj *key);
+
+/* Run the parsed command of the client on the reactors owning its keys if
+ * that's not only the current one, the client being blocked until they reply.
+ * Returns false if the command is to be executed right away instead. */
+bool rr_reactor_dispatch(rr_client_t *c);
+
+/* Stop waiting for the other reactors, called when the client is unblocked */
+void rr_reactor_dispatch_cancel(rr_client_t *c);
+
+/* Run the command on the reactor id, in the db of the given id, and call proc
+ * with its reply once done. The call takes the ownership of the arguments. */
+struct rr_call_t *rr_reactor_call(int id, int dbid, robj **argv, int argc,
+                                  rr_call_proc *proc, void *ud);
+
+/* Drop the call, proc won't be called. A blocked command is unblocked. */
+void rr_reactor_call_cancel(struct rr_call_t *call);
+
+/* Send the reply of the client running a call back to the calling reactor,
+ * and free the client */
+void rr_reactor_call_reply(rr_client_t *c);
+
+/* Read the next element of the reply of a call: a bulk string or a nil in str
+ * and len, an integer or the length of an array in ll, or an error or a
+ * status in str and len. Returns the type, '$', ':', '*', '-' or '+', and 0
+ * at the end of the reply. */
+int rr_call_reply_read(struct rr_call_t *call, long long *ll, const char **str, size_t *len);
+
+/* Copy the reply of the call to the client */
+void rr_call_reply_to(struct rr_call_t *call, rr_client_t *c);
+
+#endif /* ifndef _RR_REACTOR_H */
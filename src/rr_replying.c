@@ -1,3 +1,5 @@
+#include "rr_ftmacro.h"
+
 #include "rr_server.h"
 #include "rr_logging.h"
 #include "rr_rhino_rox.h"
@@ -5,6 +7,8 @@
 #include "robj.h"
 #include "util.h"
 
+#include <sys/uio.h>
+#include <limits.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -12,6 +16,7 @@
 #include <assert.h>
 #include <math.h>
 #include <stdarg.h>
+#include <stdio.h>
 
 static int prepare_client_to_write(rr_client_t *c);
 static int add_reply_to_buffer(rr_client_t *c, const char *s, size_t len);
@@ -24,11 +29,13 @@ bool client_has_pending_replies(rr_client_t *c) {
 
 /*  Set the flag for this client, and add it to the client list with pending write */
 static int prepare_client_to_write(rr_client_t *c) {
-    if (c->fd <= 0) return RR_ERROR;
+    /* The clients running a command of another reactor send the replies back
+     * to it instead, see rr_reactor.c */
+    if (c->fd <= 0 && !c->call) return RR_ERROR;
 
     /* Schedule the client to write the output buffers to the socket only
      * if not already done (there were no pending writes already and the client
-     * was yet not flagged) */
+     * was yet not flagged). */
     if (!client_has_pending_replies(c) && !(c->flags & CLIENT_PENDING_WRITE)) {
         /* Here instead of installing the write handler, we just flag the
          * client and put it into a list of clients that have something
@@ -45,9 +52,26 @@ static int prepare_client_to_write(rr_client_t *c) {
 }
 
 
-static int add_reply_to_buffer(rr_client_t *c, const char *s, size_t len) {
-    size_t available = sizeof(c->buf)-c->buf_offset;
+/* Make room for len more bytes in the output buffer. It grows as long as
+ * the replies fit into PROTO_REPLY_BUF_MAX_LEN, so that the replies of a whole
+ * pipeline are written with a single write. The values larger than
+ * PROTO_REPLY_MAX_LEN don't make it grow, they are referenced by the reply
+ * list instead of being copied. */
+static bool reply_buffer_room(rr_client_t *c, size_t len) {
+    size_t needed = c->buf_offset+len, size = c->buf_size;
+
+    if (needed <= size) return true;
+    if (len > PROTO_REPLY_MAX_LEN || needed > PROTO_REPLY_BUF_MAX_LEN) return false;
+
+    if (size == 0) size = PROTO_REPLY_MAX_LEN;
+    while (size < needed) size *= 2;
+    if (size > PROTO_REPLY_BUF_MAX_LEN) size = PROTO_REPLY_BUF_MAX_LEN;
+    c->buf = rr_realloc(c->buf, size);
+    c->buf_size = size;
+    return true;
+}
 
+static int add_reply_to_buffer(rr_client_t *c, const char *s, size_t len) {
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return RR_OK;
 
     /* If there already are entries in the reply list, we cannot
@@ -55,86 +79,70 @@ static int add_reply_to_buffer(rr_client_t *c, const char *s, size_t len) {
     if (listLength(c->reply) > 0) return RR_ERROR;
 
     /* Check that the buffer has enough space available for this string. */
-    if (len > available) return RR_ERROR;
+    if (!reply_buffer_room(c, len)) return RR_ERROR;
 
     memcpy(c->buf+c->buf_offset, s, len);
     c->buf_offset += len;
     return RR_OK;
 }
 
+/* The reply list is made of string objects: chunks owned by the list, which
+ * the small replies are appended to, and references to the values larger than
+ * PROTO_REPLY_MAX_LEN, which are written straight from the value instead of
+ * being copied. Return the last node if len bytes can be appended to it, the
+ * references are never appended to as they are always above the limit. */
+static robj *reply_list_tail(rr_client_t *c, size_t len) {
+    listNode *ln = listLast(c->reply);
+    robj *tail;
+
+    /* A NULL tail was set via reply_add_deferred_multi_bulk_len() */
+    if (ln == NULL || (tail = listNodeValue(ln)) == NULL) return NULL;
+    return sdslen(tail->ptr)+len <= PROTO_REPLY_MAX_LEN ? tail : NULL;
+}
+
 static void add_reply_object_to_list(rr_client_t *c, robj *o) {
+    size_t len = sdslen(o->ptr);
+
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
 
-    if (listLength(c->reply) == 0) {
-        sds s = sdsdup(o->ptr);
-        listAddNodeTail(c->reply,s);
-        c->replied_len += sdslen(s);
+    if (len > PROTO_REPLY_MAX_LEN) {
+        incrRefCount(o);
+        listAddNodeTail(c->reply, o);
+        c->replied_len += len;
     } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(o->ptr) <= PROTO_REPLY_MAX_LEN) {
-            tail = sdscatsds(tail,o->ptr);
-            listNodeValue(ln) = tail;
-            c->replied_len += sdslen(o->ptr);
-        } else {
-            sds s = sdsdup(o->ptr);
-            listAddNodeTail(c->reply,s);
-            c->replied_len += sdslen(s);
-        }
+        add_reply_str_to_list(c, o->ptr, len);
     }
 }
 
 /* This method takes responsibility on the sds. When it is no longer
  * needed it will be free'd, otherwise it ends up in a robj. */
 void add_reply_sds_to_list(rr_client_t *c, sds s) {
+    robj *tail;
+
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
         sdsfree(s);
         return;
     }
 
     c->replied_len += sdslen(s);
-    if (listLength(c->reply) == 0) {
-        listAddNodeTail(c->reply, s);
+    if ((tail = reply_list_tail(c, sdslen(s))) != NULL) {
+        tail->ptr = sdscatsds(tail->ptr, s);
+        sdsfree(s);
     } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+sdslen(s) <= PROTO_REPLY_MAX_LEN) {
-            tail = sdscatsds(tail,s);
-            listNodeValue(ln) = tail;
-            sdsfree(s);
-        } else {
-            listAddNodeTail(c->reply, s);
-        }
+        listAddNodeTail(c->reply, createObject(OBJ_STRING, s));
     }
 }
 
 void add_reply_str_to_list(rr_client_t *c, const char *s, size_t len) {
+    robj *tail;
+
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
 
     c->replied_len += len;
-    if (listLength(c->reply) == 0) {
-        sds node = sdsnewlen(s, len);
-        listAddNodeTail(c->reply,node);
-    } else {
-        listNode *ln = listLast(c->reply);
-        sds tail = listNodeValue(ln);
-
-        /* Append to this object when possible. If tail == NULL it was
-         * set via addDeferredMultiBulkLength(). */
-        if (tail && sdslen(tail)+len <= PROTO_REPLY_MAX_LEN) {
-            tail = sdscatlen(tail, s, len);
-            listNodeValue(ln) = tail;
-        } else {
-            sds node = sdsnewlen(s, len);
-            listAddNodeTail(c->reply, node);
-        }
-    }
+    if ((tail = reply_list_tail(c, len)) != NULL)
+        tail->ptr = sdscatlen(tail->ptr, s, len);
+    else
+        listAddNodeTail(c->reply, createRawStringObject(s, len));
 }
 
 void reply_add_obj(rr_client_t *c, robj *obj) {
@@ -154,7 +162,7 @@ void reply_add_obj(rr_client_t *c, robj *obj) {
         /* Optimization: if there is room in the static buffer for 32 bytes
          * (more than the max chars a 64 bit integer can take as string) we
          * avoid decoding the object and go for the lower level approach. */
-        if (listLength(c->reply) == 0 && (sizeof(c->buf) - c->buf_offset) >= 32) {
+        if (listLength(c->reply) == 0 && c->buf_size - c->buf_offset >= 32) {
             char buf[32];
             int len;
 
@@ -262,6 +270,36 @@ void reply_add_multi_bulk_len(rr_client_t *c, long length) {
         reply_add_longlong_with_prefix(c, length, '*');
 }
 
+/* Add a placeholder to the reply list for a multi bulk length which is not
+ * known yet, the caller streams the elements and then sets the length with
+ * reply_set_deferred_multi_bulk_len. */
+void *reply_add_deferred_multi_bulk_len(rr_client_t *c) {
+    if (prepare_client_to_write(c) != RR_OK) return NULL;
+    listAddNodeTail(c->reply, NULL); /* NULL is our placeholder. */
+    return listLast(c->reply);
+}
+
+/* Fill in the placeholder returned by reply_add_deferred_multi_bulk_len */
+void reply_set_deferred_multi_bulk_len(rr_client_t *c, void *node, long length) {
+    listNode *ln = (listNode *) node;
+    robj *next;
+    sds len;
+
+    if (node == NULL) return;
+
+    len = sdscatprintf(sdsnewlen("*", 1), "%ld\r\n", length);
+    c->replied_len += sdslen(len);
+    if (ln->next != NULL) {
+        next = listNodeValue(ln->next);
+        /* Only glue when the next node is non-NULL (an object in this case) */
+        if (next != NULL && sdslen(len)+sdslen(next->ptr) <= PROTO_REPLY_MAX_LEN) {
+            len = sdscatsds(len, next->ptr);
+            listDelNode(c->reply, ln->next);
+        }
+    }
+    listNodeValue(ln) = createObject(OBJ_STRING, len);
+}
+
 /* Create the length prefix of a bulk reply, example: $2234 */
 void reply_add_bulk_len(rr_client_t *c, robj *obj) {
     size_t len;
@@ -295,6 +333,22 @@ void reply_add_bulk_obj(rr_client_t *c, robj *obj) {
     reply_add_obj(c, shared.crlf);
 }
 
+/* Add the replies gathered by another client, see rr_reactor.c */
+void reply_add_list(rr_client_t *c, list *reply) {
+    listIter li;
+    listNode *ln;
+
+    if (prepare_client_to_write(c) != RR_OK) return;
+
+    listRewind(reply, &li);
+    while ((ln = listNext(&li)) != NULL) {
+        robj *o = listNodeValue(ln);
+
+        if (add_reply_to_buffer(c, o->ptr, sdslen(o->ptr)) != RR_OK)
+            add_reply_object_to_list(c, o);
+    }
+}
+
 /* Add a C buffer as bulk reply */
 void reply_add_bulk_cbuf(rr_client_t *c, const void *p, size_t len) {
     reply_add_longlong_with_prefix(c, len, '$');
@@ -328,47 +382,121 @@ void reply_add_bulk_longlong(rr_client_t *c, long long ll) {
     reply_add_bulk_cbuf(c, buf, len);
 }
 
-/* Write data in output buffers to client. Return RR_OK if the client
- * is still valid after the call, RR_ERROR if it was freed. */
-int reply_write_to_client(int fd, rr_client_t *c, int handler_installed) {
-    ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    sds o;
+/* Add a double as a bulk reply */
+void reply_add_double(rr_client_t *c, double d) {
+    char buf[128];
+    int len;
 
-    while(client_has_pending_replies(c)) {
-        if (c->buf_offset > 0) {
-            nwritten = write(fd,c->buf+c->buf_sent_len,c->buf_offset-c->buf_sent_len);
-            if (nwritten <= 0) break;
+    if (isinf(d)) {
+        reply_add_bulk_cstr(c, d > 0 ? "inf" : "-inf");
+    } else {
+        len = snprintf(buf, sizeof(buf), "%.17g", d);
+        reply_add_bulk_cbuf(c, buf, len);
+    }
+}
+
+/* Gather the static buffer and the reply list into iov, up to IOV_MAX entries
+ * and a bit more than NET_MAX_WRITES_PER_EVENT bytes. Returns the number of
+ * entries, and their total length in len. The nodes larger than
+ * PROTO_REPLY_MAX_LEN are never appended to, their objects go in refs for the
+ * loop to send them from where they are. */
+static int reply_gather(rr_client_t *c, struct iovec *iov, void **refs, size_t *len) {
+    size_t offset = c->buf_sent_len;
+    listIter li;
+    listNode *ln;
+    int iovcnt = 0;
+
+    *len = 0;
+    if (c->buf_offset > 0) {
+        refs[iovcnt] = NULL;
+        iov[iovcnt].iov_base = c->buf+offset;
+        iov[iovcnt++].iov_len = c->buf_offset-offset;
+        *len += c->buf_offset-offset;
+        offset = 0;
+    }
+
+    listRewind(c->reply, &li);
+    while (iovcnt < IOV_MAX && *len < NET_MAX_WRITES_PER_EVENT &&
+           (ln = listNext(&li)) != NULL) {
+        robj *o = listNodeValue(ln);
+        size_t objlen = sdslen(o->ptr);
+
+        if (objlen > offset) {
+            refs[iovcnt] = objlen > PROTO_REPLY_MAX_LEN ? o : NULL;
+            iov[iovcnt].iov_base = (char *) o->ptr+offset;
+            iov[iovcnt++].iov_len = objlen-offset;
+            *len += objlen-offset;
+        }
+        offset = 0;
+    }
+    return iovcnt;
+}
+
+/* Drop the nwritten bytes just written from the static buffer and the head
+ * of the reply list */
+static void reply_consume(rr_client_t *c, size_t nwritten) {
+    listNode *ln;
+
+    if (c->buf_offset > 0) {
+        size_t remaining = c->buf_offset-c->buf_sent_len;
+
+        if (nwritten < remaining) {
             c->buf_sent_len += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set buf_offset to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->buf_sent_len == c->buf_offset) {
-                c->buf_offset = 0;
-                c->buf_sent_len = 0;
-            }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = sdslen(o);
-
-            if (objlen == 0) {
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
-
-            nwritten = write(fd, o + c->buf_sent_len, objlen - c->buf_sent_len);
-            if (nwritten <= 0) break;
+            return;
+        }
+        nwritten -= remaining;
+        /* Give back the room a deeper pipeline needed */
+        if (c->buf_size > PROTO_REPLY_MAX_LEN && c->buf_offset < c->buf_size/4) {
+            c->buf_size /= 2;
+            c->buf = rr_realloc(c->buf, c->buf_size);
+        }
+        c->buf_offset = 0;
+        c->buf_sent_len = 0;
+    }
+
+    /* The empty nodes are dropped along the way */
+    while ((ln = listFirst(c->reply)) != NULL) {
+        robj *o = listNodeValue(ln);
+        size_t objlen = sdslen(o->ptr);
+        size_t remaining = objlen-c->buf_sent_len;
+
+        if (nwritten < remaining) {
             c->buf_sent_len += nwritten;
-            totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->buf_sent_len == objlen) {
-                listDelNode(c->reply,listFirst(c->reply));
-                c->buf_sent_len = 0;
-                c->replied_len -= objlen;
-            }
+            return;
         }
+        nwritten -= remaining;
+        listDelNode(c->reply, ln);
+        c->buf_sent_len = 0;
+        c->replied_len -= objlen;
+    }
+}
+
+/* Write as much of the replies as possible to the socket, gathering the
+ * static buffer and the reply nodes in a single writev. It only touches the
+ * client buffers, so that the I/O threads can call it as well. Returns
+ * RR_ERROR if writing failed, leaving to the caller to free the client. */
+int reply_write_buffers(rr_client_t *c) {
+    struct iovec iov[IOV_MAX];
+    void *refs[IOV_MAX];
+    ssize_t nwritten = 0, totwritten = 0;
+    size_t len;
+    int iovcnt;
+
+    while(client_has_pending_replies(c)) {
+        if ((iovcnt = reply_gather(c, iov, refs, &len)) == 0) {
+            /* Only empty nodes are left */
+            reply_consume(c, 0);
+            break;
+        }
+
+        nwritten = el_writev_ref(server.el, c->fd, iov, refs, iovcnt);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
+        reply_consume(c, nwritten);
+
+        /* The socket buffer is full, a new write would only get EAGAIN */
+        if ((size_t) nwritten < len) break;
+
         /* Note that we avoid sending more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -381,17 +509,22 @@ int reply_write_to_client(int fd, rr_client_t *c, int handler_installed) {
             (server.max_memory == 0 ||
              rr_get_used_memory() < server.max_memory)) break;
     }
-    if (nwritten == -1) {
-        if (errno == EAGAIN) {
-            nwritten = 0;
-        } else {
-            rr_log(RR_LOG_ERROR, "Error writing to client: %s", strerror(errno));
-            rr_client_free(c);
-            return RR_ERROR;
-        }
+    if (nwritten == -1 && errno != EAGAIN) return RR_ERROR;
+    if (!client_has_pending_replies(c)) c->buf_sent_len = 0;
+    return RR_OK;
+}
+
+/* Write data in output buffers to client. Return RR_OK if the client
+ * is still valid after the call, RR_ERROR if it was freed. */
+int reply_write_to_client(int fd, rr_client_t *c, int handler_installed) {
+    UNUSED(fd);
+
+    if (reply_write_buffers(c) != RR_OK) {
+        rr_log(RR_LOG_ERROR, "Error writing to client: %s", strerror(errno));
+        rr_client_free(c);
+        return RR_ERROR;
     }
     if (!client_has_pending_replies(c)) {
-        c->buf_sent_len = 0;
         if (handler_installed) el_event_del(server.el, c->fd, RR_EV_WRITE);
 
         /* Close connection after entire reply has been sent. */
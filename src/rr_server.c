@@ -13,6 +13,9 @@
 #include "rr_cmd_trie.h"
 #include "rr_cmd_heapq.h"
 #include "rr_cmd_fts.h"
+#include "rr_blocking.h"
+#include "rr_iothreads.h"
+#include "rr_reactor.h"
 #include "rr_datetime.h"
 #include "rr_stopwords.h"
 #include "rr_dict.h"
@@ -33,10 +36,13 @@
 #include <string.h>
 #include <sys/resource.h>
 
-struct rr_server_t server;
+static struct rr_server_t main_server;
+__thread struct rr_server_t *rr_server_self = &main_server;
 
 static int server_cron(eventloop_t *el, void *ud);
 static void before_polling(eventloop_t *el);
+static void reply_ref_hold(void *val);
+static void reply_ref_release(void *val);
 static void handle_accept(eventloop_t *el, int fd, void *ud, int mask);
 static void handle_unix_domain_sock_accept(eventloop_t *el, int fd, void *ud, int mask);
 static void add_client(int fd, int flags, char *ip);
@@ -46,7 +52,7 @@ static void free_client_argv(rr_client_t *c);
 static int cmd_process(rr_client_t *c);
 static void call(rr_client_t *c, int flags);
 static void create_pidfile(void);
-static void set_protocol_error(rr_client_t *c, int pos);
+static void set_protocol_error(rr_client_t *c, sds err);
 
 /*
  * Every entry is composed of the following fields:
@@ -98,6 +104,7 @@ static void set_protocol_error(rr_client_t *c, int pos);
  *    its execution as long as the kernel scheduler is giving us time.
  *    Note that commands that may trigger a DEL as a side effect (like SET)
  *    are not fast commands.
+ * I: Internal command, only run by the reactors on behalf of each other.
  */
 struct redisCommand redisCommandTable[] = {
     {"get",rr_cmd_get,2,"rF",0,NULL,1,1,1,0,0},
@@ -109,16 +116,37 @@ struct redisCommand redisCommandTable[] = {
     {"rpget",rr_cmd_rpget,3,"rF",0,NULL,1,1,1,0,0},
     {"rlen",rr_cmd_rlen,2,"rF",0,NULL,1,1,1,0,0},
     {"rset",rr_cmd_rset,4,"wm",0,NULL,1,1,1,0,0},
-    {"rdel",rr_cmd_rdel,3,"wF",0,NULL,1,-1,1,0,0},
+    {"rdel",rr_cmd_rdel,3,"wF",0,NULL,1,1,1,0,0},
     {"rkeys",rr_cmd_rkeys,2,"rF",0,NULL,1,1,1,0,0},
     {"rvalues",rr_cmd_rvalues,2,"rF",0,NULL,1,1,1,0,0},
     {"rgetall",rr_cmd_rgetall,2,"rF",0,NULL,1,1,1,0,0},
-    {"rexists",rr_cmd_rexists,3,"rF",0,NULL,1,-1,1,0,0},
+    {"rexists",rr_cmd_rexists,3,"rF",0,NULL,1,1,1,0,0},
+    {"rscan",rr_cmd_rscan,-3,"rR",0,NULL,1,1,1,0,0},
+    {"rrange",rr_cmd_rrange,-4,"r",0,NULL,1,1,1,0,0},
+    {"rrevrange",rr_cmd_rrevrange,-4,"r",0,NULL,1,1,1,0,0},
+    {"rpcount",rr_cmd_rpcount,3,"rF",0,NULL,1,1,1,0,0},
+    {"rrank",rr_cmd_rrank,3,"rF",0,NULL,1,1,1,0,0},
+    {"rnth",rr_cmd_rnth,3,"rF",0,NULL,1,1,1,0,0},
     {"qpush",rr_cmd_hqpush,4,"wF",0,NULL,1,1,1,0,0},
+    {"qpushn",rr_cmd_hqpushn,-4,"wm",0,NULL,1,1,1,0,0},
+    {"qpushat",rr_cmd_hqpushat,5,"wF",0,NULL,1,1,1,0,0},
     {"qpop",rr_cmd_hqpop,2,"wF",0,NULL,1,1,1,0,0},
     {"qpopn",rr_cmd_hqpopn,3,"wm",0,NULL,1,1,1,0,0},
     {"qpeek",rr_cmd_hqpeek,2,"rF",0,NULL,1,1,1,0,0},
     {"qlen",rr_cmd_hqlen,2,"rF",0,NULL,1,1,1,0,0},
+    {"bqpop",rr_cmd_bqpop,-3,"ws",0,NULL,1,-2,1,0,0},
+    {"qscore",rr_cmd_hqscore,3,"rF",0,NULL,1,1,1,0,0},
+    {"qupdate",rr_cmd_hqupdate,4,"wF",0,NULL,1,1,1,0,0},
+    {"qrem",rr_cmd_hqrem,3,"wF",0,NULL,1,1,1,0,0},
+    {"qcreate",rr_cmd_hqcreate,-2,"wF",0,NULL,1,1,1,0,0},
+    {"qtopk",rr_cmd_hqtopk,-2,"r",0,NULL,1,1,1,0,0},
+    {"qmerge",rr_cmd_hqmerge,3,"wm",0,NULL,1,2,1,0,0},
+    {"qcount",rr_cmd_hqcount,4,"rF",0,NULL,1,1,1,0,0},
+    {"qrangebyscore",rr_cmd_hqrangebyscore,-4,"r",0,NULL,1,1,1,0,0},
+    {"qlease",rr_cmd_hqlease,4,"wm",0,NULL,1,1,1,0,0},
+    {"qack",rr_cmd_hqack,-3,"wF",0,NULL,1,1,1,0,0},
+    {"qtake",rr_cmd_hqtake,3,"wI",0,NULL,1,1,1,0,0},
+    {"qwait",rr_cmd_hqwait,-2,"rsI",0,NULL,1,-1,1,0,0},
     {"dset",rr_cmd_dset,4,"wm",0,NULL,1,1,1,0,0},
     {"dget",rr_cmd_dget,3,"rF",0,NULL,1,1,1,0,0},
     {"ddel",rr_cmd_ddel,3,"wF",0,NULL,1,1,1,0,0},
@@ -126,6 +154,7 @@ struct redisCommand redisCommandTable[] = {
     {"dlen",rr_cmd_dlen,2,"rF",0,NULL,1,1,1,0,0},
     /*  {"select"lectCommand,2,"rlF",0,NULL,0,0,0,0,0}, */
     {"type",rr_cmd_type,2,"rF",0,NULL,1,1,1,0,0},
+    {"scan",rr_cmd_scan,-2,"rR",0,NULL,0,0,0,0,0},
     {"ping",rr_cmd_admin_ping,-1,"rtF",0,NULL,0,0,0,0,0},
     {"echo",rr_cmd_admin_echo,2,"rF",0,NULL,0,0,0,0,0},
     {"shutdown",rr_cmd_admin_shutdown,-1,"arlt",0,NULL,0,0,0,0,0},
@@ -176,6 +205,7 @@ void populateCommandTable(void) {
             case 'M': c->flags |= CMD_SKIP_MONITOR; break;
             case 'k': c->flags |= CMD_ASKING; break;
             case 'F': c->flags |= CMD_FAST; break;
+            case 'I': c->flags |= CMD_INTERNAL; break;
             default:
                 rr_log(RR_LOG_ERROR, "Unsupported command flag");
                 exit(1);
@@ -201,27 +231,62 @@ static void create_pidfile(void) {
 }
 
 void rr_server_init(rr_configuration *cfg) {
-    int i;
-
     rr_log_set_log_level(cfg->log_level);
     rr_log_set_log_file(cfg->log_file);
 
+    if (cfg->reactors > 1 && cfg->io_threads > 1) {
+        rr_log(RR_LOG_CRITICAL, "io_threads and reactors can not be both above 1");
+        exit(1);
+    }
+
     server.shutdown = 0;
     server.pidfile = NULL;
     server.max_memory = cfg->max_memory;
     server.max_clients = cfg->max_clients;
     server.max_dbs = cfg->max_dbs;
     server.lazyfree_server_del = cfg->lazyfree_server_del;
+    server.heapq_dary_entries = cfg->heapq_dary_entries;
+    server.client_timeout = cfg->client_timeout;
+    server.reactors_num = cfg->reactors;
     rr_server_adjust_max_clients();
     server.hz = cfg->cron_frequency;
+    rr_server_signal();
+
+    server.commands = dict_create();
+    populateCommandTable();
+
+    createSharedObjects();
+    rr_stopwords_load();
+
+    rr_server_init_reactor(cfg, 0);
+
+    /* light up background task runners */
+    rr_bgt_init();
+    /* and the I/O threads, parked until there is enough work for them */
+    rr_iot_init(cfg->io_threads);
+    /* create pidfile if necessary */
+    if (cfg->pidfile[0] != '\0') {
+        server.pidfile = rr_strdup(cfg->pidfile);
+        create_pidfile();
+    }
+    /* and finally the other reactors, which start from the settings above */
+    rr_reactor_init(cfg);
+}
+
+/* Set up the state of a reactor: its event loop, listening sockets, clients
+ * and databases. Only the main reactor listens to the unix domain socket. */
+void rr_server_init_reactor(rr_configuration *cfg, int id) {
+    int i;
+
+    server.reactor_id = id;
     server.cronloops = 0;
     server.served = 0;
     server.rejected = 0;
     server.stats_memory_usage = 0;
-    rr_server_signal();
-    if ((server.el = el_loop_create(server.max_clients)) == NULL) goto error;
-    server.lpfd = rr_net_tcpserver(
-            server.err, cfg->port, cfg->bind, AF_INET, cfg->tcp_backlog);
+    server.unix_domain_sockfd = -1;
+    if ((server.el = el_loop_create(server.max_clients, cfg->event_backend)) == NULL) goto error;
+    server.lpfd = rr_net_tcpserver(server.err, cfg->port, cfg->bind, AF_INET,
+            cfg->tcp_backlog, server.reactors_num > 1);
     if (server.lpfd == RR_NET_ERR) goto error;
     if (rr_net_nonblock(server.err, server.lpfd) == RR_NET_ERR) goto error;
     if (el_event_add(server.el, server.lpfd, RR_EV_READ, handle_accept, NULL)
@@ -229,7 +294,7 @@ void rr_server_init(rr_configuration *cfg) {
         goto error;
 
     /* open the listening Unix domain socket. */
-    if (cfg->unix_domain_sock[0] != '\0') {
+    if (id == 0 && cfg->unix_domain_sock[0] != '\0') {
         unlink(cfg->unix_domain_sock);
         server.unix_socket_sock = rr_strdup(cfg->unix_domain_sock);
         server.unix_domain_sockfd = rr_net_unixserver(
@@ -243,35 +308,26 @@ void rr_server_init(rr_configuration *cfg) {
             goto error;
     }
 
-    if (el_timer_add(server.el, 1, server_cron, NULL) == RR_EV_ERR) {
+    if (el_timer_add(server.el, 1, server_cron, NULL) == NULL) {
         rr_log(RR_LOG_CRITICAL, "Can't create event loop timers.");
         exit(1);
     }
     el_loop_set_before_polling(server.el, before_polling);
+    el_loop_set_ref_procs(server.el, reply_ref_hold, reply_ref_release);
     server.client_max_query_len = PROTO_QUERY_MAX_LEN;
     server.clients = listCreate();
     server.clients_with_pending_writes = listCreate();
+    server.clients_pending_read = listCreate();
     server.clients_to_close = listCreate();
+    server.unblocked_clients = listCreate();
+    server.ready_keys = listCreate();
+    server.blocked_clients = 0;
 
     server.dbs = rr_malloc(sizeof(rrdb_t*)*server.max_dbs);
     for (i = 0; i < server.max_dbs; i++) {
         server.dbs[i] = rr_db_create(i);
     }
-
-    server.commands = dict_create();
     server.ncmd_complete = 0;
-    populateCommandTable();
-
-    createSharedObjects();
-    rr_stopwords_load();
-
-    /* light up background task runners */
-    rr_bgt_init();
-    /* create pidfile if necessary */
-    if (cfg->pidfile[0] != '\0') {
-        server.pidfile = rr_strdup(cfg->pidfile);
-        create_pidfile();
-    }
     return;
 error:
     rr_log(RR_LOG_CRITICAL, server.err);
@@ -290,8 +346,18 @@ sds rr_server_get_info(void) {
         "current_clients:%lu\r\n"
         "clients_served:%lu\r\n"
         "clients_rejected:%lu\r\n"
+        "blocked_clients:%u\r\n"
+        "io_threads:%d\r\n"
+        "io_threads_active:%d\r\n"
+        "reactor:%d\r\n"
+        "reactors:%d\r\n"
+        "event_backend:%s\r\n"
+        "monotonic_clock:%s\r\n"
         "\r\n",
-        listLength(server.clients), server.served, server.rejected);
+        listLength(server.clients), server.served, server.rejected,
+        server.blocked_clients, server.io_threads_num,
+        server.io_threads_active, server.reactor_id, server.reactors_num,
+        el_loop_backend(server.el), rr_dt_monotonic_clock());
 
     bytesToHuman(used_mem_human, used_mem);
     bytesToHuman(system_mem_human, system_mem);
@@ -421,7 +487,30 @@ void rr_server_adjust_max_clients(void) {
 }
 
 #define CLIENTS_CRON_MIN_ITERATIONS 5
+/* Close the clients idle for longer than the client timeout. Every call goes
+ * through a share of the clients, so that all of them are checked about once
+ * per second. */
 static void client_cron(void) {
+    int iterations = listLength(server.clients)/server.hz;
+    mstime_t now = el_loop_now(server.el);
+
+    if (!server.client_timeout) return;
+    if (iterations < CLIENTS_CRON_MIN_ITERATIONS)
+        iterations = CLIENTS_CRON_MIN_ITERATIONS;
+
+    while (listLength(server.clients) && iterations--) {
+        rr_client_t *c;
+
+        /* Rotate the list, take the current head, process. This way the
+         * client can be freed without breaking the iteration. */
+        listRotate(server.clients);
+        c = listNodeValue(listFirst(server.clients));
+        if (c->flags & (CLIENT_BLOCKED|CLIENT_CLOSE_ASAP)) continue;
+        if (now - c->last_interaction > (mstime_t) server.client_timeout*1000) {
+            rr_log(RR_LOG_INFO, "Closing idle client");
+            rr_client_free(c);
+        }
+    }
 }
 
 static int server_cron(eventloop_t *el, void *ud) {
@@ -439,6 +528,8 @@ static int server_cron(eventloop_t *el, void *ud) {
 
     client_cron();
 
+    rr_cmd_hqlease_cron();
+
     server.stats_memory_usage = rr_get_used_memory();
 
     server.cronloops++;
@@ -461,17 +552,94 @@ static void free_client_async(rr_client_t *c) {
     listAddNodeTail(server.clients_to_close,c);
 }
 
+/* Read the clients in parallel with the I/O threads, then execute the parsed
+ * commands in the main thread */
+static int handle_clients_with_pending_reads(void) {
+    int processed = listLength(server.clients_pending_read);
+
+    if (!server.io_threads_active || processed == 0) return 0;
+
+    rr_iot_run(server.clients_pending_read, IO_THREADS_OP_READ);
+
+    /* Commands may free other clients of the list, so don't keep an iterator */
+    while (listLength(server.clients_pending_read)) {
+        listNode *ln = listFirst(server.clients_pending_read);
+        rr_client_t *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_READ;
+        listDelNode(server.clients_pending_read, ln);
+
+        if (c->flags & CLIENT_IO_ERROR) {
+            rr_client_free(c);
+            continue;
+        }
+        rr_client_process_input(c);
+    }
+    return processed;
+}
+
+/* Whether the pending writes are worth the I/O threads, which are parked as
+ * long as there are too few clients to keep them busy */
+static bool io_threads_worth(void) {
+    if (server.io_threads_num == 1) return false;
+    if (listLength(server.clients_with_pending_writes) < (unsigned long) server.io_threads_num * 2) {
+        /* Only park them once the pending reads have been handled */
+        if (listLength(server.clients_pending_read) == 0) rr_iot_stop();
+        return false;
+    }
+    rr_iot_start();
+    return true;
+}
+
+static int handle_clients_with_pending_writes_threaded(void) {
+    listIter li;
+    listNode *ln;
+    int processed = listLength(server.clients_with_pending_writes);
+
+    listRewind(server.clients_with_pending_writes, &li);
+    while ((ln = listNext(&li))) {
+        rr_client_t *c = listNodeValue(ln);
+        c->flags &= ~CLIENT_PENDING_WRITE;
+    }
+    rr_iot_run(server.clients_with_pending_writes, IO_THREADS_OP_WRITE);
+
+    while (listLength(server.clients_with_pending_writes)) {
+        ln = listFirst(server.clients_with_pending_writes);
+        rr_client_t *c = listNodeValue(ln);
+        listDelNode(server.clients_with_pending_writes, ln);
+
+        if (c->flags & CLIENT_IO_ERROR) {
+            rr_log(RR_LOG_ERROR, "Error writing to client");
+            rr_client_free(c);
+        } else if (client_has_pending_replies(c)) {
+            if (el_event_add(server.el, c->fd, RR_EV_WRITE, reply_write_callback, c)
+                == RR_EV_ERR)
+                free_client_async(c);
+        } else if (c->flags & CLIENT_CLOSE_AFTER_REPLY) {
+            rr_client_free(c);
+        }
+    }
+    return processed;
+}
+
 static int handle_clients_with_pending_writes() {
     listIter li;
     listNode *ln;
     int processed = listLength(server.clients_with_pending_writes);
 
+    if (io_threads_worth()) return handle_clients_with_pending_writes_threaded();
+
     listRewind(server.clients_with_pending_writes, &li);
     while((ln = listNext(&li))) {
         rr_client_t *c = listNodeValue(ln);
         c->flags &= ~CLIENT_PENDING_WRITE;
         listDelNode(server.clients_with_pending_writes, ln);
 
+        /* The client ran a command of another reactor, which gets the reply */
+        if (c->call) {
+            rr_reactor_call_reply(c);
+            continue;
+        }
+
         /* Try to write buffers to the client socket. */
         if (reply_write_to_client(c->fd, c, 0) == RR_ERROR) continue;
 
@@ -488,49 +656,57 @@ static int handle_clients_with_pending_writes() {
 
 static void before_polling(eventloop_t *el) {
     UNUSED(el);
+    handle_clients_with_pending_reads();
+    rr_blocking_process_unblocked();
     handle_clients_with_pending_writes();
 }
 
+/* Make room for argc arguments in c->argv, which is kept from one command
+ * to the other */
+static void client_argv_alloc(rr_client_t *c, int argc) {
+    if (argc <= c->argv_size) return;
+    rr_free(c->argv);
+    c->argv = rr_malloc(sizeof(robj*)*argc);
+    c->argv_size = argc;
+}
+
 static int process_inline_input(rr_client_t *c) {
-    char *newline;
+    char *query = c->query+c->qpos, *newline;
+    size_t qlen = sdslen(c->query)-c->qpos, querylen, linefeed_chars = 1;
     int i, argc;
     sds *argv, aux;
-    size_t querylen;
 
     /* Search for end of line */
-    newline = strchr(c->query, '\n');
+    newline = memchr(query, '\n', qlen);
 
     /* Nothing to do without a \r\n */
     if (newline == NULL) {
-        if (sdslen(c->query) > PROTO_INLINE_MAX_LEN) {
-            reply_add_err(c, "Protocol error: too big inline request");
-        }
+        if (qlen > PROTO_INLINE_MAX_LEN)
+            set_protocol_error(c, sdsnew("Protocol error: too big inline request"));
         return RR_ERROR;
     }
 
     /* Handle the \r\n case. */
-    if (newline && newline != c->query && *(newline-1) == '\r')
+    if (newline != query && *(newline-1) == '\r') {
         newline--;
+        linefeed_chars++;
+    }
 
     /* Split the input buffer up to the \r\n */
-    querylen = newline - c->query;
-    aux = sdsnewlen(c->query, querylen);
+    querylen = newline - query;
+    aux = sdsnewlen(query, querylen);
     argv = sdssplitargs(aux, &argc);
     sdsfree(aux);
 
     if (argv == NULL) {
-        reply_add_err(c, "Protocol error: unbalanced quotes in request");
-        set_protocol_error(c, 0);
+        set_protocol_error(c, sdsnew("Protocol error: unbalanced quotes in request"));
         return RR_ERROR;
     }
 
-    /* Slice the query buffer to delete the processed line */
-    sdsrange(c->query, querylen+2, -1);
+    /* Skip the processed line */
+    c->qpos += querylen+linefeed_chars;
 
-    if (argc) {
-        if (c->argv) rr_free(c->argv);
-        c->argv = rr_malloc(sizeof(robj*)*argc);
-    }
+    if (argc) client_argv_alloc(c, argc);
 
     /* Create redis objects for all arguments. */
     for (c->argc = 0, i = 0; i < argc; i++) {
@@ -545,16 +721,31 @@ static int process_inline_input(rr_client_t *c) {
     return RR_OK;
 }
 
-/* Trims the query buffer to make the function that processes
- * multi bulk requests idempotent */
-static void set_protocol_error(rr_client_t *c, int pos) {
+/* Stops parsing the input of the client. The error is replied once the
+ * commands before it are executed, and the client is closed then. */
+static void set_protocol_error(rr_client_t *c, sds err) {
+    c->proto_err = err;
+}
+
+static void reply_protocol_error(rr_client_t *c) {
+    reply_add_err_len(c, c->proto_err, sdslen(c->proto_err));
+    sdsfree(c->proto_err);
+    c->proto_err = NULL;
     c->flags |= CLIENT_CLOSE_AFTER_REPLY;
-    sdsrange(c->query, pos, -1);
+}
+
+/* Drop the parsed commands from the query buffer. The parsers only move
+ * c->qpos forward, so the rest of the buffer is moved once per read rather
+ * than after every command. */
+static void client_trim_query(rr_client_t *c) {
+    if (c->qpos == 0) return;
+    sdsrange(c->query, c->qpos, -1);
+    c->qpos = 0;
 }
 
 static int process_multi_bulk_input(rr_client_t *c) {
     char *newline = NULL;
-    int pos = 0, ok;
+    int ok;
     long long ll;
 
     if (c->multibulk_len == 0) {
@@ -562,102 +753,89 @@ static int process_multi_bulk_input(rr_client_t *c) {
         assert(c->argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->query, '\r');
+        newline = memchr(c->query+c->qpos, '\r', sdslen(c->query)-c->qpos);
         if (newline == NULL) {
-            if (sdslen(c->query) > PROTO_INLINE_MAX_LEN) {
-                reply_add_err(c, "Protocol error: too big mbulk count string");
-                set_protocol_error(c, 0);
+            if (sdslen(c->query)-c->qpos > PROTO_INLINE_MAX_LEN) {
+                set_protocol_error(c, sdsnew("Protocol error: too big mbulk count string"));
             }
             return RR_ERROR;
         }
 
         /* Buffer should also contain \n */
-        if (newline-(c->query) > ((signed)sdslen(c->query)-2))
+        if (newline+1 >= c->query+sdslen(c->query))
             return RR_ERROR;
 
         /* We know for sure there is a whole line since newline != NULL,
          * so go ahead and find out the multi bulk length. */
-        ok = string2ll(c->query+1, newline-(c->query+1), &ll);
+        ok = string2ll(c->query+c->qpos+1, newline-(c->query+c->qpos+1), &ll);
         if (!ok || ll > 1024*1024) {
-            reply_add_err(c, "Protocol error: invalid multibulk length");
-            set_protocol_error(c, pos);
+            set_protocol_error(c, sdsnew("Protocol error: invalid multibulk length"));
             return RR_ERROR;
         }
 
-        pos = (newline-c->query) + 2;
-        if (ll <= 0) {
-            sdsrange(c->query,pos,-1);
-            return RR_OK;
-        }
+        c->qpos = (newline-c->query) + 2;
+        if (ll <= 0) return RR_OK;
 
         c->multibulk_len = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) rr_free(c->argv);
-        c->argv = rr_malloc(sizeof(robj*)*c->multibulk_len);
+        client_argv_alloc(c, c->multibulk_len);
     }
 
     assert(c->multibulk_len > 0);
     while(c->multibulk_len) {
         /* Read bulk length if unknown */
         if (c->bulk_len == -1) {
-            newline = strchr(c->query+pos, '\r');
+            newline = memchr(c->query+c->qpos, '\r', sdslen(c->query)-c->qpos);
             if (newline == NULL) {
-                if (sdslen(c->query) > PROTO_INLINE_MAX_LEN) {
-                    reply_add_err(c,
-                        "Protocol error: too big bulk count string");
-                    set_protocol_error(c,0);
+                if (sdslen(c->query)-c->qpos > PROTO_INLINE_MAX_LEN) {
+                    set_protocol_error(c,
+                        sdsnew("Protocol error: too big bulk count string"));
                     return RR_ERROR;
                 }
                 break;
             }
 
             /* Buffer should also contain \n */
-            if (newline-(c->query) > ((signed)sdslen(c->query)-2))
+            if (newline+1 >= c->query+sdslen(c->query))
                 break;
 
-            if (c->query[pos] != '$') {
-                reply_add_err_format(c,
-                    "Protocol error: expected '$', got '%c'", c->query[pos]);
-                set_protocol_error(c, pos);
+            if (c->query[c->qpos] != '$') {
+                set_protocol_error(c, sdscatprintf(sdsempty(),
+                    "Protocol error: expected '$', got '%c'", c->query[c->qpos]));
                 return RR_ERROR;
             }
 
-            ok = string2ll(c->query+pos+1, newline-(c->query+pos+1), &ll);
+            ok = string2ll(c->query+c->qpos+1, newline-(c->query+c->qpos+1), &ll);
             if (!ok || ll < 0 || ll > 512*1024*1024) {
-                reply_add_err(c, "Protocol error: invalid bulk length");
-                set_protocol_error(c,pos);
+                set_protocol_error(c, sdsnew("Protocol error: invalid bulk length"));
                 return RR_ERROR;
             }
 
-            pos += newline-(c->query+pos)+2;
-            if (ll >= PROTO_MBULK_BIG_ARG) {
-                size_t qblen;
-
+            c->qpos = (newline-c->query) + 2;
+            if (ll >= PROTO_MBULK_BIG_ARG &&
+                sdslen(c->query)-c->qpos < (size_t)ll+2) {
                 /* If we are going to read a large object from network
                  * try to make it likely that it will start at c->query
                  * boundary so that we can optimize object creation
                  * avoiding a large copy of data. */
-                sdsrange(c->query, pos, -1);
-                pos = 0;
-                qblen = sdslen(c->query);
+                client_trim_query(c);
                 /* Hint the sds library about the amount of bytes this string is
                  * going to contain. */
-                if (qblen < (size_t)ll+2)
-                    c->query = sdsMakeRoomFor(c->query, ll+2-qblen);
+                c->query = sdsMakeRoomFor(c->query, ll+2-sdslen(c->query));
             }
             c->bulk_len = ll;
         }
 
         /* Read bulk argument */
-        if (sdslen(c->query)-pos < (unsigned)(c->bulk_len+2)) {
+        if (sdslen(c->query)-c->qpos < (size_t)(c->bulk_len+2)) {
             /* Not enough data (+2 == trailing \r\n) */
             break;
         } else {
             /* Optimization: if the buffer contains JUST our bulk element
              * instead of creating a new object by *copying* the sds we
              * just use the current sds string. */
-            if (pos == 0 &&
+            if (c->qpos == 0 &&
                 c->bulk_len >= PROTO_MBULK_BIG_ARG &&
                 (signed) sdslen(c->query) == c->bulk_len+2)
             {
@@ -667,20 +845,16 @@ static int process_multi_bulk_input(rr_client_t *c) {
                 /* Assume that if we saw a fat argument we'll see another one
                  * likely... */
                 c->query = sdsMakeRoomFor(c->query, c->bulk_len+2);
-                pos = 0;
             } else {
-                c->argv[c->argc++] =
-                    createStringObject(c->query+pos, c->bulk_len);
-                pos += c->bulk_len+2;
+                c->argv[c->argc++] = createStringObjectFromPool(&c->argv_pool,
+                    c->query+c->qpos, c->bulk_len);
+                c->qpos += c->bulk_len+2;
             }
             c->bulk_len = -1;
             c->multibulk_len--;
         }
     }
 
-    /* Trim to pos */
-    if (pos) sdsrange(c->query, pos, -1);
-
     /* We're done when c->multibulk == 0 */
     if (c->multibulk_len == 0) return RR_OK;
 
@@ -688,40 +862,166 @@ static int process_multi_bulk_input(rr_client_t *c) {
     return RR_ERROR;
 }
 
-static void process_user_input(rr_client_t *c) {
-    while (sdslen(c->query)) {
+/* Parse the next command from the query buffer into argc/argv, returns
+ * RR_ERROR if the command is not complete yet, or after a protocol error. */
+static int client_parse_command(rr_client_t *c) {
+    if (c->proto_err) return RR_ERROR;
+
+    /* Determine request type when unknown. */
+    if (!c->req_type) {
+        if (c->query[c->qpos] == '*') {
+            c->req_type = PROTO_REQ_MULTIBULK;
+        } else {
+            c->req_type = PROTO_REQ_INLINE;
+        }
+    }
+
+    if (c->req_type == PROTO_REQ_INLINE) {
+        return process_inline_input(c);
+    } else if (c->req_type == PROTO_REQ_MULTIBULK) {
+        return process_multi_bulk_input(c);
+    } else {
+        rr_log(RR_LOG_WARNING, "Unknown request type");
+        assert(0);
+    }
+    return RR_ERROR;
+}
+
+/* Swap the arguments of the client with the ones of the slot */
+static void parsed_cmd_swap(rr_client_t *c, parsed_cmd_t *cmd) {
+    parsed_cmd_t tmp = *cmd;
+
+    cmd->argc = c->argc;
+    cmd->argv_size = c->argv_size;
+    cmd->argv = c->argv;
+    c->argc = tmp.argc;
+    c->argv_size = tmp.argv_size;
+    c->argv = tmp.argv;
+}
+
+/* Move the command just parsed to the batch, the client getting the spare
+ * argv of the slot to parse the next one */
+static void cmd_batch_push(rr_client_t *c) {
+    cmd_batch_t *b = &c->batch;
+
+    if (c->argc == 0) {
+        rr_client_reset(c);
+        return;
+    }
+    if (b->len == b->size) {
+        b->size = b->size ? b->size*2 : 16;
+        b->cmds = rr_realloc(b->cmds, sizeof(parsed_cmd_t)*b->size);
+        memset(b->cmds+b->len, 0, sizeof(parsed_cmd_t)*(b->size-b->len));
+    }
+    parsed_cmd_swap(c, &b->cmds[b->len++]);
+    c->argc = 0;
+    c->req_type = 0;
+    c->multibulk_len = 0;
+    c->bulk_len = -1;
+}
+
+/* Make the next command of the batch the current one, the slot keeping the
+ * argv of the client as a spare */
+static void cmd_batch_pop(rr_client_t *c) {
+    cmd_batch_t *b = &c->batch;
+
+    parsed_cmd_swap(c, &b->cmds[b->pos]);
+    b->cmds[b->pos].argc = 0;
+    if (++b->pos == b->len) b->pos = b->len = 0;
+}
+
+/* Give the command parsed partly after the batch back to the parser */
+static void cmd_batch_resume(rr_client_t *c) {
+    cmd_batch_t *b = &c->batch;
+
+    parsed_cmd_swap(c, &b->rest);
+    c->req_type = PROTO_REQ_MULTIBULK;
+    c->multibulk_len = b->rest_multibulk_len;
+    c->bulk_len = b->rest_bulk_len;
+    b->rest_multibulk_len = 0;
+}
+
+/* Parse the complete commands of the query buffer, for the client to execute
+ * them back-to-back. A protocol error stops the parsing, it's replied after
+ * the commands before it. */
+static void cmd_batch_fill(rr_client_t *c) {
+    cmd_batch_t *b = &c->batch;
+
+    if (c->flags & (CLIENT_BLOCKED|CLIENT_CLOSE_AFTER_REPLY) || b->len) return;
+    if (b->rest_multibulk_len) cmd_batch_resume(c);
+    while (b->len < PROTO_BATCH_MAX_LEN && c->qpos < sdslen(c->query) &&
+           client_parse_command(c) == RR_OK)
+        cmd_batch_push(c);
+
+    /* The current argv is the one of the commands of the batch once they run,
+     * the command parsed partly waits aside */
+    if (b->len && c->multibulk_len) {
+        parsed_cmd_swap(c, &b->rest);
+        b->rest_multibulk_len = c->multibulk_len;
+        b->rest_bulk_len = c->bulk_len;
+        c->argc = 0;
+        c->req_type = 0;
+        c->multibulk_len = 0;
+        c->bulk_len = -1;
+    }
+}
+
+static void cmd_batch_free(rr_client_t *c) {
+    cmd_batch_t *b = &c->batch;
+    int i, j;
+
+    for (i = b->pos; i < b->len; i++) {
+        for (j = 0; j < b->cmds[i].argc; j++)
+            decrRefCount(b->cmds[i].argv[j]);
+    }
+    for (i = 0; i < b->size; i++)
+        rr_free(b->cmds[i].argv);
+    rr_free(b->cmds);
+    for (j = 0; j < b->rest.argc; j++)
+        decrRefCount(b->rest.argv[j]);
+    rr_free(b->rest.argv);
+}
+
+void rr_client_process_input(rr_client_t *c) {
+    while (c->qpos < sdslen(c->query) || (c->flags & CLIENT_PENDING_COMMAND) ||
+           c->batch.len || c->proto_err) {
+        /* Keep the input of blocked clients until they are unblocked */
+        if (c->flags & CLIENT_BLOCKED) break;
+
         /* CLIENT_CLOSE_AFTER_REPLY closes the connection once the reply is
          * written to the client. Make sure not let the reply grow after
          * this flag has been set (i.e. don't process more commands). */
         if (c->flags & CLIENT_CLOSE_AFTER_REPLY) break;
 
-        /* Determine request type when unknown. */
-        if (!c->req_type) {
-            if (c->query[0] == '*') {
-                c->req_type = PROTO_REQ_MULTIBULK;
-            } else {
-                c->req_type = PROTO_REQ_INLINE;
-            }
-        }
-
-        if (c->req_type == PROTO_REQ_INLINE) {
-            if (process_inline_input(c) != RR_OK) break;
-        } else if (c->req_type == PROTO_REQ_MULTIBULK) {
-            if (process_multi_bulk_input(c) != RR_OK) break;
+        /* The command may come from another reactor, or may have been
+         * parsed ahead by an I/O thread. The main thread parses one command
+         * at a time, which keeps the arguments in the cache and the object
+         * pool until they run. */
+        if (c->flags & CLIENT_PENDING_COMMAND) {
+            c->flags &= ~CLIENT_PENDING_COMMAND;
+        } else if (c->batch.len) {
+            cmd_batch_pop(c);
         } else {
-            rr_log(RR_LOG_WARNING, "Unknown request type");
-            assert(0);
+            if (c->batch.rest_multibulk_len) cmd_batch_resume(c);
+            if (client_parse_command(c) != RR_OK) {
+                if (c->proto_err) reply_protocol_error(c);
+                break;
+            }
         }
 
         /* Multibulk processing could see a <= 0 length. */
         if (c->argc == 0) {
             rr_client_reset(c);
+        } else if (server.reactors_num > 1 && !c->call && rr_reactor_dispatch(c)) {
+            /* Other reactors run the command, the client waits for them */
+            rr_client_reset(c);
         } else {
             /* Only reset the client when the command was executed. */
             if (cmd_process(c) == RR_OK)
                 rr_client_reset(c);
         }
     }
+    client_trim_query(c);
 }
 
 /* If this function gets called we already read a whole
@@ -746,7 +1046,7 @@ static int cmd_process(rr_client_t *c) {
     /* Now lookup the command and check ASAP about trivial error conditions
      * such as wrong arity, bad command name and so forth. */
     c->cmd = c->lastcmd = cmd_lookup(c->argv[0]->ptr);
-    if (!c->cmd) {
+    if (!c->cmd || ((c->cmd->flags & CMD_INTERNAL) && !c->call)) {
         reply_add_err_format(c, "unknown command '%s'",
             (char*) c->argv[0]->ptr);
         return RR_OK;
@@ -757,7 +1057,9 @@ static int cmd_process(rr_client_t *c) {
         return RR_OK;
     }
 
-    call(c, CMD_CALL_FULL);
+    /* The command table, and so the stats, are shared by the reactors */
+    call(c, server.reactors_num > 1 ? CMD_CALL_FULL & ~CMD_CALL_STATS : CMD_CALL_FULL);
+    if (listLength(server.ready_keys)) rr_blocking_serve_ready_keys();
     return RR_OK;
 }
 
@@ -802,9 +1104,9 @@ static void call(rr_client_t *c, int flags) {
     long long start, duration;
 
     /* Call the command. */
-    start = rr_dt_ustime();
+    start = rr_dt_monotonic_us();
     c->cmd->proc(c);
-    duration = rr_dt_ustime() - start;
+    duration = rr_dt_monotonic_us() - start;
     if (flags & CMD_CALL_STATS) {
         c->lastcmd->microseconds += duration;
         c->lastcmd->calls++;
@@ -821,13 +1123,12 @@ void rr_client_reset(rr_client_t *c) {
     free_client_argv(c);
 }
 
-static void handle_read_from_client(eventloop_t *el, int fd, void *ud, int mask) {
-   rr_client_t *c = (rr_client_t *) ud;
-
+/* Read from the client socket into the query buffer. Returns RR_ERROR if the
+ * client has to be freed, which is up to the caller. It touches nothing but
+ * the client, so that the I/O threads can call it. */
+static int rr_client_read_query(rr_client_t *c) {
     int nread, readlen;
     int qlen;
-    UNUSED(el);
-    UNUSED(mask);
 
     readlen = PROTO_IOBUF_LEN;
     /* If this is a multi bulk request, and we are processing a bulk reply
@@ -839,45 +1140,94 @@ static void handle_read_from_client(eventloop_t *el, int fd, void *ud, int mask)
     if (c->req_type == PROTO_REQ_MULTIBULK && c->multibulk_len && c->bulk_len != -1
         && c->bulk_len >= PROTO_MBULK_BIG_ARG)
     {
-        int remaining = (unsigned)(c->bulk_len+2) - sdslen(c->query);
+        int remaining = (unsigned)(c->bulk_len+2) - (sdslen(c->query)-c->qpos);
 
         if (remaining < readlen) readlen = remaining;
     }
 
     qlen = sdslen(c->query);
     c->query = sdsMakeRoomFor(c->query, readlen);
-    nread = read(fd, c->query+qlen, readlen);
+    nread = el_read(server.el, c->fd, c->query+qlen, readlen);
     if (nread == -1) {
         if (errno == EAGAIN) {
-            return;
+            return RR_OK;
         } else {
             rr_log(RR_LOG_ERROR, "Reading from client: %s", strerror(errno));
-            rr_client_free(c);
-            return;
+            return RR_ERROR;
         }
     } else if (nread == 0) {
         rr_log(RR_LOG_INFO, "Client closed connection");
-        rr_client_free(c);
-        return;
+        return RR_ERROR;
     }
     sdsIncrLen(c->query, nread);
 
+    /* A deep pipeline fills the reads, go on until the socket is drained so
+     * that the whole pipeline is executed and replied at once. The parsers
+     * only move the input once done, so a longer query costs nothing more.
+     * Errors and the end of the stream are left to the next read. */
+    while (nread == PROTO_IOBUF_LEN && sdslen(c->query)-c->qpos < PROTO_READ_MAX_LEN) {
+        qlen = sdslen(c->query);
+        c->query = sdsMakeRoomFor(c->query, PROTO_IOBUF_LEN);
+        nread = el_read(server.el, c->fd, c->query+qlen, PROTO_IOBUF_LEN);
+        if (nread <= 0) break;
+        sdsIncrLen(c->query, nread);
+    }
+
     if (sdslen(c->query) > server.client_max_query_len) {
         rr_log(RR_LOG_WARNING, "Closing client that reached max query buffer length.");
-        rr_client_free(c);
+        return RR_ERROR;
+    }
+    return RR_OK;
+}
+
+/* Read and parse the commands of the client from an I/O thread, the main
+ * thread executes them back-to-back */
+void rr_client_io_read(rr_client_t *c) {
+    if (rr_client_read_query(c) != RR_OK) {
+        c->flags |= CLIENT_IO_ERROR;
         return;
     }
+    cmd_batch_fill(c);
+}
+
+static void handle_read_from_client(eventloop_t *el, int fd, void *ud, int mask) {
+    rr_client_t *c = (rr_client_t *) ud;
+    UNUSED(fd);
+    UNUSED(mask);
 
-    process_user_input(c);
+    c->last_interaction = el_loop_now(el);
+    /* Leave the read to the I/O threads, right before polling again */
+    if (server.io_threads_active) {
+        if (!(c->flags & CLIENT_PENDING_READ)) {
+            c->flags |= CLIENT_PENDING_READ;
+            listAddNodeHead(server.clients_pending_read, c);
+        }
+        return;
+    }
+
+    if (rr_client_read_query(c) != RR_OK) {
+        rr_client_free(c);
+        return;
+    }
+    rr_client_process_input(c);
 }
 
 /* Client.reply list dup and free methods */
 static void *list_reply_dup(void *val) {
-    return sdsdup(val);
+    return val ? dupStringObject(val) : NULL;
 }
 
 static void list_reply_free(void *val) {
-    sdsfree(val);
+    if (val) decrRefCount(val);
+}
+
+/* References to the reply objects the loop sends from where they are */
+static void reply_ref_hold(void *val) {
+    incrRefCount(val);
+}
+
+static void reply_ref_release(void *val) {
+    decrRefCount(val);
 }
 
 rr_client_t *rr_client_create(int fd) {
@@ -891,8 +1241,9 @@ rr_client_t *rr_client_create(int fd) {
         rr_net_nonblock(server.err, fd);
         rr_net_nodelay(server.err, fd);
         rr_net_keepalive(server.err, fd);
-        if (el_event_add(server.el, fd, RR_EV_READ, handle_read_from_client, c) == RR_EV_ERR) {
-            close(fd);
+        if (el_stream_open(server.el, fd) == RR_EV_ERR ||
+            el_event_add(server.el, fd, RR_EV_READ, handle_read_from_client, c) == RR_EV_ERR) {
+            el_close(server.el, fd);
             rr_free(c);
             return NULL;
         }
@@ -903,13 +1254,27 @@ rr_client_t *rr_client_create(int fd) {
     c->multibulk_len = 0;
     c->bulk_len = -1;
     c->query = sdsempty();
+    c->qpos = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_size = 0;
+    memset(&c->argv_pool, 0, sizeof(c->argv_pool));
     c->cmd = c->lastcmd = NULL;
     c->db = *server.dbs;  /* use db 0 by default */
     c->replied_len = 0;
     c->buf_sent_len = 0;
     c->buf_offset = 0;
+    c->buf_size = 0;
+    c->buf = NULL;
+    c->last_interaction = el_loop_now(server.el);
+    c->bpop.keys = NULL;
+    c->bpop.numkeys = 0;
+    c->bpop.timeout = NULL;
+    c->bpop.merge = NULL;
+    c->bpop.job = NULL;
+    memset(&c->batch, 0, sizeof(c->batch));
+    c->proto_err = NULL;
+    c->call = NULL;
     c->reply = listCreate();
     listSetFreeMethod(c->reply, list_reply_free);
     listSetDupMethod(c->reply, list_reply_dup);
@@ -928,7 +1293,7 @@ static void unlink_client(rr_client_t *c) {
 
         el_event_del(server.el, c->fd, RR_EV_READ);
         el_event_del(server.el, c->fd, RR_EV_WRITE);
-        close(c->fd);
+        el_close(server.el, c->fd);
         c->fd = -1;
     }
 }
@@ -936,16 +1301,44 @@ static void unlink_client(rr_client_t *c) {
 static void free_client_argv(rr_client_t *c) {
     int i;
     for (i = 0; i < c->argc; i++)
-        decrRefCount(c->argv[i]);
+        releaseObjectToPool(&c->argv_pool, c->argv[i]);
     c->argc = 0;
     c->cmd = NULL;
+    if (c->argv_size > PROTO_ARGV_KEPT_LEN) {
+        rr_free(c->argv);
+        c->argv = NULL;
+        c->argv_size = 0;
+    }
 }
 
 void rr_client_free(rr_client_t *c) {
+    listNode *ln;
+
+    if (c->flags & CLIENT_BLOCKED) rr_client_unblock(c);
+    if (c->flags & CLIENT_UNBLOCKED) {
+        ln = listSearchKey(server.unblocked_clients, c);
+        assert(ln != NULL);
+        listDelNode(server.unblocked_clients, ln);
+    }
+    if (c->flags & CLIENT_PENDING_READ) {
+        ln = listSearchKey(server.clients_pending_read, c);
+        assert(ln != NULL);
+        listDelNode(server.clients_pending_read, ln);
+    }
+    if (c->flags & CLIENT_PENDING_WRITE) {
+        ln = listSearchKey(server.clients_with_pending_writes, c);
+        assert(ln != NULL);
+        listDelNode(server.clients_with_pending_writes, ln);
+    }
     unlink_client(c);
     sdsfree(c->query);
     listRelease(c->reply);
     free_client_argv(c);
+    rr_free(c->argv);
+    emptyObjectPool(&c->argv_pool);
+    cmd_batch_free(c);
+    sdsfree(c->proto_err);
+    rr_free(c->buf);
     rr_free(c);
 }
 
@@ -965,10 +1358,12 @@ static void add_client(int fd, int flags, char *ip) {
      * for this condition, since now the socket is already set in non-blocking
      * mode and we can send an error for free using the Kernel I/O */
     if (listLength(server.clients) > server.max_clients) {
-        char *err = "-ERR max number of clients reached\r\n";
+        struct iovec err;
 
+        err.iov_base = "-ERR max number of clients reached\r\n";
+        err.iov_len = strlen(err.iov_base);
         /* That's a best effort error message, don't check write errors */
-        if (write(c->fd, err, strlen(err)) == -1) {
+        if (el_writev(server.el, c->fd, &err, 1) == -1) {
             /* Nothing to do, Just to avoid the warning... */
         }
         server.rejected++;
@@ -1098,6 +1493,7 @@ int main(int argc, char *argv[]) {
         exit(1);
     }
     dict_free(options);
+    rr_dt_monotonic_init();
     rr_server_init(&cfg);
     el_main(server.el);
     rr_server_close();
@@ -7,15 +7,20 @@
 #include "sds.h"
 #include "robj.h"
 #include "rr_db.h"
+#include "rr_datetime.h"
 
 #include <stddef.h>
 #include <stdbool.h>
 
 #define PROTO_REPLY_MAX_LEN (16*1024)  /* max length of a reply buffer */
+#define PROTO_REPLY_BUF_MAX_LEN (1024*1024) /* max size of the growing output buffer */
 #define PROTO_QUERY_MAX_LEN (512*1024*1024) /* max length of the query string */
 #define PROTO_IOBUF_LEN (16*1024) /* default read buffer length */
+#define PROTO_READ_MAX_LEN (64*1024) /* max unparsed input drained from the socket */
 #define PROTO_INLINE_MAX_LEN (1024*64) /* max length of inline reads */
 #define PROTO_MBULK_BIG_ARG (1024*32)  /* threshold of a big argument in multi bulk request */
+#define PROTO_BATCH_MAX_LEN 1024       /* max commands parsed ahead by an I/O thread */
+#define PROTO_ARGV_KEPT_LEN 64         /* max argv size kept for the next command */
 
 #define PROTO_REQ_MULTIBULK 1          /* multibulk user request */
 #define PROTO_REQ_INLINE 2             /* inline user request */
@@ -28,6 +33,12 @@
                                        handler is yet not installed. */
 #define CLIENT_CLOSE_AFTER_REPLY (1<<2) /* close once complete the entire reply */
 #define CLIENT_CLOSE_ASAP (1<<3)        /* close client ASAP */
+#define CLIENT_BLOCKED (1<<4)           /* client is in a blocking operation */
+#define CLIENT_PENDING_READ (1<<5)      /* client is waiting for an I/O thread to read */
+#define CLIENT_PENDING_COMMAND (1<<6)   /* argv holds a command to execute */
+#define CLIENT_UNBLOCKED (1<<7)         /* client was unblocked and is in
+                                           server.unblocked_clients */
+#define CLIENT_IO_ERROR (1<<8)          /* an I/O thread failed reading or writing */
 #define CLIENT_UNIX_SOCKET (1<<11)      /* client connected via Unix domain socket */
 
 #define NET_MAX_WRITES_PER_EVENT (1024*64) /* Max reply size for each EVENT */
@@ -56,32 +67,82 @@ struct rr_server_t {
     size_t stats_memory_usage;         /* current memory usage */
     rrdb_t **dbs;                      /* db array */
     int max_dbs;                       /* max number of databases */
+    unsigned long heapq_dary_entries;  /* heapq switches to the d-ary layout above this length */
+    int client_timeout;                /* seconds before closing idle clients, 0 for never */
     dict_t *commands;                  /* all commands */
     long long ncmd_complete;           /* number of command executed */
     list *clients;                     /* list of clients */
     list *clients_with_pending_writes; /* list of clients with pending writes */
+    list *clients_pending_read;        /* clients to read by the I/O threads */
     list *clients_to_close;            /* list of closable clients */
+    list *unblocked_clients;           /* clients to process after being unblocked */
+    list *ready_keys;                  /* keys with blocked clients to serve */
+    unsigned int blocked_clients;      /* number of clients in blocking operations */
+    int io_threads_num;                /* number of I/O threads, the main one included */
+    bool io_threads_active;            /* whether the I/O threads are running */
+    int io_threads_op;                 /* what the I/O threads are doing right now */
+    int reactor_id;                    /* id of the reactor of this state */
+    int reactors_num;                  /* number of reactors */
 };
 
 struct redisCommand;
 
+/* State of a client in a blocking operation */
+typedef struct block_state_t {
+    robj **keys;                     /* keys the client is waiting for */
+    int numkeys;                     /* number of keys */
+    ev_timer_t *timeout;             /* handle of the timeout timer, if any */
+    struct hq_merge_t *merge;        /* QMERGE the client waits for, if any */
+    struct reactor_job_t *job;       /* other reactors the client waits for, if any */
+} block_state_t;
+
+/* A parsed command */
+typedef struct parsed_cmd_t {
+    int argc;
+    int argv_size;                   /* number of arguments argv has room for */
+    robj **argv;
+} parsed_cmd_t;
+
+/* Commands of a pipeline parsed ahead by an I/O thread, for the main thread
+ * to execute them back-to-back */
+typedef struct cmd_batch_t {
+    parsed_cmd_t *cmds;              /* the slots past len keep spare argv */
+    int len;                         /* number of parsed commands */
+    int pos;                         /* next command to execute */
+    int size;                        /* capacity of cmds */
+    parsed_cmd_t rest;               /* arguments of the command after the
+                                        batch, parsed partly */
+    int rest_multibulk_len;          /* its parser state, see rr_client_t */
+    long rest_bulk_len;
+} cmd_batch_t;
+
 typedef struct rr_client_t {
     int fd;                        /* client file descriptor */
     int req_type;                  /* request type: [inline|multibulk] */
     int multibulk_len;             /* number of multi bulk arguments left to read */
     long bulk_len;                 /* length of bulk argument in multi bulk request */
     sds query;                     /* query buffer */
+    size_t qpos;                   /* offset of the unparsed input in query */
     list *reply;                   /* reply list */
     struct redisCommand *cmd;      /* current cmd */
     struct redisCommand *lastcmd;  /* last cmd */
     int flags;                     /* client flags */
     int argc;                      /* number of arguments of current command. */
     robj **argv;                   /* arguments of the current command. */
+    int argv_size;                 /* number of arguments argv has room for */
+    objectPool argv_pool;          /* argument objects kept for reuse */
     rrdb_t *db;                    /* current databasee */
     size_t replied_len;            /* total length of bytes already replied */
     size_t buf_sent_len;           /* length of bytes sent in the buffer */
+    mstime_t last_interaction;     /* loop time of the last read from the client */
     int buf_offset;                /* output buffer offset */
-    char buf[PROTO_REPLY_MAX_LEN]; /* output buffer */
+    int buf_size;                  /* room in the output buffer */
+    block_state_t bpop;            /* blocking state */
+    cmd_batch_t batch;             /* commands parsed ahead by an I/O thread */
+    sds proto_err;                 /* protocol error found by the parser */
+    struct rr_call_t *call;        /* command of another reactor the client runs */
+    char *buf;                     /* output buffer, the replies of a pipeline
+                                      go on growing it */
 } rr_client_t;
 
 /* Command flags. Please check the command table defined in the redis.c file
@@ -100,6 +161,7 @@ typedef struct rr_client_t {
 #define CMD_SKIP_MONITOR 2048         /* "M" flag */
 #define CMD_ASKING 4096               /* "k" flag */
 #define CMD_FAST 8192                 /* "F" flag */
+#define CMD_INTERNAL 16384            /* "I" flag */
 
 /* Command call flags, see call() function */
 #define CMD_CALL_NONE 0
@@ -130,6 +192,7 @@ struct redisCommand {
 
 struct rr_configuration;
 void rr_server_init(struct rr_configuration *cfg);
+void rr_server_init_reactor(struct rr_configuration *cfg, int id);
 void rr_server_close(void);
 void rr_server_adjust_max_clients(void);
 int rr_server_prepare_to_shutdown(void);
@@ -138,6 +201,8 @@ sds rr_server_get_info(void);
 rr_client_t *rr_client_create(int fd);
 void rr_client_free(rr_client_t *c);
 void rr_client_reset(rr_client_t *c);
+void rr_client_process_input(rr_client_t *c);
+void rr_client_io_read(rr_client_t *c);
 
 /* command look up */
 struct redisCommand *cmd_lookup(sds name);
@@ -158,10 +223,15 @@ void reply_add_bulk_cbuf(rr_client_t *c, const void *p, size_t len);
 void reply_add_bulk_sds(rr_client_t *c, sds s);
 void reply_add_bulk_cstr(rr_client_t *c, const char *s);
 void reply_add_bulk_longlong(rr_client_t *c, long long ll);
+void reply_add_double(rr_client_t *c, double d);
 void reply_add_multi_bulk_len(rr_client_t *c, long length);
+void *reply_add_deferred_multi_bulk_len(rr_client_t *c);
+void reply_set_deferred_multi_bulk_len(rr_client_t *c, void *node, long length);
+void reply_add_list(rr_client_t *c, list *reply);
 int check_obj_type(rr_client_t *c, robj *o, int type);
 
 int reply_write_to_client(int fd, rr_client_t *c, int handler_installed);
+int reply_write_buffers(rr_client_t *c);
 
 /* Callback for write event */
 void reply_write_callback(eventloop_t *el, int fd, void *ud, int mask);
@@ -171,7 +241,10 @@ bool client_has_pending_replies(rr_client_t *c);
 
 void objectCommand(rr_client_t *c);
 
-/* declare the global server variable */
-extern struct rr_server_t server;
+/* Every reactor has its own server state, see rr_reactor.c. The code always
+ * refers to the state of the reactor it runs on through this thread local
+ * pointer, which defaults to the state of the main reactor. */
+extern __thread struct rr_server_t *rr_server_self;
+#define server (*rr_server_self)
 
 #endif
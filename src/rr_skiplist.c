@@ -0,0 +1,187 @@
+#include "rr_ftmacro.h"
+
+#include "rr_skiplist.h"
+#include "rr_malloc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static skiplist_node_t *create_node(int level, double score, const char *member) {
+    skiplist_node_t *node;
+
+    node = rr_malloc(sizeof(*node) + level * sizeof(struct skiplist_level_t));
+    node->score = score;
+    node->member = member;
+    return node;
+}
+
+/* Random level in [1, SKIPLIST_MAXLEVEL], a node gets to the next level with a
+ * probability of SKIPLIST_P */
+static int random_level(void) {
+    int level = 1;
+
+    while ((random() & 0xFFFF) < (SKIPLIST_P * 0xFFFF)) level++;
+    return level < SKIPLIST_MAXLEVEL ? level : SKIPLIST_MAXLEVEL;
+}
+
+/* Whether the node goes before the given score and member */
+static inline bool node_before(const skiplist_node_t *node, double score,
+                               const char *member) {
+    return node->score < score ||
+        (node->score == score && strcmp(node->member, member) < 0);
+}
+
+static inline bool value_gte_min(double value, const skiplist_range_t *range) {
+    return range->minex ? value > range->min : value >= range->min;
+}
+
+skiplist_t *skiplist_create(void) {
+    skiplist_t *sl = rr_malloc(sizeof(*sl));
+    int i;
+
+    sl->level = 1;
+    sl->length = 0;
+    sl->header = create_node(SKIPLIST_MAXLEVEL, 0, NULL);
+    for (i = 0; i < SKIPLIST_MAXLEVEL; i++) {
+        sl->header->level[i].forward = NULL;
+        sl->header->level[i].span = 0;
+    }
+    sl->header->backward = NULL;
+    sl->tail = NULL;
+    return sl;
+}
+
+void skiplist_free(skiplist_t *sl) {
+    skiplist_node_t *node = sl->header->level[0].forward, *next;
+
+    rr_free(sl->header);
+    while (node) {
+        next = node->level[0].forward;
+        rr_free(node);
+        node = next;
+    }
+    rr_free(sl);
+}
+
+skiplist_node_t *skiplist_insert(skiplist_t *sl, double score, const char *member) {
+    skiplist_node_t *update[SKIPLIST_MAXLEVEL], *x = sl->header;
+    unsigned long rank[SKIPLIST_MAXLEVEL];
+    int i, level;
+
+    /* Find where to insert, and how many nodes are before it on every level */
+    for (i = sl->level - 1; i >= 0; i--) {
+        rank[i] = i == sl->level - 1 ? 0 : rank[i+1];
+        while (x->level[i].forward &&
+               node_before(x->level[i].forward, score, member)) {
+            rank[i] += x->level[i].span;
+            x = x->level[i].forward;
+        }
+        update[i] = x;
+    }
+
+    level = random_level();
+    if (level > sl->level) {
+        for (i = sl->level; i < level; i++) {
+            rank[i] = 0;
+            update[i] = sl->header;
+            update[i]->level[i].span = sl->length;
+        }
+        sl->level = level;
+    }
+
+    x = create_node(level, score, member);
+    for (i = 0; i < level; i++) {
+        x->level[i].forward = update[i]->level[i].forward;
+        update[i]->level[i].forward = x;
+        x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
+        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
+    }
+    /* The links above the new node now span one more node */
+    for (i = level; i < sl->level; i++)
+        update[i]->level[i].span++;
+
+    x->backward = update[0] == sl->header ? NULL : update[0];
+    if (x->level[0].forward)
+        x->level[0].forward->backward = x;
+    else
+        sl->tail = x;
+    sl->length++;
+    return x;
+}
+
+bool skiplist_delete(skiplist_t *sl, double score, const char *member) {
+    skiplist_node_t *update[SKIPLIST_MAXLEVEL], *x = sl->header;
+    int i;
+
+    for (i = sl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward &&
+               node_before(x->level[i].forward, score, member))
+            x = x->level[i].forward;
+        update[i] = x;
+    }
+
+    x = x->level[0].forward;
+    if (!x || x->score != score || strcmp(x->member, member)) return false;
+
+    for (i = 0; i < sl->level; i++) {
+        if (update[i]->level[i].forward == x) {
+            update[i]->level[i].span += x->level[i].span - 1;
+            update[i]->level[i].forward = x->level[i].forward;
+        } else {
+            update[i]->level[i].span--;
+        }
+    }
+    if (x->level[0].forward)
+        x->level[0].forward->backward = x->backward;
+    else
+        sl->tail = x->backward;
+    while (sl->level > 1 && sl->header->level[sl->level-1].forward == NULL)
+        sl->level--;
+    sl->length--;
+    rr_free(x);
+    return true;
+}
+
+/* Number of nodes before the first one which is not below the bound, that is
+ * with a score less than the bound, or less than or equal to it if inclusive */
+static unsigned long count_below(skiplist_t *sl, double bound, bool inclusive) {
+    skiplist_node_t *x = sl->header, *next;
+    unsigned long rank = 0;
+    int i;
+
+    for (i = sl->level - 1; i >= 0; i--) {
+        while ((next = x->level[i].forward) &&
+               (next->score < bound || (inclusive && next->score == bound))) {
+            rank += x->level[i].span;
+            x = next;
+        }
+    }
+    return rank;
+}
+
+unsigned long skiplist_count_range(skiplist_t *sl, const skiplist_range_t *range) {
+    unsigned long below_min, upto_max;
+
+    if (range->min > range->max ||
+        (range->min == range->max && (range->minex || range->maxex)))
+        return 0;
+
+    below_min = count_below(sl, range->min, range->minex);
+    upto_max = count_below(sl, range->max, !range->maxex);
+    return upto_max > below_min ? upto_max - below_min : 0;
+}
+
+skiplist_node_t *skiplist_first_in_range(skiplist_t *sl, const skiplist_range_t *range) {
+    skiplist_node_t *x = sl->header;
+    int i;
+
+    for (i = sl->level - 1; i >= 0; i--) {
+        while (x->level[i].forward &&
+               !value_gte_min(x->level[i].forward->score, range))
+            x = x->level[i].forward;
+    }
+
+    x = x->level[0].forward;
+    if (!x || !skiplist_value_lte_max(x->score, range)) return NULL;
+    return x;
+}
@@ -0,0 +1,68 @@
+#ifndef _RR_SKIPLIST_H
+#define _RR_SKIPLIST_H
+
+/*
+ * Skiplist ordered by score then member, much like the one of the Redis
+ * sorted sets. Every link knows how many nodes it spans, so that counting
+ * the nodes in a score range takes O(log n).
+ *
+ * The members are borrowed from the caller, who makes sure that they are
+ * unique and live as long as their nodes.
+ */
+
+#include <stdbool.h>
+
+#define SKIPLIST_MAXLEVEL 32
+#define SKIPLIST_P 0.25
+
+typedef struct skiplist_node_t {
+    double score;
+    const char *member;
+    struct skiplist_node_t *backward;
+    struct skiplist_level_t {
+        struct skiplist_node_t *forward;
+        unsigned long span;  /* number of nodes between this one and forward */
+    } level[];
+} skiplist_node_t;
+
+typedef struct skiplist_t {
+    skiplist_node_t *header;
+    skiplist_node_t *tail;
+    unsigned long length;
+    int level;
+} skiplist_t;
+
+/* Score range, the bounds are excluded if minex/maxex are set */
+typedef struct skiplist_range_t {
+    double min, max;
+    int minex, maxex;
+} skiplist_range_t;
+
+skiplist_t *skiplist_create(void);
+void skiplist_free(skiplist_t *sl);
+
+/* Insert the member, which must not be in the skiplist yet */
+skiplist_node_t *skiplist_insert(skiplist_t *sl, double score, const char *member);
+
+/* Delete the member with the given score, returns false if it's missing */
+bool skiplist_delete(skiplist_t *sl, double score, const char *member);
+
+/* Number of nodes in the range */
+unsigned long skiplist_count_range(skiplist_t *sl, const skiplist_range_t *range);
+
+/* First node in the range, or NULL if the range is empty */
+skiplist_node_t *skiplist_first_in_range(skiplist_t *sl, const skiplist_range_t *range);
+
+static inline unsigned long skiplist_len(const skiplist_t *sl) {
+    return sl->length;
+}
+
+static inline skiplist_node_t *skiplist_next(const skiplist_node_t *node) {
+    return node->level[0].forward;
+}
+
+static inline bool skiplist_value_lte_max(double value, const skiplist_range_t *range) {
+    return range->maxex ? value < range->max : value <= range->max;
+}
+
+#endif /* ifndef _RR_SKIPLIST_H */
@@ -0,0 +1,909 @@
+/* Linux io_uring based event loop backend
+ *
+ * The sockets handed over to the loop with el_stream_open are read and
+ * written by the ring. They are received ahead of their read events into the
+ * buffers of a provided buffer ring, by a multishot receive which stays armed
+ * as long as the stream doesn't hold too many of them, el_read then copies out
+ * what is already there. The writes are queued and sent by SEND or SENDMSG
+ * requests submitted along with the next wait, so that the wait, the sends and
+ * the receives of a whole loop iteration make a single io_uring_enter. The
+ * small writes are copied to a send buffer, the large ones written with
+ * el_writev_ref are sent from where they are, holding a reference to their
+ * object until they are.
+ *
+ * The events keep the level-triggered behavior of epoll that the callbacks
+ * expect: a stream fires its read event as long as there is received data
+ * left, or the end of the stream, and its write event as long as there is
+ * room to queue more data.
+ *
+ * A stream closed with data still queued is closed once it is sent, so that
+ * the fd isn't reused meanwhile. A peer that doesn't read would keep it open
+ * forever, the send is then cancelled and the socket shut down past
+ * URING_CLOSE_TIMEOUT.
+ *
+ * The other fds, e.g. the listening sockets, are polled with one-shot polls
+ * armed again when they fire as long as the event is still wanted.
+ */
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <poll.h>
+
+#define URING_SQ_ENTRIES 1024
+#define URING_BUF_COUNT  256        /* buffers of the provided buffer ring, a power of 2 */
+#define URING_BUF_SIZE   (16*1024)
+#define URING_BUF_GROUP  0
+#define URING_RECV_QUEUE 8          /* received buffers held per stream */
+#define URING_SEND_MIN_LEN (16*1024) /* data copied to send per stream, grown up to */
+#define URING_SEND_LEN   (64*1024)    /* for large replies */
+#define URING_SEND_REF_MIN (16*1024) /* data sent by reference rather than copied */
+#define URING_SEND_SEGS  16          /* parts of the data queued to send, a power of 2 */
+#define URING_CLOSE_TIMEOUT 2000     /* ms a closed stream has to send its queued data */
+#define URING_BID_NONE   -1
+
+#ifndef IORING_RECV_MULTISHOT
+#define IORING_RECV_MULTISHOT (1U << 1)
+#endif
+
+/* The user data of a request is made of its generation, the fd and the
+ * event, so that the completions of the polls and receives since removed can
+ * be told apart. The sends use URING_EV_SEND, and the removals URING_UD_NONE. */
+#define URING_UD_NONE 0
+#define URING_UD(gen, fd, ev) (((uint64_t) (gen) << 32) | ((uint64_t) (fd) << 2) | (ev))
+#define URING_UD_GEN(ud) ((uint32_t) ((ud) >> 32))
+#define URING_UD_FD(ud) ((int) (((ud) >> 2) & 0x3FFFFFFF))
+#define URING_UD_EV(ud) ((int) ((ud) & 3))
+#define URING_EV_SEND 3
+
+/* Features the backend relies on, along with the provided buffer rings
+ * available since Linux 5.19 */
+#define URING_FEATURES (IORING_FEAT_SINGLE_MMAP|IORING_FEAT_NODROP|IORING_FEAT_EXT_ARG)
+
+/* A part of the data queued to send, either copied to the send buffer, right
+ * after the copied parts before it, or referenced where it is */
+typedef struct el_uring_seg_t {
+    char *base;             /* the data referenced, NULL when copied */
+    void *ref;              /* the reference held until it is sent */
+    size_t len;             /* bytes left to send */
+} el_uring_seg_t;
+
+/* The send queue of a stream, allocated along with its send buffer */
+typedef struct el_uring_sendq_t {
+    el_uring_seg_t segs[URING_SEND_SEGS];
+    struct iovec iov[URING_SEND_SEGS]; /* of the SENDMSG in flight */
+    struct msghdr msg;
+} el_uring_sendq_t;
+
+typedef struct el_uring_fd_t {
+    uint32_t gens[2];       /* generation of the read and write requests */
+    unsigned char stream;   /* opened with el_stream_open */
+    unsigned char recving;  /* a receive is submitted, or armed */
+    unsigned char stopping; /* its cancellation is submitted */
+    unsigned char active;   /* in the list of the active streams */
+    unsigned char flushing; /* in the list of the streams to flush */
+    unsigned char closing;  /* closed once the queued data is sent */
+    unsigned char lingering; /* in the list of the closing streams */
+    int rerr;               /* errno of the receives, -1 at the end of the stream */
+    /* Received buffers, linked in the order they were received, recycled up
+     * to rread and read up to roff of it */
+    int rfirst, rread, rlast;
+    uint32_t roff;
+    unsigned rcount;
+    /* Data queued to send: the copied parts are sent up to soff of the send
+     * buffer and queued up to slen, sref bytes are referenced, and sending
+     * bytes of the queue are submitted */
+    el_uring_sendq_t *sq;
+    unsigned shead, stail;
+    char *sbuf;
+    uint32_t ssize, soff, slen;
+    size_t sref, sending;
+    int serr;               /* errno of the sends */
+    long long close_at;     /* deadline of the closing, monotonic milliseconds */
+} el_uring_fd_t;
+
+typedef struct el_uring_t {
+    int ring_fd;
+    void *ring;                 /* the mmap-ed submission and completion rings */
+    size_t ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, sq_entries;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br; /* the provided buffer ring */
+    char *bufs;                 /* its buffers */
+    uint16_t br_tail;
+    int nobufs;                 /* a receive ran out of buffers */
+    int oneshot;                /* multishot receives aren't supported */
+    int bnext[URING_BUF_COUNT]; /* next buffer received by the same stream */
+    uint32_t blens[URING_BUF_COUNT]; /* bytes received in the buffers */
+    eventloop_t *el;
+    el_uring_fd_t *fds;
+    int nfds;
+    int *active, nactive;       /* streams with buffers or events to look after */
+    int *flush, nflush;         /* streams written since the last polling */
+    int *closing, nclosing;     /* streams closed while their data is sent */
+} el_uring_t;
+
+static inline uint32_t *el_uring_gen(el_uring_t *u, int fd, int ev) {
+    return &u->fds[fd].gens[ev == RR_EV_WRITE];
+}
+
+static unsigned el_uring_pending(el_uring_t *u) {
+    return *u->sq_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+}
+
+static int el_uring_enter(el_uring_t *u, unsigned min_complete, unsigned flags,
+                          void *arg, size_t argsz) {
+    /* The buffers recycled so far go along */
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+    return (int) syscall(__NR_io_uring_enter, u->ring_fd, el_uring_pending(u),
+                         min_complete, flags, arg, argsz);
+}
+
+/* Get a zeroed SQE, submitting the pending ones if the ring is full */
+static struct io_uring_sqe *el_uring_get_sqe(el_uring_t *u) {
+    struct io_uring_sqe *sqe;
+
+    if (el_uring_pending(u) == u->sq_entries) {
+        el_uring_enter(u, 0, 0, NULL, 0);
+        if (el_uring_pending(u) == u->sq_entries) return NULL;
+    }
+    sqe = &u->sqes[*u->sq_tail & *u->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void el_uring_push_sqe(el_uring_t *u) {
+    __atomic_store_n(u->sq_tail, *u->sq_tail + 1, __ATOMIC_RELEASE);
+}
+
+static int el_uring_arm(el_uring_t *u, int fd, int ev) {
+    struct io_uring_sqe *sqe = el_uring_get_sqe(u);
+    uint32_t *gen = el_uring_gen(u, fd, ev);
+
+    if (!sqe) return -1;
+    (*gen)++;
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->poll32_events = ev == RR_EV_READ ? POLLIN : POLLOUT;
+    sqe->user_data = URING_UD(*gen, fd, ev);
+    el_uring_push_sqe(u);
+    return 0;
+}
+
+static void el_uring_disarm(el_uring_t *u, int fd, int ev) {
+    struct io_uring_sqe *sqe = el_uring_get_sqe(u);
+    uint32_t *gen = el_uring_gen(u, fd, ev);
+
+    if (sqe) {
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->addr = URING_UD(*gen, fd, ev);
+        sqe->user_data = URING_UD_NONE;
+        el_uring_push_sqe(u);
+    }
+    /* Whatever happens to the removal, the completions of the poll are
+     * ignored from now on */
+    (*gen)++;
+}
+
+/* Give a buffer back to the ring, published with the next io_uring_enter */
+static void el_uring_recycle(el_uring_t *u, uint16_t bid) {
+    struct io_uring_buf *buf = &u->br->bufs[u->br_tail & (URING_BUF_COUNT-1)];
+
+    buf->addr = (uint64_t) (uintptr_t) (u->bufs + (size_t) bid*URING_BUF_SIZE);
+    buf->len = URING_BUF_SIZE;
+    buf->bid = bid;
+    u->br_tail++;
+    u->nobufs = 0;
+}
+
+static int el_uring_recv(el_uring_t *u, int fd) {
+    struct io_uring_sqe *sqe = el_uring_get_sqe(u);
+    el_uring_fd_t *f = &u->fds[fd];
+
+    if (!sqe) return -1;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUF_GROUP;
+    /* Receives into a new buffer as long as there is data, which needs
+     * Linux 6.0 */
+    if (!u->oneshot) sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->user_data = URING_UD(f->gens[0], fd, RR_EV_READ);
+    el_uring_push_sqe(u);
+    f->recving = 1;
+    return 0;
+}
+
+static void el_uring_cancel(el_uring_t *u, uint64_t ud) {
+    struct io_uring_sqe *sqe = el_uring_get_sqe(u);
+
+    if (!sqe) return;
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = ud;
+    sqe->user_data = URING_UD_NONE;
+    el_uring_push_sqe(u);
+}
+
+/* Submit the queued data, a single copied part with SEND, several parts with
+ * SENDMSG gathering them */
+static int el_uring_send(el_uring_t *u, int fd) {
+    struct io_uring_sqe *sqe = el_uring_get_sqe(u);
+    el_uring_fd_t *f = &u->fds[fd];
+    el_uring_sendq_t *q = f->sq;
+    size_t off = f->soff;
+    unsigned i, n = 0;
+
+    if (!sqe) return -1;
+    f->sending = 0;
+    for (i = f->shead; i != f->stail; i++) {
+        el_uring_seg_t *seg = &q->segs[i & (URING_SEND_SEGS-1)];
+
+        q->iov[n].iov_base = seg->base ? seg->base : f->sbuf + off;
+        q->iov[n++].iov_len = seg->len;
+        if (!seg->base) off += seg->len;
+        f->sending += seg->len;
+    }
+    sqe->fd = fd;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    if (n == 1) {
+        sqe->opcode = IORING_OP_SEND;
+        sqe->addr = (uint64_t) (uintptr_t) q->iov[0].iov_base;
+        sqe->len = q->iov[0].iov_len;
+    } else {
+        memset(&q->msg, 0, sizeof(q->msg));
+        q->msg.msg_iov = q->iov;
+        q->msg.msg_iovlen = n;
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->addr = (uint64_t) (uintptr_t) &q->msg;
+        sqe->len = 1;
+    }
+    sqe->user_data = URING_UD(0, fd, URING_EV_SEND);
+    el_uring_push_sqe(u);
+    return 0;
+}
+
+static void el_uring_activate(el_uring_t *u, int fd) {
+    if (u->fds[fd].active) return;
+    u->fds[fd].active = 1;
+    u->active[u->nactive++] = fd;
+}
+
+/* Room left to copy data to send, what is being sent can't move */
+static uint32_t el_uring_send_room(el_uring_fd_t *f) {
+    if (f->stail - f->shead == URING_SEND_SEGS) return 0;
+    return f->ssize - (f->sending ? f->slen : f->slen - f->soff);
+}
+
+/* Events of the stream to fire, as epoll would report them */
+static int el_uring_stream_events(eventloop_t *el, el_uring_t *u, int fd) {
+    el_uring_fd_t *f = &u->fds[fd];
+    int mask = el->events[fd].mask, ev = 0;
+
+    if (!f->stream) return 0;
+    if ((mask & RR_EV_READ) && (f->rread != URING_BID_NONE || f->rerr)) ev |= RR_EV_READ;
+    if ((mask & RR_EV_WRITE) && (f->serr || !f->sbuf || el_uring_send_room(f))) ev |= RR_EV_WRITE;
+    return ev;
+}
+
+static void el_uring_received(el_uring_t *u, int fd, struct io_uring_cqe *cqe) {
+    el_uring_fd_t *f = &u->fds[fd];
+
+    /* The multishot receives stay armed until the completion without MORE */
+    if (!(cqe->flags & IORING_CQE_F_MORE)) f->recving = f->stopping = 0;
+    if (cqe->res > 0) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+        u->blens[bid] = cqe->res;
+        u->bnext[bid] = URING_BID_NONE;
+        if (f->rlast != URING_BID_NONE) u->bnext[f->rlast] = bid;
+        else f->rfirst = bid;
+        f->rlast = bid;
+        if (f->rread == URING_BID_NONE) {
+            f->rread = bid;
+            f->roff = 0;
+        }
+        /* Received again once it is read, leaving the buffers to the others */
+        if (++f->rcount >= URING_RECV_QUEUE && f->recving && !f->stopping) {
+            el_uring_cancel(u, URING_UD(f->gens[0], fd, RR_EV_READ));
+            f->stopping = 1;
+        }
+    } else if (cqe->res == 0) {
+        f->rerr = -1;
+    } else if (cqe->res == -ENOBUFS) {
+        /* Received again once buffers are recycled */
+        u->nobufs = 1;
+    } else if (cqe->res == -EINVAL && !u->oneshot) {
+        /* No multishot receives before Linux 6.0, one receive at a time */
+        u->oneshot = 1;
+    } else if (cqe->res != -ECANCELED) {
+        f->rerr = -cqe->res;
+    }
+    el_uring_activate(u, fd);
+}
+
+/* Drop the parts of the queue sent, releasing their references */
+static void el_uring_consume(el_uring_t *u, el_uring_fd_t *f, size_t nsent) {
+    while (f->shead != f->stail) {
+        el_uring_seg_t *seg = &f->sq->segs[f->shead & (URING_SEND_SEGS-1)];
+        size_t n = seg->len < nsent ? seg->len : nsent;
+
+        if (seg->base) {
+            seg->base += n;
+            f->sref -= n;
+        } else {
+            f->soff += n;
+        }
+        seg->len -= n;
+        nsent -= n;
+        if (seg->len) break;
+        if (seg->ref) u->el->ref_release(seg->ref);
+        f->shead++;
+    }
+}
+
+/* Free the send queue and close the fd of a stream closed and done sending,
+ * or given up */
+static void el_uring_drop(el_uring_t *u, int fd) {
+    el_uring_fd_t *f = &u->fds[fd];
+
+    el_uring_consume(u, f, SIZE_MAX);
+    rr_free(f->sq);
+    rr_free(f->sbuf);
+    f->sq = NULL;
+    f->sbuf = NULL;
+    f->shead = f->stail = 0;
+    f->ssize = f->soff = f->slen = 0;
+    f->closing = 0;
+    f->serr = 0;
+    close(fd);
+}
+
+static void el_uring_sent(el_uring_t *u, int fd, int res) {
+    el_uring_fd_t *f = &u->fds[fd];
+
+    f->sending = 0;
+    if (res < 0) {
+        f->serr = -res;
+        el_uring_consume(u, f, SIZE_MAX);
+    } else {
+        el_uring_consume(u, f, res);
+    }
+    if (f->shead != f->stail && !f->serr) {
+        /* The rest goes with the next io_uring_enter */
+        if (el_uring_send(u, fd) == -1 && !f->flushing) {
+            f->flushing = 1;
+            u->flush[u->nflush++] = fd;
+        }
+        return;
+    }
+    if (f->closing) {
+        el_uring_drop(u, fd);
+        return;
+    }
+    f->soff = f->slen = 0;
+    /* Give back the room a large reply needed */
+    if (f->ssize > URING_SEND_MIN_LEN) {
+        f->ssize = URING_SEND_MIN_LEN;
+        f->sbuf = rr_realloc(f->sbuf, f->ssize);
+    }
+    if (f->stream) el_uring_activate(u, fd);
+}
+
+static void el_uring_release(el_uring_t *u) {
+    int fd;
+
+    if (u->fds) {
+        for (fd = 0; fd < u->nfds; fd++) {
+            el_uring_consume(u, &u->fds[fd], SIZE_MAX);
+            rr_free(u->fds[fd].sq);
+            rr_free(u->fds[fd].sbuf);
+            if (u->fds[fd].closing) close(fd);
+        }
+    }
+    if (u->bufs) munmap(u->bufs, (size_t) URING_BUF_COUNT*URING_BUF_SIZE);
+    if (u->br) munmap(u->br, URING_BUF_COUNT*sizeof(struct io_uring_buf));
+    if (u->sqes) munmap(u->sqes, u->sqes_size);
+    if (u->ring) munmap(u->ring, u->ring_size);
+    if (u->ring_fd != -1) close(u->ring_fd);
+    rr_free(u->fds);
+    rr_free(u->active);
+    rr_free(u->flush);
+    rr_free(u->closing);
+    rr_free(u);
+}
+
+static int el_uring_create(eventloop_t *el) {
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    el_uring_t *u;
+    size_t sq_size, cq_size;
+    unsigned i, cq_entries;
+    char *ring;
+
+    if ((u = rr_calloc(sizeof(*u))) == NULL) return -1;
+    u->el = el;
+    u->ring_fd = -1;
+    u->nfds = el->size;
+    u->fds = rr_calloc(sizeof(el_uring_fd_t)*el->size);
+    u->active = rr_malloc(sizeof(int)*el->size);
+    u->flush = rr_malloc(sizeof(int)*el->size);
+    u->closing = rr_malloc(sizeof(int)*el->size);
+    if (u->fds == NULL || u->active == NULL || u->flush == NULL || u->closing == NULL)
+        goto err;
+
+    /* Room for the completions of a read and a write per fd, no less than
+     * the submissions as the ring requires */
+    cq_entries = el->size*2 > URING_SQ_ENTRIES ? el->size*2 : URING_SQ_ENTRIES;
+
+    /* Only the thread of the loop submits, the completions can then be left
+     * for it to process when it waits rather than interrupting it, which
+     * needs Linux 6.1 */
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_CLAMP|
+              IORING_SETUP_SINGLE_ISSUER|IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = cq_entries;
+    u->ring_fd = (int) syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    if (u->ring_fd == -1 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE|IORING_SETUP_CLAMP;
+        p.cq_entries = cq_entries;
+        u->ring_fd = (int) syscall(__NR_io_uring_setup, URING_SQ_ENTRIES, &p);
+    }
+    if (u->ring_fd == -1) goto err;
+    if ((p.features & URING_FEATURES) != URING_FEATURES) goto err;
+
+    sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, u->ring_fd, IORING_OFF_SQ_RING);
+    if (u->ring == MAP_FAILED) {
+        u->ring = NULL;
+        goto err;
+    }
+    u->sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ|PROT_WRITE,
+                   MAP_SHARED|MAP_POPULATE, u->ring_fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto err;
+    }
+
+    ring = u->ring;
+    u->sq_head = (unsigned *) (ring + p.sq_off.head);
+    u->sq_tail = (unsigned *) (ring + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (ring + p.sq_off.ring_mask);
+    u->sq_entries = p.sq_entries;
+    u->cq_head = (unsigned *) (ring + p.cq_off.head);
+    u->cq_tail = (unsigned *) (ring + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (ring + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (ring + p.cq_off.cqes);
+    /* SQEs are always submitted in order */
+    for (i = 0; i < p.sq_entries; i++)
+        ((unsigned *) (ring + p.sq_off.array))[i] = i;
+
+    /* The buffers the streams are received into, shared by all of them */
+    u->br = mmap(NULL, URING_BUF_COUNT*sizeof(struct io_uring_buf),
+                 PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        goto err;
+    }
+    u->bufs = mmap(NULL, (size_t) URING_BUF_COUNT*URING_BUF_SIZE,
+                   PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (u->bufs == MAP_FAILED) {
+        u->bufs = NULL;
+        goto err;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->br;
+    reg.ring_entries = URING_BUF_COUNT;
+    reg.bgid = URING_BUF_GROUP;
+    if (syscall(__NR_io_uring_register, u->ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0)
+        goto err;
+    for (i = 0; i < URING_BUF_COUNT; i++)
+        el_uring_recycle(u, i);
+    __atomic_store_n(&u->br->tail, u->br_tail, __ATOMIC_RELEASE);
+
+    el->context = u;
+    return 0;
+
+err:
+    el_uring_release(u);
+    return -1;
+}
+
+static void el_uring_free(eventloop_t *el) {
+    el_uring_release(el->context);
+}
+
+static int el_uring_add(eventloop_t *el, int fd, int mask) {
+    el_uring_t *u = el->context;
+    int ev, old = el->events[fd].mask;
+
+    /* Received and fired by the polling */
+    if (u->fds[fd].stream) {
+        el_uring_activate(u, fd);
+        return 0;
+    }
+    for (ev = RR_EV_READ; ev <= RR_EV_WRITE; ev <<= 1) {
+        if (!(mask & ev) || (old & ev)) continue;
+        if (el_uring_arm(u, fd, ev) == -1) return -1;
+    }
+    return 0;
+}
+
+static void el_uring_del(eventloop_t *el, int fd, int delmask) {
+    el_uring_t *u = el->context;
+    int ev, old = el->events[fd].mask;
+
+    /* A stream keeps what it received until it is closed */
+    if (u->fds[fd].stream) return;
+    for (ev = RR_EV_READ; ev <= RR_EV_WRITE; ev <<= 1)
+        if (delmask & old & ev) el_uring_disarm(u, fd, ev);
+}
+
+static int el_uring_stream(eventloop_t *el, int fd) {
+    el_uring_fd_t *f = &((el_uring_t *) el->context)->fds[fd];
+
+    f->stream = 1;
+    f->rerr = f->serr = 0;
+    f->rfirst = f->rread = f->rlast = URING_BID_NONE;
+    f->roff = f->rcount = 0;
+    return 0;
+}
+
+static ssize_t el_uring_read(eventloop_t *el, int fd, void *buf, size_t len) {
+    el_uring_t *u = el->context;
+    el_uring_fd_t *f = &u->fds[fd];
+    size_t nread = 0;
+
+    if (!f->stream) return read(fd, buf, len);
+    while (nread < len && f->rread != URING_BID_NONE) {
+        int bid = f->rread;
+        size_t n = u->blens[bid] - f->roff;
+
+        if (n > len - nread) n = len - nread;
+        memcpy((char *) buf + nread, u->bufs + (size_t) bid*URING_BUF_SIZE + f->roff, n);
+        nread += n;
+        f->roff += n;
+        /* Recycled by the polling, the ring is only touched from its thread */
+        if (f->roff == u->blens[bid]) {
+            f->rread = u->bnext[bid];
+            f->roff = 0;
+        }
+    }
+    if (nread) return nread;
+    if (f->rerr == -1) return 0;
+    errno = f->rerr ? f->rerr : EAGAIN;
+    return -1;
+}
+
+/* Queue a part of the data to send, returns NULL if the queue is full */
+static el_uring_seg_t *el_uring_queue(el_uring_fd_t *f, char *base, void *ref) {
+    el_uring_seg_t *seg;
+
+    if (f->stail - f->shead == URING_SEND_SEGS) return NULL;
+    seg = &f->sq->segs[f->stail++ & (URING_SEND_SEGS-1)];
+    seg->base = base;
+    seg->ref = ref;
+    seg->len = 0;
+    return seg;
+}
+
+static ssize_t el_uring_writev(eventloop_t *el, int fd, const struct iovec *iov,
+                               void **refs, int iovcnt) {
+    el_uring_t *u = el->context;
+    el_uring_fd_t *f = &u->fds[fd];
+    size_t nwritten = 0, total = 0, n;
+    el_uring_seg_t *seg;
+    uint32_t room, size;
+    int i;
+
+    if (!f->stream) return writev(fd, iov, iovcnt);
+    if (f->serr) {
+        errno = f->serr;
+        return -1;
+    }
+    if (!el->ref_hold) refs = NULL;
+    for (i = 0; i < iovcnt; i++) {
+        if (refs && refs[i] && iov[i].iov_len >= URING_SEND_REF_MIN) continue;
+        total += iov[i].iov_len;
+    }
+    if (f->sq == NULL && (f->sq = rr_malloc(sizeof(el_uring_sendq_t))) == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    /* Only what isn't being sent can move */
+    if (!f->sending) {
+        char *sbuf;
+
+        if (f->soff) {
+            memmove(f->sbuf, f->sbuf + f->soff, f->slen - f->soff);
+            f->slen -= f->soff;
+            f->soff = 0;
+        }
+        for (size = f->ssize ? f->ssize : URING_SEND_MIN_LEN;
+             size < URING_SEND_LEN && size - f->slen < total; size *= 2);
+        if (size != f->ssize) {
+            if ((sbuf = rr_realloc(f->sbuf, size)) == NULL) {
+                errno = ENOMEM;
+                return -1;
+            }
+            f->sbuf = sbuf;
+            f->ssize = size;
+        }
+    }
+    room = el_uring_send_room(f);
+    for (i = 0; i < iovcnt; i++) {
+        n = iov[i].iov_len;
+        if (n == 0) continue;
+
+        /* The large data of an object is referenced, as much of it as the
+         * copied data can take */
+        if (refs && refs[i] && n >= URING_SEND_REF_MIN) {
+            if (f->sref >= URING_SEND_LEN ||
+                (seg = el_uring_queue(f, iov[i].iov_base, refs[i])) == NULL)
+                break;
+            el->ref_hold(refs[i]);
+            seg->len = n;
+            f->sref += n;
+            nwritten += n;
+            continue;
+        }
+
+        /* The copied data goes on the last part if it is copied as well */
+        if (n > room) n = room;
+        if (n == 0) break;
+        seg = f->stail != f->shead ? &f->sq->segs[(f->stail-1) & (URING_SEND_SEGS-1)] : NULL;
+        if ((seg == NULL || seg->base) && (seg = el_uring_queue(f, NULL, NULL)) == NULL)
+            break;
+        memcpy(f->sbuf + f->slen, iov[i].iov_base, n);
+        f->slen += n;
+        seg->len += n;
+        room -= n;
+        nwritten += n;
+        if (n < iov[i].iov_len) break;
+    }
+    if (nwritten == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    /* Sent along with the next wait, the I/O threads may write at once */
+    if (!f->flushing) {
+        f->flushing = 1;
+        u->flush[__atomic_fetch_add(&u->nflush, 1, __ATOMIC_RELAXED)] = fd;
+    }
+    return nwritten;
+}
+
+static void el_uring_close(eventloop_t *el, int fd) {
+    el_uring_t *u = el->context;
+    el_uring_fd_t *f = &u->fds[fd];
+
+    if (!f->stream) {
+        close(fd);
+        return;
+    }
+    if (f->recving) el_uring_cancel(u, URING_UD(f->gens[0], fd, RR_EV_READ));
+    /* The receives still to complete are ignored from now on */
+    f->gens[0]++;
+    f->recving = f->stopping = 0;
+    f->stream = 0;
+    while (f->rfirst != URING_BID_NONE) {
+        int bid = f->rfirst;
+
+        f->rfirst = u->bnext[bid];
+        el_uring_recycle(u, bid);
+    }
+    f->rread = f->rlast = URING_BID_NONE;
+    f->rcount = 0;
+
+    /* The fd is kept until the queued data is sent, so that it isn't reused */
+    if ((f->shead != f->stail && !f->serr) || f->sending) {
+        f->closing = 1;
+        f->close_at = rr_dt_monotonic_ms() + URING_CLOSE_TIMEOUT;
+        if (!f->lingering) {
+            f->lingering = 1;
+            u->closing[u->nclosing++] = fd;
+        }
+        if (!f->sending && !f->flushing) {
+            f->flushing = 1;
+            u->flush[u->nflush++] = fd;
+        }
+        return;
+    }
+    el_uring_drop(u, fd);
+}
+
+/* Give up sending the data of a stream closed past its deadline. The send
+ * being cancelled, or failing on the socket shut down, closes it. */
+static void el_uring_expire(el_uring_t *u, int fd) {
+    el_uring_fd_t *f = &u->fds[fd];
+
+    if (!f->sending) {
+        el_uring_drop(u, fd);
+        return;
+    }
+    el_uring_cancel(u, URING_UD(0, fd, URING_EV_SEND));
+    shutdown(fd, SHUT_RDWR);
+    f->serr = ETIMEDOUT;
+}
+
+/* Expire the closing streams past their deadline, returns the milliseconds
+ * left before the next deadline, or -1 if there is none */
+static long long el_uring_linger(el_uring_t *u) {
+    long long now, wait = -1;
+    int i, n;
+
+    if (u->nclosing == 0) return -1;
+    now = rr_dt_monotonic_ms();
+    for (i = 0, n = 0; i < u->nclosing; i++) {
+        int fd = u->closing[i];
+        el_uring_fd_t *f = &u->fds[fd];
+
+        if (f->closing && !f->serr && now >= f->close_at) el_uring_expire(u, fd);
+        if (!f->closing) {
+            f->lingering = 0;
+            continue;
+        }
+        u->closing[n++] = fd;
+        if (!f->serr && (wait == -1 || f->close_at - now < wait)) wait = f->close_at - now;
+    }
+    u->nclosing = n;
+    return wait;
+}
+
+/* Recycle the buffers read by the stream and receive more if needed. Returns
+ * false once there is nothing left to look after until a completion. */
+static bool el_uring_stream_update(eventloop_t *el, el_uring_t *u, int fd) {
+    el_uring_fd_t *f = &u->fds[fd];
+    int mask = el->events[fd].mask;
+
+    while (f->rfirst != f->rread) {
+        int bid = f->rfirst;
+
+        f->rfirst = u->bnext[bid];
+        f->rcount--;
+        el_uring_recycle(u, bid);
+    }
+    if (f->rfirst == URING_BID_NONE) f->rlast = URING_BID_NONE;
+    if (!f->stream) return false;
+    if ((mask & RR_EV_READ) && !f->recving && !f->rerr && !u->nobufs &&
+        f->rcount < URING_RECV_QUEUE)
+        el_uring_recv(u, fd);
+    return f->rfirst != URING_BID_NONE || (mask & RR_EV_WRITE) ||
+           ((mask & RR_EV_READ) && (f->rerr || !f->recving));
+}
+
+static int el_uring_poll(eventloop_t *el, struct timeval *tvp) {
+    el_uring_t *u = el->context;
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned head, tail;
+    int nevent = 0, ready = 0, i, n;
+    long long linger;
+
+    /* Queue the sends of what was written since the last polling */
+    n = u->nflush;
+    u->nflush = 0;
+    for (i = 0; i < n; i++) {
+        int fd = u->flush[i];
+        el_uring_fd_t *f = &u->fds[fd];
+
+        f->flushing = 0;
+        if (f->sending || f->shead == f->stail || f->serr) continue;
+        if (el_uring_send(u, fd) == -1) {
+            f->flushing = 1;
+            u->flush[u->nflush++] = fd;
+        }
+    }
+
+    for (i = 0, n = 0; i < u->nactive; i++) {
+        int fd = u->active[i];
+
+        if (el_uring_stream_update(el, u, fd)) {
+            u->active[n++] = fd;
+            if (el_uring_stream_events(el, u, fd)) ready = 1;
+        } else {
+            u->fds[fd].active = 0;
+        }
+    }
+    u->nactive = n;
+    linger = el_uring_linger(u);
+
+    head = *u->cq_head;
+    if (!ready && head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        /* Submit the changes and wait for events at once */
+        memset(&arg, 0, sizeof(arg));
+        if (tvp) {
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec*1000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+        /* Woken up for the next closing deadline */
+        if (linger != -1 && (!tvp || linger < tvp->tv_sec*1000LL + tvp->tv_usec/1000)) {
+            ts.tv_sec = linger/1000;
+            ts.tv_nsec = (linger%1000)*1000000;
+            arg.ts = (uint64_t) (uintptr_t) &ts;
+        }
+        el_uring_enter(u, 1, IORING_ENTER_GETEVENTS|IORING_ENTER_EXT_ARG,
+                       &arg, sizeof(arg));
+    } else {
+        /* Submit without waiting, still collecting the deferred completions */
+        el_uring_enter(u, 0, IORING_ENTER_GETEVENTS, NULL, 0);
+    }
+
+    tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        uint64_t ud = cqe->user_data;
+        int fd = URING_UD_FD(ud), ev = URING_UD_EV(ud);
+
+        if (ud == URING_UD_NONE) {
+            head++;
+            continue;
+        }
+        if (ev == URING_EV_SEND) {
+            el_uring_sent(u, fd, cqe->res);
+            head++;
+            continue;
+        }
+        if (URING_UD_GEN(ud) != *el_uring_gen(u, fd, ev)) {
+            /* A receive of a stream since closed */
+            if (cqe->flags & IORING_CQE_F_BUFFER)
+                el_uring_recycle(u, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            head++;
+            continue;
+        }
+        if (u->fds[fd].stream) {
+            el_uring_received(u, fd, cqe);
+            head++;
+            continue;
+        }
+
+        /* Left for the next polling once the fired events are full */
+        if (nevent == el->size) break;
+        head++;
+        /* Errors are reported as events for the callbacks to run into them,
+         * but the fd is not polled anymore */
+        el->fired[nevent].fd = fd;
+        el->fired[nevent].mask = ev;
+        nevent++;
+        if (cqe->res >= 0 && el_uring_arm(u, fd, ev) == -1)
+            rr_log(RR_LOG_ERROR, "Can not poll fd %d again", fd);
+    }
+    __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+
+    for (i = 0; i < u->nactive && nevent < el->size; i++) {
+        int fd = u->active[i], ev = el_uring_stream_events(el, u, fd);
+
+        if (ev) {
+            el->fired[nevent].fd = fd;
+            el->fired[nevent].mask = ev;
+            nevent++;
+        }
+    }
+    return nevent;
+}
+
+static const el_backend_t el_backend_uring = {
+    "io_uring",
+    el_uring_create,
+    el_uring_free,
+    el_uring_add,
+    el_uring_del,
+    el_uring_poll,
+    el_uring_stream,
+    el_uring_read,
+    el_uring_writev,
+    el_uring_close
+};
@@ -0,0 +1,108 @@
+/*
+ * Push/pop throughput of the heapq layouts against the generic minheap_t, and
+ * of loading all the items at once with a heapify.
+ *
+ * Usage: ./bench_heap [number of items, default 1000000]
+ */
+#include "../src/rr_ftmacro.h"
+#include "../src/rr_minheap.h"
+#include "../src/rr_heap.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Same shape as hq_item_t */
+typedef struct item_t {
+    double score;
+    void *obj;
+} item_t;
+
+#define ITEM_LESS(l, r) ((l)->score < (r)->score)
+
+HEAP_HEAD(item_heap, item_t)
+HEAP_GENERATE_ARITY(bheap, item_heap, item_t, ITEM_LESS, 2)
+HEAP_GENERATE_ARITY(dheap, item_heap, item_t, ITEM_LESS, 4)
+
+static void *item_cpy(void *dst, const void *src) {
+    *(item_t *) dst = *(const item_t *) src;
+    return dst;
+}
+
+static int item_cmp(const void *lv, const void *rv) {
+    const item_t *l = lv, *r = rv;
+    return l->score < r->score ? -1 : l->score > r->score;
+}
+
+static void item_swp(void *lv, void *rv) {
+    item_t tmp = *(item_t *) lv;
+    *(item_t *) lv = *(item_t *) rv;
+    *(item_t *) rv = tmp;
+}
+
+static double now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, unsigned long n, double push, double pop) {
+    printf("%-10s push: %8.2f Mops/s  pop: %8.2f Mops/s\n",
+        name, n / push / 1e6, n / pop / 1e6);
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long i, n = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    item_t *items = malloc(sizeof(item_t) * n), out;
+    item_heap_t h;
+    minheap_t *mh;
+    double t0, t1, t2;
+
+    srand(42);
+    for (i = 0; i < n; i++) {
+        items[i].score = rand();
+        items[i].obj = NULL;
+    }
+    printf("%lu items\n", n);
+
+    mh = minheap_create(8, sizeof(item_t), item_cmp, item_cpy, item_swp);
+    t0 = now();
+    for (i = 0; i < n; i++) minheap_push(mh, &items[i]);
+    t1 = now();
+    while (minheap_pop(mh) != NULL);
+    t2 = now();
+    minheap_free(mh);
+    report("minheap", n, t1 - t0, t2 - t1);
+
+    bheap_init(&h, 8);
+    t0 = now();
+    for (i = 0; i < n; i++) bheap_push(&h, &items[i]);
+    t1 = now();
+    while (!bheap_pop(&h, &out));
+    t2 = now();
+    bheap_release(&h);
+    report("binary", n, t1 - t0, t2 - t1);
+
+    dheap_init(&h, 8);
+    t0 = now();
+    for (i = 0; i < n; i++) dheap_push(&h, &items[i]);
+    t1 = now();
+    while (!dheap_pop(&h, &out));
+    t2 = now();
+    dheap_release(&h);
+    report("4-ary", n, t1 - t0, t2 - t1);
+
+    dheap_init(&h, 8);
+    t0 = now();
+    for (i = 0; i < n; i++) dheap_append(&h, &items[i]);
+    dheap_heapify(&h);
+    t1 = now();
+    while (!dheap_pop(&h, &out));
+    t2 = now();
+    dheap_release(&h);
+    report("4-ary bulk", n, t1 - t0, t2 - t1);
+
+    free(items);
+    return 0;
+}
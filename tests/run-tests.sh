@@ -9,16 +9,23 @@ if [[ ! -d venv ]]; then
     pip install -r requirements.txt
 fi
 
-echo ""
-echo "Starting server..."
-cd ../src && ./${rr} > /dev/null 2>&1 &
+# The suite runs once more with the I/O threads, so that the clients are read
+# and written by them, once with the keys spread over several reactors, and
+# once with the client I/O going through io_uring
+for options in "" "--io_threads 4" "--reactors 2" "--event_backend io_uring"; do
+    echo ""
+    echo "Starting server ${options}..."
+    (cd ../src && ./${rr} rhino-rox.ini ${options} > /dev/null 2>&1 &)
+    sleep 1
 
-echo "Running tests..."
-cd ../tests && source venv/bin/activate && nosetests && deactivate
+    echo "Running tests..."
+    source venv/bin/activate && nosetests && deactivate
 
-echo "Shutting down server..."
-if [[ ! -z ${pidfile} ]]; then
-    kill -TERM $(cat ${pidfile})
-else
-    pkill -TERM ${rr}
-fi
+    echo "Shutting down server..."
+    if [[ ! -z ${pidfile} ]]; then
+        kill -TERM $(cat ${pidfile})
+    else
+        pkill -TERM ${rr}
+    fi
+    sleep 1
+done
@@ -1,5 +1,9 @@
 import unittest
 import redis
+import random
+import socket
+import threading
+import time
 
 
 class TestCmdDB(unittest.TestCase):
@@ -9,6 +13,10 @@ class TestCmdDB(unittest.TestCase):
         self.rr.execute_command("del foo")
         self.rr.execute_command("del egg")
         self.rr.execute_command("del apple")
+        for i in range(50):
+            self.rr.execute_command("del key%d" % i)
+        for i in range(16):
+            self.rr.execute_command("del egg%d" % i)
 
     def test_basic_cmds(self):
         self.rr.set("foo", "bar")
@@ -34,3 +42,182 @@ class TestCmdDB(unittest.TestCase):
 
         ret = self.rr.exists("foo")
         self.assertFalse(ret)
+
+    def test_large_values(self):
+        # values larger than the reply chunks are sent from the value itself
+        big = "x" * (1024 * 1024)
+        self.rr.set("foo", big)
+        self.rr.set("egg", "spam")
+        pipe = self.rr.pipeline(transaction=False)
+        for _ in range(4):
+            pipe.get("foo")
+            pipe.get("egg")
+        pipe.delete("foo")
+        ret = pipe.execute()
+        self.assertListEqual(ret, [big, "spam"] * 4 + [1])
+        self.assertIsNone(self.rr.get("foo"))
+
+    def test_reused_arguments(self):
+        # the argument objects are reused, but not the ones kept as values
+        values = ["v" * n for n in range(1, 50)]
+        pipe = self.rr.pipeline(transaction=False)
+        for i, v in enumerate(values):
+            pipe.set("foo", i)
+            pipe.set("egg", v)
+            pipe.get("egg")
+        ret = pipe.execute()
+        self.assertListEqual(ret, sum([[True, True, v] for v in values], []))
+        self.assertEqual(self.rr.get("foo"), str(len(values) - 1))
+        self.assertEqual(self.rr.get("egg"), values[-1])
+
+    def test_concurrent_pipelines(self):
+        # enough clients with pending replies at once for the I/O threads to
+        # take over the reads and writes, when the server runs with them
+        big = "y" * (256 * 1024)
+        self.rr.set("foo", big)
+        errors = []
+
+        def client(i):
+            rr = redis.Redis("localhost", 6000)
+            try:
+                for j in range(5):
+                    pipe = rr.pipeline(transaction=False)
+                    for k in range(50):
+                        pipe.set("egg%d" % i, "%d-%d" % (j, k))
+                        pipe.get("egg%d" % i)
+                        pipe.get("foo")
+                    ret = pipe.execute()
+                    expected = []
+                    for k in range(50):
+                        expected += [True, "%d-%d" % (j, k), big]
+                    if ret != expected:
+                        errors.append(i)
+                        return
+            finally:
+                rr.execute_command("del egg%d" % i)
+
+        threads = [threading.Thread(target=client, args=(i,)) for i in range(16)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertListEqual(errors, [])
+
+    def test_deep_pipelines(self):
+        # pipelines deeper than a batch of commands parsed ahead, than a read
+        # and than the output buffer, with a value written from the reply list
+        # in the middle, and a protocol error at the end, from enough clients
+        # for the I/O threads to take over when the server runs with them
+        big = "b" * (64 * 1024)
+        self.rr.set("foo", big)
+        value = "v" * 500
+
+        def pipeline(key):
+            query, expected = [], []
+            for i in range(1500):
+                query.append("*3\r\n$3\r\nset\r\n$%d\r\n%s\r\n$%d\r\n%s%03d\r\n" %
+                             (len(key), key, len(value) + 3, value, i % 1000))
+                query.append("*2\r\n$3\r\nget\r\n$%d\r\n%s\r\n" % (len(key), key))
+                expected.append("+OK\r\n$%d\r\n%s%03d\r\n" % (len(value) + 3, value, i % 1000))
+                if i == 700:
+                    query.append("get foo\r\n")
+                    expected.append("$%d\r\n%s\r\n" % (len(big), big))
+            query.append("*1\r\n$-x\r\n")
+            expected.append("-ERR Protocol error: invalid bulk length\r\n")
+            return "".join(query), "".join(expected)
+
+        errors = []
+
+        def client(i):
+            query, expected = pipeline("egg%d" % i)
+            s = socket.create_connection(("localhost", 6000))
+            s.sendall(query)
+            replies = []
+            while True:
+                data = s.recv(65536)
+                if not data:
+                    break
+                replies.append(data)
+            s.close()
+            if "".join(replies) != expected:
+                errors.append(i)
+
+        threads = [threading.Thread(target=client, args=(i,)) for i in range(16)]
+        for t in threads:
+            t.start()
+        for t in threads:
+            t.join()
+        self.assertListEqual(errors, [])
+
+    def test_scan(self):
+        self.rr.set("foo", "bar")
+        self.rr.set("egg", "spam")
+        self.rr.set("apple", "orange")
+
+        ret = self.rr.execute_command("scan", "", "count", 2)
+        self.assertListEqual(ret, ["egg", ["apple", "egg"]])
+        ret = self.rr.execute_command("scan", "egg", "count", 2)
+        self.assertListEqual(ret, ["", ["foo"]])
+        ret = self.rr.execute_command("scan", "", "match", "f")
+        self.assertListEqual(ret, ["", ["foo"]])
+
+    def test_keys_of_all_reactors(self):
+        # with several reactors, the keys are spread over them and the
+        # commands without keys gather what all of them have
+        keys = ["key%d" % i for i in range(50)]
+        pipe = self.rr.pipeline(transaction=False)
+        for k in keys:
+            pipe.set(k, k.upper())
+        for k in keys:
+            pipe.get(k)
+        ret = pipe.execute()
+        self.assertListEqual(ret, [True] * 50 + [k.upper() for k in keys])
+        self.assertEqual(self.rr.execute_command("len"), 50)
+
+        found, cursor = [], ""
+        while True:
+            cursor, batch = self.rr.execute_command("scan", cursor, "count", 7)
+            self.assertLessEqual(len(batch), 7)
+            found += batch
+            if not cursor:
+                break
+        self.assertListEqual(found, sorted(keys))
+        ret = self.rr.execute_command("scan", "", "match", "key4", "count", 20)
+        self.assertListEqual(ret, ["", ["key4"] + ["key4%d" % i for i in range(10)]])
+        ret = self.rr.execute_command("scan", "", "match", "key4")
+        self.assertListEqual(ret, ["key48", ["key4"] + ["key4%d" % i for i in range(9)]])
+        with self.assertRaises(redis.ResponseError):
+            self.rr.execute_command("scan", "", "count", 0)
+
+    def test_split_pipeline(self):
+        # the parser resumes wherever the reads of a pipeline end, be it in
+        # the middle of a big argument, of an inline command or of an error
+        big = "z" * (40 * 1024)
+        query = ("*3\r\n$3\r\nset\r\n$3\r\nfoo\r\n$%d\r\n%s\r\n" % (len(big), big) +
+                 "exists foo\n" +
+                 "set egg  spam\n" +
+                 "*2\r\n$3\r\nget\r\n$3\r\negg\r\n" +
+                 "*2\r\n$3\r\nget\r\n$3\r\nfoo\r\n" +
+                 "*2\r\n$3\r\nget\r\nx3\r\nfoo\r\n" +
+                 "*1\r\n$4\r\nping\r\n")
+        expected = ("+OK\r\n:1\r\n+OK\r\n$4\r\nspam\r\n$%d\r\n%s\r\n" % (len(big), big) +
+                    "-ERR Protocol error: expected '$', got 'x'\r\n")
+        rnd = random.Random(42)
+        for _ in range(5):
+            s = socket.create_connection(("localhost", 6000))
+            s.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+            pos = 0
+            while pos < len(query):
+                n = rnd.choice([1, 2, 3, rnd.randint(1, 8192)])
+                s.sendall(query[pos:pos + n])
+                pos += n
+                time.sleep(0.0005)
+            # the connection is closed once the error is replied
+            replies = ""
+            while True:
+                data = s.recv(65536)
+                if not data:
+                    break
+                replies += data
+            s.close()
+            self.assertEqual(replies, expected)
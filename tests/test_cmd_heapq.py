@@ -1,6 +1,8 @@
 import unittest
 import redis
 import random
+import threading
+import time
 
 
 class TestHeadpCmd(unittest.TestCase):
@@ -52,6 +54,277 @@ class TestHeadpCmd(unittest.TestCase):
         length = self.rr.execute_command("qlen test")
         self.assertEqual(length, 0)
 
+    def test_member_cmds(self):
+        self._load_heap()
+        ret = self.rr.execute_command("qscore test v4")
+        self.assertEqual(float(ret), 1.5)
+        ret = self.rr.execute_command("qscore test nope")
+        self.assertIsNone(ret)
+
+        ret = self.rr.execute_command("qupdate test v2 0.5")
+        self.assertEqual(ret, 1)
+        ret = self.rr.execute_command("qupdate test nope 0.5")
+        self.assertEqual(ret, 0)
+        ret = self.rr.execute_command("qpeek test")
+        self.assertEqual(ret, "v2")
+
+        ret = self.rr.execute_command("qrem test v2")
+        self.assertEqual(ret, 1)
+        ret = self.rr.execute_command("qrem test v2")
+        self.assertEqual(ret, 0)
+
+        # members are unique, pushing an existing one updates its score
+        self.rr.execute_command("qpush test 3 v1")
+        length = self.rr.execute_command("qlen test")
+        self.assertEqual(length, 3)
+        ret = self.rr.execute_command("qpopn test 3")
+        self.assertListEqual(ret, ["v4", "v3", "v1"])
+
+    def test_blocking_pop(self):
+        self._load_heap()
+        ret = self.rr.execute_command("bqpop nope test 0")
+        self.assertListEqual(ret, ["test", "v1"])
+        ret = self.rr.execute_command("bqpop nope 0.1")
+        self.assertIsNone(ret)
+
+        # wake up once another client pushes
+        pusher = redis.Redis("localhost", 6000)
+        timer = threading.Timer(
+            0.1, pusher.execute_command, ["qpush test2 1 job"])
+        timer.start()
+        ret = self.rr.execute_command("bqpop nope test2 5")
+        timer.join()
+        self.assertListEqual(ret, ["test2", "job"])
+        length = self.rr.execute_command("qlen test2")
+        self.assertEqual(length, 0)
+
+    def test_batch_push(self):
+        self.rr.execute_command("qpush test 10 v0")
+        self.rr.execute_command("qpushn test 4 v2 2 v3 1.5 v4 1 v1 5 v0")
+        length = self.rr.execute_command("qlen test")
+        self.assertEqual(length, 5)
+        ret = self.rr.execute_command("qpopn test 5")
+        self.assertListEqual(ret, ["v1", "v4", "v3", "v2", "v0"])
+
+        with self.assertRaises(redis.ResponseError):
+            self.rr.execute_command("qpushn test 1 v1 2")
+        with self.assertRaises(redis.ResponseError):
+            self.rr.execute_command("qpushn test 1 v1 x v2")
+        length = self.rr.execute_command("qlen test")
+        self.assertEqual(length, 0)
+
+        _N = 10000
+        input = range(_N)
+        random.shuffle(input)
+        args = []
+        for item in input:
+            args += [item, item]
+        self.rr.execute_command("qpush test -1 first")
+        self.rr.execute_command("qpushn", "test", *args)
+        ret = self.rr.execute_command("qpopn test %d" % (_N + 1))
+        self.assertListEqual(ret, ["first"] + ["%d" % i for i in range(_N)])
+
+    def test_merge(self):
+        self._load_heap()
+        self.rr.execute_command("qpushn test2 3 w1 0.5 w2 2.5 v2")
+        # v2 is in both, it's only updated
+        ret = self.rr.execute_command("qmerge test test2")
+        self.assertEqual(ret, 2)
+        self.assertEqual(self.rr.execute_command("exists test2"), 0)
+        ret = self.rr.execute_command("qpopn test 10")
+        self.assertListEqual(ret, ["w2", "v1", "v4", "v3", "v2", "w1"])
+
+        ret = self.rr.execute_command("qmerge test nope")
+        self.assertEqual(ret, 0)
+        with self.assertRaises(redis.ResponseError):
+            self.rr.execute_command("qmerge test test")
+
+        # the leased members stay behind
+        self.rr.execute_command("qpushn test2 1 a 2 b")
+        self.rr.execute_command("qlease test2 1 10000")
+        ret = self.rr.execute_command("qmerge test test2")
+        self.assertEqual(ret, 1)
+        self.assertEqual(self.rr.execute_command("exists test2"), 1)
+        self.assertEqual(self.rr.execute_command("qlen test2"), 0)
+        self.rr.execute_command("del test2")
+
+        # only the members kept by the cap count
+        self.rr.execute_command("qcreate capped cap 2")
+        self.rr.execute_command("qpushn test2 1 a 2 b 3 c 4 d")
+        ret = self.rr.execute_command("qmerge capped test2")
+        self.assertEqual(ret, 2)
+        self.assertListEqual(self.rr.execute_command("qpopn capped 10"), ["c", "d"])
+        self.rr.execute_command("del capped")
+
+    def test_merge_steps(self):
+        # nothing to merge into, test2 is renamed along with its timer
+        self.rr.execute_command("qpushat test2 %d 0 later" % (time.time() * 1000 + 100))
+        ret = self.rr.execute_command("qmerge test3 test2")
+        self.assertEqual(ret, 1)
+        self.assertEqual(self.rr.execute_command("exists test2"), 0)
+        ret = self.rr.execute_command("bqpop test3 5")
+        self.assertListEqual(ret, ["test3", "later"])
+
+        # the members move in steps, capped test2 keeps the highest ones
+        _N = 5000
+        args = []
+        for i in range(_N):
+            args += [i, "m%d" % i]
+        self.rr.execute_command("qpushn", "test3", *args)
+        self.rr.execute_command("qcreate test2 cap 100")
+        self.rr.execute_command("qpush test2 %d top" % _N)
+        ret = self.rr.execute_command("qmerge test2 test3")
+        self.assertEqual(ret, 99)
+        self.assertEqual(self.rr.execute_command("qlen test2"), 100)
+        self.assertEqual(self.rr.execute_command("exists test3"), 0)
+        self.rr.execute_command("del test2")
+
+        self.rr.execute_command("qpushn", "test3", *args)
+        self.rr.execute_command("qpush test -1 first")
+        ret = self.rr.execute_command("qmerge test test3")
+        self.assertEqual(ret, _N)
+        ret = self.rr.execute_command("qpopn test %d" % (_N + 1))
+        self.assertListEqual(ret, ["first"] + ["m%d" % i for i in range(_N)])
+
+    def test_merge_keys_of_all_reactors(self):
+        # some of the pairs belong to different reactors when there are some
+        for i in range(8):
+            self.rr.execute_command("qpushn src%d 1 a 2 b" % i)
+            self.rr.execute_command("qpush dst%d 1.5 c" % i)
+            ret = self.rr.execute_command("qmerge dst%d src%d" % (i, i))
+            self.assertEqual(ret, 2)
+            self.assertEqual(self.rr.execute_command("exists src%d" % i), 0)
+            ret = self.rr.execute_command("qpopn dst%d 5" % i)
+            self.assertListEqual(ret, ["a", "c", "b"])
+
+    def test_blocking_pop_keys_of_all_reactors(self):
+        keys = ["wait%d" % i for i in range(8)]
+        ret = self.rr.execute_command("bqpop", *(keys + [0.1]))
+        self.assertIsNone(ret)
+
+        self.rr.execute_command("qpush wait5 1 five")
+        self.rr.execute_command("qpush wait7 1 seven")
+        ret = self.rr.execute_command("bqpop", *(keys + [0]))
+        self.assertListEqual(ret, ["wait5", "five"])
+
+        pusher = redis.Redis("localhost", 6000)
+        timer = threading.Timer(
+            0.1, pusher.execute_command, ["qpush wait2 1 two"])
+        timer.start()
+        ret = self.rr.execute_command("bqpop", *(keys[:5] + [5]))
+        timer.join()
+        self.assertListEqual(ret, ["wait2", "two"])
+        self.assertEqual(self.rr.execute_command("qlen wait7"), 1)
+        self.rr.execute_command("del wait7")
+
+    def test_score_range(self):
+        self._load_heap()
+        ret = self.rr.execute_command("qcount test 1 2")
+        self.assertEqual(ret, 3)
+        ret = self.rr.execute_command("qcount test (1 +inf")
+        self.assertEqual(ret, 3)
+        ret = self.rr.execute_command("qrangebyscore test -inf (4")
+        self.assertListEqual(ret, ["v1", "v4", "v3"])
+        ret = self.rr.execute_command(
+            "qrangebyscore test 1.5 4 withscores limit 2")
+        self.assertListEqual(ret[0::2], ["v4", "v3"])
+        self.assertListEqual([float(s) for s in ret[1::2]], [1.5, 2])
+        with self.assertRaises(redis.ResponseError):
+            self.rr.execute_command("qcount test x 2")
+        self.assertEqual(self.rr.execute_command("qcount nope 1 2"), 0)
+
+        # the index follows the changes of the heapq
+        self.rr.execute_command("qpop test")
+        self.rr.execute_command("qupdate test v2 1.8")
+        self.rr.execute_command("qpushn test 1.9 v5 0 v6")
+        ret = self.rr.execute_command("qrangebyscore test 1 2")
+        self.assertListEqual(ret, ["v4", "v2", "v5", "v3"])
+        self.rr.execute_command("qrem test v2")
+        ret = self.rr.execute_command("qcount test -inf +inf")
+        self.assertEqual(ret, 4)
+
+    def test_capped(self):
+        self.rr.execute_command("qcreate test cap 3")
+        for i in range(100):
+            self.rr.execute_command("qpush test %d v%d" % (i % 10, i))
+        length = self.rr.execute_command("qlen test")
+        self.assertEqual(length, 3)
+        # ties don't evict, and are ordered by member
+        ret = self.rr.execute_command("qtopk test withscores")
+        self.assertListEqual(ret[0::2], ["v19", "v29", "v9"])
+        self.assertListEqual([float(s) for s in ret[1::2]], [9, 9, 9])
+
+        # shrinking the cap evicts the lowest members
+        self.rr.execute_command("qpush test 0.5 v29")
+        self.rr.execute_command("qcreate test cap 2")
+        ret = self.rr.execute_command("qtopk test")
+        self.assertListEqual(ret, ["v19", "v9"])
+        with self.assertRaises(redis.ResponseError):
+            self.rr.execute_command("qcreate test cap 0")
+        with self.assertRaises(redis.ResponseError):
+            self.rr.execute_command("qcreate test size 2")
+
+        # without a cap the heapq is unbounded again
+        self.rr.execute_command("qcreate test")
+        self.rr.execute_command("qpushn test 1 a 2 b 3 c")
+        ret = self.rr.execute_command("qtopk test")
+        self.assertListEqual(ret, ["v19", "v9", "c", "b", "a"])
+
+    def test_lease(self):
+        self._load_heap()
+        ret = self.rr.execute_command("qlease test 2 200")
+        self.assertListEqual(ret[1::2], ["v1", "v4"])
+        ids = ret[0::2]
+        length = self.rr.execute_command("qlen test")
+        self.assertEqual(length, 2)
+
+        ret = self.rr.execute_command("qack test %s nope" % ids[0])
+        self.assertEqual(ret, 1)
+        ret = self.rr.execute_command("qack test %s" % ids[0])
+        self.assertEqual(ret, 0)
+        ret = self.rr.execute_command("qlease nope 2 200")
+        self.assertListEqual(ret, [])
+        with self.assertRaises(redis.ResponseError):
+            self.rr.execute_command("qlease test 2 0")
+
+        # v4 is pushed back with its score once the lease expires
+        time.sleep(0.5)
+        ret = self.rr.execute_command("qpopn test 3")
+        self.assertListEqual(ret, ["v4", "v3", "v2"])
+        ret = self.rr.execute_command("qack test %s" % ids[1])
+        self.assertEqual(ret, 0)
+
+    def test_delayed_push(self):
+        now = int(time.time() * 1000)
+        self.rr.execute_command("qpushat test %d 2 later" % (now + 200))
+        self.rr.execute_command("qpushat test %d 3 past" % (now - 1000))
+        self.rr.execute_command("qpush test 1 ready")
+        length = self.rr.execute_command("qlen test")
+        self.assertEqual(length, 2)
+        ret = self.rr.execute_command("qpopn test 10")
+        self.assertListEqual(ret, ["ready", "past"])
+        self.assertIsNone(self.rr.execute_command("qpop test"))
+
+        # promoted by the timer, waking up the blocked clients
+        ret = self.rr.execute_command("bqpop test 5")
+        self.assertListEqual(ret, ["test", "later"])
+        self.assertGreaterEqual(time.time() * 1000, now + 200)
+
+    def test_qpushat_earlier(self):
+        # every earlier push replaces the armed timer
+        now = int(time.time() * 1000)
+        for delay in (100000, 400, 300, 150):
+            self.rr.execute_command("qpushat test %d %d m%d" % (now + delay, delay, delay))
+        ret = self.rr.execute_command("bqpop test 5")
+        self.assertListEqual(ret, ["test", "m150"])
+        self.assertGreaterEqual(time.time() * 1000, now + 150)
+        ret = self.rr.execute_command("bqpop test 5")
+        self.assertListEqual(ret, ["test", "m300"])
+        ret = self.rr.execute_command("bqpop test 5")
+        self.assertListEqual(ret, ["test", "m400"])
+        self.assertGreaterEqual(time.time() * 1000, now + 400)
+        self.assertEqual(self.rr.execute_command("qlen test"), 0)
+
     def test_pressure_test(self):
         _N = 10000
         input = range(_N)
@@ -1,6 +1,8 @@
 import unittest
 import redis
 import random
+import socket
+import time
 
 
 class TestTrieCmd(unittest.TestCase):
@@ -36,6 +38,9 @@ class TestTrieCmd(unittest.TestCase):
         self.assertListEqual(ret, ["ape", "3", "apolo", "4", "apple", "2",
                                    "apply", "1"])
 
+        ret = self.rr.execute_command("rpget trie b")
+        self.assertListEqual(ret, [])
+
     def test_iterator(self):
         self.rr.execute_command("rset trie apply 1")
         self.rr.execute_command("rset trie apple 2")
@@ -50,6 +55,110 @@ class TestTrieCmd(unittest.TestCase):
         ret = self.rr.execute_command("rgetall trie")
         self.assertListEqual(ret, ["ape", "3", "apple", "2", "apply", "1"])
 
+    def test_scan(self):
+        for i in range(100):
+            self.rr.execute_command("rset trie key:%03d %d" % (i, i))
+        self.rr.execute_command("rset trie other 1")
+
+        cursor, ret = "", []
+        while True:
+            cursor, kvs = self.rr.execute_command(
+                "rscan", "trie", cursor, "count", 7)
+            self.assertLessEqual(len(kvs), 14)
+            ret.extend(kvs)
+            if cursor == "":
+                break
+        self.assertListEqual(ret, self.rr.execute_command("rgetall trie"))
+
+        cursor, kvs = self.rr.execute_command(
+            "rscan", "trie", "key:050", "match", "key:", "count", 3)
+        self.assertEqual(cursor, "key:053")
+        self.assertListEqual(kvs, ["key:051", "51", "key:052", "52",
+                                   "key:053", "53"])
+
+        cursor, kvs = self.rr.execute_command(
+            "rscan", "trie", "", "match", "key:09", "count", 100)
+        self.assertEqual(cursor, "")
+        self.assertEqual(len(kvs), 20)
+
+        ret = self.rr.execute_command("rscan", "nokey", "")
+        self.assertListEqual(ret, ["", []])
+
+    def test_range(self):
+        for key in ["ape", "app", "apple", "apply", "bob", "box"]:
+            self.rr.execute_command("rset trie %s %s" % (key, key.upper()))
+
+        ret = self.rr.execute_command("rrange trie [app (bob")
+        self.assertListEqual(ret, ["app", "APP", "apple", "APPLE",
+                                   "apply", "APPLY"])
+        ret = self.rr.execute_command("rrange trie (app [bob limit 2")
+        self.assertListEqual(ret, ["apple", "APPLE", "apply", "APPLY"])
+        ret = self.rr.execute_command("rrange trie [b +")
+        self.assertListEqual(ret, ["bob", "BOB", "box", "BOX"])
+        ret = self.rr.execute_command("rrange trie + -")
+        self.assertListEqual(ret, [])
+
+        ret = self.rr.execute_command("rrevrange trie [apz - limit 3")
+        self.assertListEqual(ret, ["apply", "APPLY", "apple", "APPLE",
+                                   "app", "APP"])
+        ret = self.rr.execute_command("rrevrange trie + (box")
+        self.assertListEqual(ret, [])
+
+    def test_rank(self):
+        for key in ["ape", "app", "apple", "apply", "bob", "box"]:
+            self.rr.execute_command("rset trie %s %s" % (key, key.upper()))
+
+        ret = self.rr.execute_command("rpcount trie ap")
+        self.assertEqual(ret, 4)
+        ret = self.rr.execute_command("rpcount trie c")
+        self.assertEqual(ret, 0)
+        ret = self.rr.execute_command("rpcount nokey a")
+        self.assertEqual(ret, 0)
+
+        ret = self.rr.execute_command("rrank trie apple")
+        self.assertEqual(ret, 2)
+        ret = self.rr.execute_command("rrank trie appl")
+        self.assertEqual(ret, None)
+
+        ret = self.rr.execute_command("rnth trie 4")
+        self.assertListEqual(ret, ["bob", "BOB"])
+        ret = self.rr.execute_command("rnth trie -1")
+        self.assertListEqual(ret, ["box", "BOX"])
+        ret = self.rr.execute_command("rnth trie 6")
+        self.assertEqual(ret, None)
+        ret = self.rr.execute_command("rnth nokey 0")
+        self.assertEqual(ret, None)
+
+    def test_slow_reader(self):
+        # a reply much larger than the socket buffers is written over many
+        # events, resuming from where the last partial write stopped
+        _N = 20000
+        pipe = self.rr.pipeline(transaction=False)
+        for i in range(_N):
+            pipe.execute_command("rset", "trie", "k%06d" % i, "%06d" % i * 32)
+        pipe.execute()
+
+        expected = ["*%d\r\n" % (_N * 2)]
+        for i in range(_N):
+            expected.append("$7\r\nk%06d\r\n$192\r\n%s\r\n" % (i, "%06d" % i * 32))
+        expected = "".join(expected)
+
+        s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        s.setsockopt(socket.SOL_SOCKET, socket.SO_RCVBUF, 4096)
+        s.connect(("localhost", 6000))
+        s.sendall("*2\r\n$7\r\nrgetall\r\n$4\r\ntrie\r\n")
+        reply = []
+        size = 0
+        while size < len(expected):
+            data = s.recv(16384)
+            if not data:
+                break
+            reply.append(data)
+            size += len(data)
+            time.sleep(0.001)
+        s.close()
+        self.assertEqual("".join(reply), expected)
+
     def test_pressure_test(self):
         inserted = dict()
         for i in range(10000):
@@ -109,6 +109,130 @@ MU_TEST(test_dict_iterator) {
     dict_free(d);
 }
 
+MU_TEST(test_dict_deep_iterator) {
+    dict_t *d;
+    dict_iterator_t iter;
+    char key[DICT_ITER_STACK_SIZE*4+1];
+    int i, n = DICT_ITER_STACK_SIZE*4;
+
+    /* Keys like "a", "aa", "aaa"... build up a tree as deep as its size,
+     * which forces the iterator stack to spill over to the heap */
+    d = dict_create();
+    for (i = 0; i < n; i++) {
+        memset(key, 'a', i+1);
+        key[i+1] = '\0';
+        dict_set(d, key, (void *)(unsigned long)(i+1));
+    }
+
+    dict_iter_init(d, &iter);
+    for (i = 0; dict_iter_hasnext(&iter); i++) {
+        dict_kv_t kv = dict_iter_next(&iter);
+        mu_assert_int_eq(i+1, strlen(kv.key));
+        mu_assert_int_eq(i+1, (unsigned long) kv.value);
+    }
+    mu_assert_int_eq(n, i);
+    dict_iter_release(&iter);
+
+    dict_iter_init_prefix(d, "aaaaaaaaaa", &iter);
+    for (i = 0; dict_iter_hasnext(&iter); i++) dict_iter_next(&iter);
+    mu_assert_int_eq(n-9, i);
+    dict_iter_release(&iter);
+
+    dict_iter_init_prefix(d, "b", &iter);
+    mu_check(!dict_iter_hasnext(&iter));
+    dict_iter_release(&iter);
+
+    dict_free(d);
+}
+
+MU_TEST(test_dict_iterator_from) {
+    dict_t *d;
+    dict_iterator_t iter;
+    int i, j;
+    const char *starts[] = {"", "a", "ape", "apex", "app", "appl", "applez",
+        "b", "bobbz", "boy", "boz", "z"};
+
+    d = dict_create();
+    for (i=0; pairs[i].key; i++)
+        dict_set(d, pairs[i].key, (void *) pairs[i].value);
+
+    /* Compare against a linear search on the ordered pairs */
+    for (i = 0; i < (int)(sizeof(starts)/sizeof(starts[0])); i++) {
+        for (j = 0; in_order_pairs[j].key; j++)
+            if (strcmp(in_order_pairs[j].key, starts[i]) >= 0) break;
+
+        dict_iter_init_from(d, starts[i], &iter);
+        for (; dict_iter_hasnext(&iter); j++) {
+            dict_kv_t kv = dict_iter_next(&iter);
+            mu_check(!strcmp(kv.key, in_order_pairs[j].key));
+        }
+        mu_check(in_order_pairs[j].key == NULL);
+        dict_iter_release(&iter);
+
+        /* and the reverse one */
+        for (j = 0; in_order_pairs[j].key; j++)
+            if (strcmp(in_order_pairs[j].key, starts[i]) > 0) break;
+
+        dict_iter_init_rev_from(d, starts[i], &iter);
+        for (j--; dict_iter_hasnext(&iter); j--) {
+            dict_kv_t kv = dict_iter_next(&iter);
+            mu_check(!strcmp(kv.key, in_order_pairs[j].key));
+        }
+        mu_assert_int_eq(-1, j);
+        dict_iter_release(&iter);
+    }
+
+    dict_iter_init_rev(d, &iter);
+    for (j = 8; dict_iter_hasnext(&iter); j--) {
+        dict_kv_t kv = dict_iter_next(&iter);
+        mu_check(!strcmp(kv.key, in_order_pairs[j].key));
+    }
+    mu_assert_int_eq(-1, j);
+    dict_iter_release(&iter);
+
+    dict_free(d);
+}
+
+MU_TEST(test_dict_rank) {
+    dict_t *d;
+    dict_kv_t kv;
+    unsigned long rank;
+    int i;
+
+    d = dict_create();
+    for (i=0; pairs[i].key; i++)
+        dict_set(d, pairs[i].key, (void *) pairs[i].value);
+
+    for (i=0; in_order_pairs[i].key; i++) {
+        mu_check(dict_rank(d, in_order_pairs[i].key, &rank));
+        mu_assert_int_eq(i, rank);
+        mu_check(dict_nth(d, i, &kv));
+        mu_check(!strcmp(kv.key, in_order_pairs[i].key));
+    }
+    mu_check(!dict_nth(d, i, &kv));
+    mu_check(!dict_rank(d, "appl", &rank));
+    mu_check(!dict_rank(d, "zoo", &rank));
+
+    mu_assert_int_eq(9, dict_count_prefix(d, ""));
+    mu_assert_int_eq(5, dict_count_prefix(d, "ap"));
+    mu_assert_int_eq(3, dict_count_prefix(d, "appl"));
+    mu_assert_int_eq(2, dict_count_prefix(d, "bob"));
+    mu_assert_int_eq(0, dict_count_prefix(d, "c"));
+
+    /* The counts have to follow the deletes too */
+    dict_del(d, "apple");
+    dict_del(d, "bob");
+    mu_assert_int_eq(2, dict_count_prefix(d, "appl"));
+    mu_assert_int_eq(1, dict_count_prefix(d, "bob"));
+    mu_check(dict_rank(d, "bobby", &rank));
+    mu_assert_int_eq(4, rank);
+    mu_check(dict_nth(d, 6, &kv));
+    mu_check(!strcmp(kv.key, "boy"));
+    mu_check(!dict_nth(d, 7, &kv));
+
+    dict_free(d);
+}
+
 MU_TEST(test_dict_copy) {
     dict_t *d, *s;
     s = dict_create();
@@ -129,6 +253,9 @@ MU_TEST(test_dict_copy) {
 MU_TEST_SUITE(test_suite) {
     MU_RUN_TEST(test_dict_basic);
     MU_RUN_TEST(test_dict_iterator);
+    MU_RUN_TEST(test_dict_deep_iterator);
+    MU_RUN_TEST(test_dict_iterator_from);
+    MU_RUN_TEST(test_dict_rank);
     MU_RUN_TEST(test_dict_copy);
 }
 
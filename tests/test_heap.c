@@ -0,0 +1,143 @@
+#include "minunit.h"
+#include "../src/rr_heap.h"
+#include "../src/rr_rhino_rox.h"
+
+#include <stdlib.h>
+
+#define INT_LESS(l, r) (*(l) < *(r))
+
+HEAP_HEAD(int_heap, int)
+HEAP_GENERATE(int_heap, int, INT_LESS)
+HEAP_GENERATE_ARITY(int_dheap, int_heap, int, INT_LESS, 4)
+
+/* Pop everything and check the order */
+static int drain_ordered(int_heap_t *h, int dary) {
+    int v, last = -1, ordered = 1;
+
+    while (!(dary ? int_dheap_pop(h, &v) : int_heap_pop(h, &v))) {
+        if (v < last) ordered = 0;
+        last = v;
+    }
+    return ordered;
+}
+
+MU_TEST(test_heap_basic) {
+    int_heap_t h;
+    int v;
+
+    int_heap_init(&h, 0);
+    mu_check(int_heap_min(&h) == NULL);
+    mu_check(int_heap_pop(&h, &v) == -1);
+
+    v = 3; int_heap_push(&h, &v);
+    v = 1; int_heap_push(&h, &v);
+    v = 2; int_heap_push(&h, &v);
+    mu_assert_int_eq(3, int_heap_len(&h));
+    mu_assert_int_eq(1, *int_heap_min(&h));
+
+    mu_check(!int_heap_pop(&h, &v));
+    mu_assert_int_eq(1, v);
+    mu_check(!int_heap_pop(&h, &v));
+    mu_assert_int_eq(2, v);
+    mu_check(!int_heap_pop(&h, &v));
+    mu_assert_int_eq(3, v);
+    mu_assert_int_eq(0, int_heap_len(&h));
+
+    int_heap_release(&h);
+}
+
+MU_TEST(test_heap_random) {
+    int_heap_t h;
+    int i, v;
+
+    srand(42);
+    int_heap_init(&h, 4);
+    for (i = 0; i < 10000; i++) {
+        v = rand() % 1000;
+        int_heap_push(&h, &v);
+    }
+    /* interleave some pops and pushes */
+    for (i = 0; i < 5000; i++) {
+        int_heap_pop(&h, &v);
+        v = rand() % 1000;
+        int_heap_push(&h, &v);
+    }
+    mu_assert_int_eq(10000, int_heap_len(&h));
+
+    mu_check(drain_ordered(&h, 0));
+    mu_assert_int_eq(0, int_heap_len(&h));
+    int_heap_release(&h);
+}
+
+MU_TEST(test_heap_dary) {
+    int_heap_t h;
+    int i, v;
+
+    int_dheap_init(&h, 1);
+    for (i = 0; i < 10000; i++) {
+        v = rand() % 1000;
+        int_dheap_push(&h, &v);
+    }
+    mu_check(((unsigned long) &h.items[1]) % HEAP_CACHELINE == 0);
+    for (i = 0; i < 5000; i++) {
+        int_dheap_pop(&h, &v);
+        v = rand() % 1000;
+        int_dheap_push(&h, &v);
+    }
+    mu_assert_int_eq(10000, int_heap_len(&h));
+    mu_check(drain_ordered(&h, 1));
+    int_heap_release(&h);
+}
+
+MU_TEST(test_heap_heapify) {
+    int_heap_t h;
+    int i, v;
+
+    /* Build a binary heap and switch it to the 4-ary layout */
+    int_heap_init(&h, 0);
+    for (i = 0; i < 1000; i++) {
+        v = rand() % 100;
+        int_heap_push(&h, &v);
+    }
+    int_dheap_heapify(&h);
+    mu_check(drain_ordered(&h, 1));
+
+    /* Any unordered array */
+    for (i = 0; i < 777; i++) {
+        v = rand() % 100;
+        int_heap_push(&h, &v);
+    }
+    for (i = 0; i < 777; i++)
+        h.items[i] = rand() % 100;
+    int_heap_heapify(&h);
+    mu_check(drain_ordered(&h, 0));
+
+    /* A batch of appends on top of a heap */
+    for (i = 0; i < 100; i++) {
+        v = rand() % 100;
+        int_dheap_push(&h, &v);
+    }
+    for (i = 0; i < 5000; i++) {
+        v = rand() % 100;
+        int_dheap_append(&h, &v);
+    }
+    mu_assert_int_eq(5100, int_heap_len(&h));
+    int_dheap_heapify(&h);
+    mu_check(drain_ordered(&h, 1));
+    int_heap_release(&h);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_RUN_TEST(test_heap_basic);
+    MU_RUN_TEST(test_heap_random);
+    MU_RUN_TEST(test_heap_dary);
+    MU_RUN_TEST(test_heap_heapify);
+}
+
+int main(int argc, char *argv[]) {
+    UNUSED(argc);
+    UNUSED(argv);
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return 0;
+}
@@ -0,0 +1,105 @@
+#include "minunit.h"
+#include "../src/rr_skiplist.h"
+#include "../src/rr_rhino_rox.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N 2000
+
+static char members[N][16];
+static double scores[N];
+static int present[N];
+
+/* Count the present members in the range the slow way */
+static unsigned long count_slow(const skiplist_range_t *range) {
+    unsigned long count = 0;
+    int i;
+
+    for (i = 0; i < N; i++) {
+        if (!present[i]) continue;
+        if (range->minex ? scores[i] <= range->min : scores[i] < range->min)
+            continue;
+        if (range->maxex ? scores[i] >= range->max : scores[i] > range->max)
+            continue;
+        count++;
+    }
+    return count;
+}
+
+MU_TEST(test_skiplist_basic) {
+    skiplist_t *sl = skiplist_create();
+    skiplist_range_t range = {1, 2, 0, 0};
+    skiplist_node_t *node;
+
+    mu_check(skiplist_first_in_range(sl, &range) == NULL);
+    mu_assert_int_eq(0, skiplist_count_range(sl, &range));
+
+    skiplist_insert(sl, 2, "b");
+    skiplist_insert(sl, 1, "c");
+    skiplist_insert(sl, 1, "a");
+    skiplist_insert(sl, 3, "d");
+    mu_assert_int_eq(4, skiplist_len(sl));
+    mu_assert_int_eq(3, skiplist_count_range(sl, &range));
+
+    /* Ties are ordered by member */
+    node = skiplist_first_in_range(sl, &range);
+    mu_check(!strcmp("a", node->member));
+    node = skiplist_next(node);
+    mu_check(!strcmp("c", node->member));
+
+    range.minex = 1;
+    node = skiplist_first_in_range(sl, &range);
+    mu_check(!strcmp("b", node->member));
+    mu_assert_int_eq(1, skiplist_count_range(sl, &range));
+
+    mu_check(!skiplist_delete(sl, 2, "a"));
+    mu_check(skiplist_delete(sl, 1, "a"));
+    mu_check(skiplist_delete(sl, 3, "d"));
+    mu_assert_int_eq(2, skiplist_len(sl));
+    mu_check(!strcmp("b", sl->tail->member));
+    skiplist_free(sl);
+}
+
+MU_TEST(test_skiplist_random) {
+    skiplist_t *sl = skiplist_create();
+    skiplist_range_t range;
+    int i, j, matched = 1;
+
+    for (i = 0; i < N; i++) {
+        snprintf(members[i], sizeof(members[i]), "m%d", i);
+        scores[i] = rand() % 100;
+        present[i] = 1;
+        skiplist_insert(sl, scores[i], members[i]);
+    }
+    for (i = 0; i < N; i += 3) {
+        mu_check(skiplist_delete(sl, scores[i], members[i]));
+        present[i] = 0;
+    }
+    mu_assert_int_eq(N - (N + 2) / 3, skiplist_len(sl));
+
+    for (j = 0; j < 500; j++) {
+        range.min = rand() % 110 - 5;
+        range.max = range.min + rand() % 30;
+        range.minex = rand() % 2;
+        range.maxex = rand() % 2;
+        if (skiplist_count_range(sl, &range) != count_slow(&range))
+            matched = 0;
+    }
+    mu_check(matched);
+    skiplist_free(sl);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_RUN_TEST(test_skiplist_basic);
+    MU_RUN_TEST(test_skiplist_random);
+}
+
+int main(int argc, char *argv[]) {
+    UNUSED(argc);
+    UNUSED(argv);
+    MU_RUN_SUITE(test_suite);
+    MU_REPORT();
+    return 0;
+}
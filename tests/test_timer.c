@@ -0,0 +1,430 @@
+#include "../src/rr_ftmacro.h"
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "minunit.h"
+#include "../src/rr_event.h"
+#include "../src/rr_datetime.h"
+#include "../src/rr_rhino_rox.h"
+
+#define MAX_FIRED 64
+
+static int fired[MAX_FIRED];
+static long long fired_after[MAX_FIRED];
+static int nfired;
+static long long start;
+static int backend = RR_EV_BACKEND_DEFAULT;
+
+static void record(void *ud) {
+    if (nfired < MAX_FIRED) {
+        fired[nfired] = (int) (long) ud;
+        fired_after[nfired] = rr_dt_monotonic_ms() - start;
+    }
+    nfired++;
+}
+
+static int once(eventloop_t *el, void *ud) {
+    UNUSED(el);
+    record(ud);
+    return 0;
+}
+
+static int stop(eventloop_t *el, void *ud) {
+    UNUSED(ud);
+    el_loop_stop(el);
+    return 0;
+}
+
+static eventloop_t *setup(void) {
+    nfired = 0;
+    start = rr_dt_monotonic_ms();
+    return el_loop_create(16, backend);
+}
+
+MU_TEST(test_timer_order) {
+    static const int delays[] = {30, 5, 90, 1, 130, 70};
+    eventloop_t *el = setup();
+    ev_timer_t *deleted;
+    int i;
+
+    for (i = 0; i < 6; i++)
+        mu_check(el_timer_add(el, delays[i], once, (void *) (long) delays[i]) != NULL);
+    deleted = el_timer_add(el, 50, once, (void *) -1L);
+    /* beyond the last level of the wheel */
+    el_timer_del(el, el_timer_add(el, 1LL << 30, once, (void *) -1L));
+    /* left for el_loop_free */
+    el_timer_add(el, 60000, once, (void *) -1L);
+    el_timer_add(el, 150, stop, NULL);
+    el_timer_del(el, deleted);
+
+    el_main(el);
+    mu_assert_int_eq(6, nfired);
+    mu_assert_int_eq(1, fired[0]);
+    mu_assert_int_eq(5, fired[1]);
+    mu_assert_int_eq(30, fired[2]);
+    mu_assert_int_eq(70, fired[3]);
+    mu_assert_int_eq(90, fired[4]);
+    mu_assert_int_eq(130, fired[5]);
+    for (i = 0; i < 6; i++)
+        mu_check(fired_after[i] >= fired[i]);
+    el_loop_free(el);
+}
+
+static ev_timer_t *victim;
+static int repeats;
+
+static int remove_other(eventloop_t *el, void *ud) {
+    record(ud);
+    el_timer_del(el, victim);
+    return 0;
+}
+
+static int repeat(eventloop_t *el, void *ud) {
+    record(ud);
+    repeats++;
+    /* removed by its own callback, the delay returned is ignored then */
+    if (repeats == 3) el_timer_del(el, victim);
+    return 5;
+}
+
+MU_TEST(test_timer_del_from_callback) {
+    eventloop_t *el = setup();
+
+    /* both fire at the same time, the first one removes the second one */
+    el_timer_add(el, 10, remove_other, (void *) 1L);
+    victim = el_timer_add(el, 10, once, (void *) 2L);
+    el_timer_add(el, 40, stop, NULL);
+    el_main(el);
+    mu_assert_int_eq(1, nfired);
+    mu_assert_int_eq(1, fired[0]);
+
+    nfired = 0;
+    repeats = 0;
+    el->stop = 0;
+    victim = el_timer_add(el, 5, repeat, (void *) 3L);
+    el_timer_add(el, 60, stop, NULL);
+    el_main(el);
+    mu_assert_int_eq(3, nfired);
+    mu_assert_int_eq(3, repeats);
+    el_loop_free(el);
+}
+
+MU_TEST(test_timer_cascade) {
+    /* the levels up to the last one, and beyond it */
+    static const long long delays[] = {300000, 4096, 1LL << 25, 70, 5000, 4095};
+    static const long long steps[] = {4095, 4096, 4999, 5000, 299999, 300000,
+                                      (1LL << 25) - 1, 1LL << 25};
+    static const int expected[] = {2, 3, 3, 4, 4, 5, 5, 6};
+    eventloop_t *el = setup();
+    long long base = el->now;
+    int i;
+
+    for (i = 0; i < 6; i++)
+        el_timer_add(el, delays[i], once, (void *) (long) delays[i]);
+
+    /* time is forged, so that the timers fire neither early nor late */
+    for (i = 0; i < 8; i++) {
+        el->now = base + steps[i];
+        el_timer_process(el);
+        mu_assert_int_eq(expected[i], nfired);
+    }
+    mu_assert_int_eq(70, fired[0]);
+    mu_assert_int_eq(4095, fired[1]);
+    mu_assert_int_eq(4096, fired[2]);
+    mu_assert_int_eq(5000, fired[3]);
+    mu_assert_int_eq(300000, fired[4]);
+    mu_assert_int_eq(1 << 25, fired[5]);
+    el_loop_free(el);
+}
+
+/* Echo of a stream read and written through the loop, the peer being driven
+ * by a timer */
+#define ECHO_LEN (256*1024)
+
+static char payload[ECHO_LEN], echoed[ECHO_LEN], pending[ECHO_LEN];
+static int npending, echo_eof, peer_sent, peer_recv, peer_eof;
+
+static void echo_flush(eventloop_t *el, int fd) {
+    struct iovec iov;
+    ssize_t n;
+
+    iov.iov_base = pending;
+    iov.iov_len = npending;
+    if (npending && (n = el_writev(el, fd, &iov, 1)) > 0) {
+        memmove(pending, pending + n, npending - n);
+        npending -= n;
+    }
+    if (npending) return;
+    el_event_del(el, fd, RR_EV_WRITE);
+    /* what is queued is still sent */
+    if (echo_eof) {
+        el_event_del(el, fd, RR_EV_READ);
+        el_close(el, fd);
+    }
+}
+
+static void echo_write(eventloop_t *el, int fd, void *ud, int mask) {
+    UNUSED(ud);
+    UNUSED(mask);
+    echo_flush(el, fd);
+}
+
+static void echo_read(eventloop_t *el, int fd, void *ud, int mask) {
+    ssize_t n;
+    UNUSED(ud);
+    UNUSED(mask);
+
+    /* a small read, the rest has to fire the event again */
+    n = el_read(el, fd, pending + npending, 1000);
+    if (n > 0) npending += n;
+    else if (n == 0) echo_eof = 1;
+    else return;
+    if (el_event_get(el, fd) & RR_EV_WRITE) return;
+    if (npending || echo_eof) echo_flush(el, fd);
+    if (npending) el_event_add(el, fd, RR_EV_WRITE, echo_write, NULL);
+}
+
+static int echo_peer(eventloop_t *el, void *ud) {
+    int fd = (int) (long) ud;
+    ssize_t n;
+
+    if (peer_sent < ECHO_LEN && (n = write(fd, payload + peer_sent, ECHO_LEN - peer_sent)) > 0) {
+        peer_sent += n;
+        if (peer_sent == ECHO_LEN) shutdown(fd, SHUT_WR);
+    }
+    /* read once done writing, so that the echo is still queued to send when
+     * the end of the stream closes it */
+    if (peer_sent < ECHO_LEN) return 1;
+    while ((n = read(fd, echoed + peer_recv, ECHO_LEN - peer_recv)) > 0)
+        peer_recv += n;
+    if (n == 0 && peer_recv == ECHO_LEN) {
+        peer_eof = 1;
+        el_loop_stop(el);
+        return 0;
+    }
+    return 1;
+}
+
+MU_TEST(test_stream_echo) {
+    eventloop_t *el = setup();
+    int sv[2], i;
+
+    for (i = 0; i < ECHO_LEN; i++)
+        payload[i] = (char) (i*7);
+    npending = echo_eof = peer_sent = peer_recv = peer_eof = 0;
+    mu_check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    mu_check(el_stream_open(el, sv[0]) == RR_EV_OK);
+    mu_check(el_event_add(el, sv[0], RR_EV_READ, echo_read, NULL) == RR_EV_OK);
+    el_timer_add(el, 1, echo_peer, (void *) (long) sv[1]);
+    el_timer_add(el, 10000, stop, NULL);
+
+    el_main(el);
+    mu_check(peer_eof);
+    mu_assert_int_eq(ECHO_LEN, peer_recv);
+    mu_check(memcmp(payload, echoed, ECHO_LEN) == 0);
+    close(sv[1]);
+    el_loop_free(el);
+}
+
+/* Writes by reference, framed as the replies of large values: a header and
+ * a trailer copied around a chunk of the payload referenced, which the loop
+ * holds until it is sent */
+#define REF_CHUNK (64*1024)
+#define REF_HEAD "$65536\r\n"
+#define REF_FRAME (REF_CHUNK + 8 + 2)
+#define REF_CHUNKS 3
+
+static int ref_holds, ref_releases, ref_written;
+
+static void ref_hold(void *ref) {
+    UNUSED(ref);
+    ref_holds++;
+}
+
+static void ref_release(void *ref) {
+    UNUSED(ref);
+    ref_releases++;
+}
+
+static void ref_write(eventloop_t *el, int fd, void *ud, int mask) {
+    struct iovec frame[3], iov[3];
+    void *refs[3];
+    size_t skip = ref_written % REF_FRAME;
+    ssize_t n;
+    int i, iovcnt = 0;
+    UNUSED(ud);
+    UNUSED(mask);
+
+    frame[0].iov_base = REF_HEAD;
+    frame[0].iov_len = 8;
+    frame[1].iov_base = payload + (ref_written/REF_FRAME)*REF_CHUNK;
+    frame[1].iov_len = REF_CHUNK;
+    frame[2].iov_base = "\r\n";
+    frame[2].iov_len = 2;
+    /* the rest of the current frame */
+    for (i = 0; i < 3; i++) {
+        if (skip >= frame[i].iov_len) {
+            skip -= frame[i].iov_len;
+            continue;
+        }
+        iov[iovcnt].iov_base = (char *) frame[i].iov_base + skip;
+        iov[iovcnt].iov_len = frame[i].iov_len - skip;
+        refs[iovcnt++] = i == 1 ? payload : NULL;
+        skip = 0;
+    }
+    if ((n = el_writev_ref(el, fd, iov, refs, iovcnt)) > 0) ref_written += n;
+    if (ref_written == REF_FRAME*REF_CHUNKS) {
+        el_event_del(el, fd, RR_EV_WRITE);
+        el_close(el, fd);
+    }
+}
+
+static int ref_peer(eventloop_t *el, void *ud) {
+    int fd = (int) (long) ud;
+    ssize_t n;
+
+    while ((n = read(fd, echoed + peer_recv, ECHO_LEN - peer_recv)) > 0)
+        peer_recv += n;
+    if (n == 0) {
+        peer_eof = 1;
+        el_loop_stop(el);
+        return 0;
+    }
+    return 1;
+}
+
+MU_TEST(test_stream_write_ref) {
+    eventloop_t *el = setup();
+    int sv[2], i;
+
+    for (i = 0; i < ECHO_LEN; i++)
+        payload[i] = (char) (i*13);
+    ref_holds = ref_releases = ref_written = peer_recv = peer_eof = 0;
+    mu_check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fcntl(sv[1], F_SETFL, O_NONBLOCK);
+    el_loop_set_ref_procs(el, ref_hold, ref_release);
+    mu_check(el_stream_open(el, sv[0]) == RR_EV_OK);
+    mu_check(el_event_add(el, sv[0], RR_EV_WRITE, ref_write, NULL) == RR_EV_OK);
+    el_timer_add(el, 1, ref_peer, (void *) (long) sv[1]);
+    el_timer_add(el, 10000, stop, NULL);
+
+    el_main(el);
+    mu_check(peer_eof);
+    mu_assert_int_eq(REF_FRAME*REF_CHUNKS, peer_recv);
+    for (i = 0; i < REF_CHUNKS; i++) {
+        char *frame = echoed + i*REF_FRAME;
+
+        mu_check(memcmp(frame, REF_HEAD, 8) == 0);
+        mu_check(memcmp(frame + 8, payload + i*REF_CHUNK, REF_CHUNK) == 0);
+        mu_check(memcmp(frame + 8 + REF_CHUNK, "\r\n", 2) == 0);
+    }
+    /* only io_uring sends from the referenced data, and drops every
+     * reference it took once sent */
+    if (strcmp(el_loop_backend(el), "io_uring") == 0) mu_check(ref_holds > 0);
+    else mu_assert_int_eq(0, ref_holds);
+    mu_assert_int_eq(ref_holds, ref_releases);
+    close(sv[1]);
+    el_loop_free(el);
+}
+
+/* A stream closed while its peer never reads, whatever is left to send is
+ * given up at some point for the fd to be closed */
+static int stuck_fd, stuck_idle;
+static long long stuck_closed_at, stuck_gone_at;
+
+static int stuck_check(eventloop_t *el, void *ud) {
+    UNUSED(ud);
+    if (fcntl(stuck_fd, F_GETFD) != -1 || errno != EBADF) return 10;
+    stuck_gone_at = rr_dt_monotonic_ms();
+    el_loop_stop(el);
+    return 0;
+}
+
+static int stuck_writer(eventloop_t *el, void *ud) {
+    struct iovec iov;
+    ssize_t n;
+    UNUSED(ud);
+
+    iov.iov_base = payload;
+    iov.iov_len = ECHO_LEN;
+    while ((n = el_writev(el, stuck_fd, &iov, 1)) > 0)
+        stuck_idle = 0;
+    /* the socket buffer is full once the writes make no progress for a while */
+    if (++stuck_idle < 20) return 1;
+    el_close(el, stuck_fd);
+    stuck_closed_at = rr_dt_monotonic_ms();
+    el_timer_add(el, 1, stuck_check, NULL);
+    return 0;
+}
+
+MU_TEST(test_stream_close_stuck) {
+    eventloop_t *el = setup();
+    int sv[2];
+
+    stuck_idle = 0;
+    stuck_closed_at = stuck_gone_at = 0;
+    mu_check(socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == 0);
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    stuck_fd = sv[0];
+    mu_check(el_stream_open(el, sv[0]) == RR_EV_OK);
+    el_timer_add(el, 1, stuck_writer, NULL);
+    el_timer_add(el, 10000, stop, NULL);
+
+    el_main(el);
+    mu_check(stuck_closed_at != 0);
+    mu_check(stuck_gone_at != 0);
+    mu_check(stuck_gone_at - stuck_closed_at < 5000);
+    close(sv[1]);
+    el_loop_free(el);
+}
+
+MU_TEST(test_monotonic_clock) {
+    long long prev, now;
+    int i, backwards = 0;
+
+    rr_dt_monotonic_init();
+    prev = rr_dt_monotonic_us();
+    for (i = 0; i < 100000; i++) {
+        now = rr_dt_monotonic_us();
+        if (now < prev) backwards++;
+        prev = now;
+    }
+    mu_assert_int_eq(0, backwards);
+    /* runs as fast as the clock of the system */
+    prev = rr_dt_monotonic_us();
+    now = rr_dt_ustime();
+    usleep(50000);
+    prev = rr_dt_monotonic_us() - prev;
+    now = rr_dt_ustime() - now;
+    mu_check(prev >= 45000 && prev <= now + 5000);
+}
+
+MU_TEST_SUITE(test_suite) {
+    MU_RUN_TEST(test_monotonic_clock);
+}
+
+MU_TEST_SUITE(test_loop_suite) {
+    MU_RUN_TEST(test_timer_order);
+    MU_RUN_TEST(test_timer_del_from_callback);
+    MU_RUN_TEST(test_timer_cascade);
+    MU_RUN_TEST(test_stream_echo);
+    MU_RUN_TEST(test_stream_write_ref);
+    MU_RUN_TEST(test_stream_close_stuck);
+}
+
+int main(int argc, char *argv[]) {
+    UNUSED(argc);
+    UNUSED(argv);
+    MU_RUN_SUITE(test_suite);
+    MU_RUN_SUITE(test_loop_suite);
+    /* falls back to the default backend where io_uring is not available */
+    backend = RR_EV_BACKEND_IO_URING;
+    MU_RUN_SUITE(test_loop_suite);
+    MU_REPORT();
+    return 0;
+}